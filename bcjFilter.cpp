@@ -0,0 +1,154 @@
+/* PatchMaker utility, Copyright (c) 1997-2020 Yuriy Yakimenko
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation.  No representations are made about the suitability of this
+ * software for any purpose.  It is provided "as is" without express or
+ * implied warranty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "bcjFilter.h"
+
+#define FILTER_BUFFER_SIZE (1L << 20)
+
+int branchFilterByName (const char *name)
+{
+    if (strcmp (name, "x86") == 0) return FILTER_X86;
+    if (strcmp (name, "arm64") == 0) return FILTER_ARM64;
+
+    return FILTER_NONE;
+}
+
+const char * branchFilterName (int filter)
+{
+    return filter == FILTER_X86 ? "x86" : (filter == FILTER_ARM64 ? "arm64" : "none");
+}
+
+// x86 and x86-64: CALL (E8) and JMP (E9) with 32-bit displacement. Only
+// displacements within +-16MB are converted (most significant byte 00 or FF),
+// arithmetic is done on 25 bits and sign extended, so converted value again
+// has 00 or FF in its top byte and conversion is reversible. Operand bytes are
+// skipped, opcode bytes are never changed, so both directions see the same
+// instruction boundaries.
+static size_t filterX86 (unsigned char *buf, size_t len, uint32_t pos, bool encode)
+{
+    size_t i = 0;
+
+    for (; i + 5 <= len; )
+    {
+        if (buf[i] != 0xE8 && buf[i] != 0xE9)
+        {
+            i++;
+            continue;
+        }
+
+        unsigned char *p = buf + i + 1;
+
+        if (p[3] == 0x00 || p[3] == 0xFF)
+        {
+            uint32_t value = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+            uint32_t next = pos + (uint32_t)i + 5;
+
+            value = encode ? value + next : value - next;
+
+            value &= 0x01FFFFFF;
+            value |= 0U - (value & 0x01000000);
+
+            p[0] = (unsigned char)value;
+            p[1] = (unsigned char)(value >> 8);
+            p[2] = (unsigned char)(value >> 16);
+            p[3] = (unsigned char)(value >> 24);
+        }
+
+        i += 5;
+    }
+
+    return i;
+}
+
+// ARM64: BL instruction, 26-bit word displacement in 4-byte aligned words.
+static size_t filterArm64 (unsigned char *buf, size_t len, uint32_t pos, bool encode)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= len; i += 4)
+    {
+        uint32_t insn = (uint32_t)buf[i] | ((uint32_t)buf[i + 1] << 8) | ((uint32_t)buf[i + 2] << 16) | ((uint32_t)buf[i + 3] << 24);
+
+        if ((insn >> 26) != 0x25) continue;
+
+        uint32_t word = (pos + (uint32_t)i) >> 2;
+        uint32_t imm = encode ? insn + word : insn - word;
+
+        insn = (insn & 0xFC000000) | (imm & 0x03FFFFFF);
+
+        buf[i] = (unsigned char)insn;
+        buf[i + 1] = (unsigned char)(insn >> 8);
+        buf[i + 2] = (unsigned char)(insn >> 16);
+        buf[i + 3] = (unsigned char)(insn >> 24);
+    }
+
+    return i;
+}
+
+size_t branchFilter (int filter, unsigned char *buf, size_t len, uint32_t pos, bool encode)
+{
+    if (filter == FILTER_X86) return filterX86 (buf, len, pos, encode);
+    if (filter == FILTER_ARM64) return filterArm64 (buf, len, pos, encode);
+
+    return len;
+}
+
+void branchFilterImage (int filter, unsigned char *image, size_t len, bool encode)
+{
+    branchFilter (filter, image, len, 0, encode);
+}
+
+int branchFilterFile (int filter, FILE *in, FILE *out, bool encode)
+{
+    std::vector<unsigned char> buffer (FILTER_BUFFER_SIZE);
+
+    long readPos = ftell (in), writePos = ftell (out);
+    uint32_t pos = 0;     // file offset of buffer start, relative to initial position.
+    size_t kept = 0;      // bytes carried over to following data.
+
+    if (readPos < 0 || writePos < 0) return -1;
+
+    for (bool end = false; !end; )
+    {
+        if (0 != fseek (in, readPos, SEEK_SET)) return -1;
+
+        size_t got = fread (buffer.data() + kept, 1, buffer.size() - kept, in);
+
+        if (got < buffer.size() - kept)
+        {
+            if (ferror (in)) return -1;
+            end = true;
+        }
+
+        readPos += (long)got;
+
+        size_t len = kept + got;
+        size_t done = end ? len : branchFilter (filter, buffer.data(), len, pos, encode);
+
+        if (end) branchFilter (filter, buffer.data(), len, pos, encode);
+
+        if (0 != fseek (out, writePos, SEEK_SET) || (done > 0 && fwrite (buffer.data(), done, 1, out) != 1)) return -1;
+
+        writePos += (long)done;
+        pos += (uint32_t)done;
+
+        kept = len - done;
+        memmove (buffer.data(), buffer.data() + done, kept);
+    }
+
+    return (fflush (out) == 0) ? 0 : -1;
+}
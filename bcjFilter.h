@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Branch converters for executables (BCJ). Relative call/jump displacements
+// change all over a recompiled binary whenever code moves; converted to absolute
+// targets they stay the same, so such code matches again. Conversion is done on
+// both files before creating a patch and reverted after applying it.
+enum BranchFilter { FILTER_NONE = 0, FILTER_X86 = 1, FILTER_ARM64 = 2 };
+
+// returns filter for name ("x86" or "arm64"), or FILTER_NONE when unknown.
+int branchFilterByName (const char *name);
+
+const char * branchFilterName (int filter);
+
+// converts branches in buf, which is data of the file at offset pos. returns
+// number of bytes done; the rest (at most 4 bytes) must be passed again along
+// with following data, or is left as is at the end of file.
+size_t branchFilter (int filter, unsigned char *buf, size_t len, uint32_t pos, bool encode);
+
+// converts entire file image.
+void branchFilterImage (int filter, unsigned char *image, size_t len, bool encode);
+
+// converts file from current position of in to out (may be the same file,
+// then converted data is written back in place). returns zero on success.
+int branchFilterFile (int filter, FILE *in, FILE *out, bool encode);
@@ -0,0 +1,641 @@
+/* PatchMaker utility, Copyright (c) 1997-2020 Yuriy Yakimenko
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation.  No representations are made about the suitability of this
+ * software for any purpose.  It is provided "as is" without express or
+ * implied warranty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm> // min, max
+
+#ifndef _MSC_VER
+#include <unistd.h>
+#include <sys/mman.h>
+#else
+#include <process.h>
+#endif
+
+#include "common.h"
+#include "checksum.h"
+#include "blockIndex.h"
+
+#define INDEX_CACHE_VERSION 4
+#define CHECKSUM_CACHE_VERSION 1
+
+// cache file header. Followed by slots, block ids, filter words (8-byte aligned)
+// and block fingerprints.
+struct BlockIndex::Header
+{
+    char     magic[4];      // "FOCI"
+    uint32_t version;
+    uint64_t fileSize;      // file1 identity
+    int64_t  mtimeSec;
+    int64_t  mtimeNsec;
+    uint64_t inode;
+    uint32_t checksum;
+    uint32_t endianness;
+    uint32_t blockSize;
+    uint32_t blockCount;
+    uint32_t slotBits;
+    uint32_t entryCount;
+    uint32_t filterBits;    // log2 of filter word count.
+    uint32_t partitionBits; // log2 of partition count, probing wraps within partition.
+};
+
+int getBaseFileKey (const char *filename, BaseFileKey & key)
+{
+    struct stat buf;
+
+    if (0 != stat (filename, &buf)) return -1;
+
+    key.fileSize = (uint64_t)buf.st_size;
+    key.mtimeSec = (int64_t)buf.st_mtime;
+    key.ctimeSec = (int64_t)buf.st_ctime;
+#if defined(__linux__)
+    key.mtimeNsec = (int64_t)buf.st_mtim.tv_nsec;
+    key.ctimeNsec = (int64_t)buf.st_ctim.tv_nsec;
+#elif defined(__APPLE__)
+    key.mtimeNsec = (int64_t)buf.st_mtimespec.tv_nsec;
+    key.ctimeNsec = (int64_t)buf.st_ctimespec.tv_nsec;
+#else
+    key.mtimeNsec = 0;
+    key.ctimeNsec = 0;
+#endif
+    key.inode = (uint64_t)buf.st_ino;
+
+    return 0;
+}
+
+// checksum sidecar file.
+struct ChecksumCache
+{
+    char     magic[4];      // "FOCC"
+    uint32_t version;
+    uint64_t fileSize;
+    int64_t  mtimeSec;
+    int64_t  mtimeNsec;
+    int64_t  ctimeSec;
+    int64_t  ctimeNsec;
+    uint64_t inode;
+    uint32_t checksum;
+    uint32_t endianness;
+};
+
+static bool sameFile (const BaseFileKey & a, const BaseFileKey & b)
+{
+    return a.fileSize == b.fileSize && a.mtimeSec == b.mtimeSec && a.mtimeNsec == b.mtimeNsec &&
+           a.ctimeSec == b.ctimeSec && a.ctimeNsec == b.ctimeNsec && a.inode == b.inode;
+}
+
+static int checksumCacheName (const char *filename, char *szName, size_t len)
+{
+    return (snprintf (szName, len, "%s.fcc", filename) < (int)len) ? 0 : -1;
+}
+
+// creates temporary file to be renamed to name once written. Its name is unique,
+// so concurrent runs never write the same one. returns NULL on failure.
+static FILE *createTemporary (const char *name, char *szTemp, size_t len)
+{
+#ifndef _MSC_VER
+    if (snprintf (szTemp, len, "%s.XXXXXX", name) >= (int)len) return NULL;
+
+    int handle = mkstemp (szTemp);
+
+    if (handle == -1) return NULL;
+
+    FILE *fp = (0 == fchmod (handle, 0644)) ? fdopen (handle, "wb") : NULL;
+
+    if (fp == NULL)
+    {
+        close (handle);
+        remove (szTemp);
+    }
+
+    return fp;
+#else
+    if (snprintf (szTemp, len, "%s.%d.tmp", name, _getpid ()) >= (int)len) return NULL;
+
+    return fopen (szTemp, "wb");
+#endif
+}
+
+// writes sidecar for file with given identity. returns zero on success.
+static int saveChecksumCache (const char *filename, const BaseFileKey & key)
+{
+    char szName [PATH_MAX], szTemp [PATH_MAX];
+
+    if (0 != checksumCacheName (filename, szName, sizeof (szName))) return -1;
+
+    ChecksumCache cache;
+
+    memset (&cache, 0, sizeof (cache));
+    memcpy (cache.magic, "FOCC", 4);
+    cache.version = CHECKSUM_CACHE_VERSION;
+    cache.fileSize = key.fileSize;
+    cache.mtimeSec = key.mtimeSec;
+    cache.mtimeNsec = key.mtimeNsec;
+    cache.ctimeSec = key.ctimeSec;
+    cache.ctimeNsec = key.ctimeNsec;
+    cache.inode = key.inode;
+    cache.checksum = key.checksum;
+    cache.endianness = getEndianness();
+
+    // write to temporary file first, so concurrent runs never see partial sidecar.
+    FILE *fp = createTemporary (szName, szTemp, sizeof (szTemp));
+
+    if (fp == NULL) return -1;
+
+    bool ok = (fwrite (&cache, sizeof (cache), 1, fp) == 1);
+
+    if (fclose (fp) != 0) ok = false;
+
+    if (ok && rename (szTemp, szName) != 0) ok = false;
+
+    if (!ok) remove (szTemp);
+
+    return ok ? 0 : -1;
+}
+
+// gets CRC of file along with its identity, see getFileChecksum. identified tells
+// whether key is that of the file the CRC belongs to. returns zero on success.
+static int checksumWithKey (const char *filename, FILE *fp, bool paranoid, BaseFileKey & key, bool & cached,
+            bool & identified, bool save)
+{
+    cached = identified = false;
+
+    key = BaseFileKey ();
+
+    bool known = (0 == getBaseFileKey (filename, key));
+
+    char szName [PATH_MAX];
+
+    if (known && !paranoid && 0 == checksumCacheName (filename, szName, sizeof (szName)))
+    {
+        FILE *fc = fopen (szName, "rb");
+
+        if (fc)
+        {
+            ChecksumCache cache;
+
+            BaseFileKey saved;
+
+            if (fread (&cache, sizeof (cache), 1, fc) == 1 && memcmp (cache.magic, "FOCC", 4) == 0 &&
+                cache.version == CHECKSUM_CACHE_VERSION && cache.endianness == getEndianness())
+            {
+                saved.fileSize = cache.fileSize;
+                saved.mtimeSec = cache.mtimeSec;
+                saved.mtimeNsec = cache.mtimeNsec;
+                saved.ctimeSec = cache.ctimeSec;
+                saved.ctimeNsec = cache.ctimeNsec;
+                saved.inode = cache.inode;
+
+                cached = sameFile (key, saved);
+            }
+
+            fclose (fc);
+
+            if (cached)
+            {
+                key.checksum = cache.checksum;
+                identified = true;
+                return 0;
+            }
+        }
+    }
+
+    if (0 != getChecksum (fp, key.checksum)) return -1;
+
+    // file must not have changed while it was read.
+    BaseFileKey after;
+
+    identified = known && 0 == getBaseFileKey (filename, after) && sameFile (key, after);
+
+    if (save && identified) (void)saveChecksumCache (filename, key);
+
+    return 0;
+}
+
+int getFileChecksum (const char *filename, FILE *fp, bool paranoid, uint32_t & checksum, bool & cached, bool save)
+{
+    BaseFileKey key;
+
+    bool identified = false;
+
+    if (0 != checksumWithKey (filename, fp, paranoid, key, cached, identified, save)) return -1;
+
+    checksum = key.checksum;
+
+    return 0;
+}
+
+int getFileKey (const char *filename, FILE *fp, bool paranoid, BaseFileKey & key, bool & cached, bool save)
+{
+    bool identified = false;
+
+    return (0 == checksumWithKey (filename, fp, paranoid, key, cached, identified, save) && identified) ? 0 : -1;
+}
+
+void saveFileChecksum (const char *filename, uint32_t checksum)
+{
+    BaseFileKey key;
+
+    if (0 != getBaseFileKey (filename, key)) return;
+
+    key.checksum = checksum;
+    (void)saveChecksumCache (filename, key);
+}
+
+// filter words follow block ids.
+size_t BlockIndex::filterOffset (uint32_t slotBits, uint32_t count)
+{
+    size_t offset = sizeof (Header) + (sizeof (BlockIndexSlot) << slotBits) + sizeof (uint32_t) * count;
+
+    return (offset + 7) & ~(size_t)7;
+}
+
+// block fingerprints follow filter words.
+size_t BlockIndex::storageSizeOf (uint32_t slotBits, uint32_t entryCount, uint32_t filterBits, uint32_t blockCount)
+{
+    return filterOffset (slotBits, entryCount) + (sizeof (uint64_t) << filterBits) + sizeof (uint32_t) * blockCount;
+}
+
+void BlockIndex::attach ()
+{
+    header = (const Header *)storage;
+    slots = (const BlockIndexSlot *)((const char *)storage + sizeof (Header));
+    entries = (const uint32_t *)(slots + (1UL << header->slotBits));
+    filter = (const uint64_t *)((const char *)storage + filterOffset (header->slotBits, header->entryCount));
+    prints = (const uint32_t *)(filter + (1UL << header->filterBits));
+    slotShift = 32 - header->slotBits;
+    partMask = (1U << (header->slotBits - header->partitionBits)) - 1;
+    filterShift = 32 - header->filterBits;
+}
+
+void BlockIndex::release ()
+{
+    if (storage)
+    {
+#ifndef _MSC_VER
+        if (mapped)
+            munmap (storage, storageSize);
+        else
+#endif
+            free (storage);
+    }
+
+    storage = nullptr;
+    storageSize = 0;
+    mapped = false;
+    header = nullptr;
+    slots = nullptr;
+    entries = nullptr;
+    filter = nullptr;
+    prints = nullptr;
+}
+
+// keeps load factor under 2/3 even when all checksums are unique.
+static uint32_t slotBitsFor (uint32_t count)
+{
+    uint32_t slotBits = 1;
+
+    while ((1UL << slotBits) < (unsigned long)count + count / 2 + 1) slotBits++;
+
+    return slotBits;
+}
+
+// about 8 filter bits per block, at least two words.
+static uint32_t filterBitsFor (uint32_t count)
+{
+    uint32_t filterBits = 1;
+
+    while ((1UL << filterBits) < (unsigned long)count / 8) filterBits++;
+
+    return filterBits;
+}
+
+// threads actually used by build for count blocks.
+static int threadsFor (uint32_t count, int threads)
+{
+    return (std::max)(1, (std::min)(threads, (int)(count / 65536) + 1));
+}
+
+// top bits of slot hash partitioning blocks, enough for several partitions per thread.
+static uint32_t partitionBitsFor (int threads, uint32_t slotBits, uint32_t filterBits)
+{
+    uint32_t partitionBits = 0;
+
+    while (threads > 1 && (1 << partitionBits) < threads * 4 && partitionBits < 8 &&
+           partitionBits + 10 < slotBits && partitionBits < filterBits) partitionBits++;
+
+    return partitionBits;
+}
+
+// probing wraps within partition, so each of them (largest blocks at most) has
+// to stay under 2/3 full.
+static uint32_t partitionedSlotBits (uint32_t slotBits, uint32_t partitionBits, uint32_t largest)
+{
+    while ((1UL << (slotBits - partitionBits)) < (unsigned long)largest + largest / 2 + 1) slotBits++;
+
+    return slotBits;
+}
+
+// partitions are filled by a hash, so the largest one is taken as 4 standard
+// deviations above the average.
+size_t BlockIndex::estimateSize (uint32_t count, int threads)
+{
+    uint32_t slotBits = slotBitsFor (count), filterBits = filterBitsFor (count);
+    uint32_t partitionBits = partitionBitsFor (threadsFor (count, threads), slotBits, filterBits);
+
+    double average = (double)count / (1U << partitionBits);
+    uint32_t largest = (uint32_t)(std::min)((double)count, average + 4 * sqrt (average) + 1);
+
+    return storageSizeOf (partitionedSlotBits (slotBits, partitionBits, largest), count, filterBits, count);
+}
+
+// runs fn(0) ... fn(threads - 1) in parallel.
+template <typename Fn> static void runThreads (int threads, Fn fn)
+{
+    std::vector<std::thread> workers;
+
+    for (int t = 1; t < threads; t++) workers.push_back (std::thread (fn, t));
+
+    fn (0);
+
+    for (auto & th : workers) th.join();
+}
+
+// Blocks are radix partitioned by top bits of their slot hash, so every partition
+// owns a contiguous range of slots, filter words and block ids, and partitions are
+// filled by separate threads. Block ranges of threads are ascending and scattered
+// in order, which keeps block ids of every checksum in ascending order.
+int BlockIndex::build (const uint32_t *sums, const uint32_t *fingerprints, uint32_t count, uint32_t first, uint32_t last,
+                       uint32_t blockSize, int threads)
+{
+    release ();
+
+    const uint32_t entryCount = last - first;
+
+    threads = threadsFor (entryCount, threads);
+
+    uint32_t slotBits = slotBitsFor (entryCount), filterBits = filterBitsFor (entryCount);
+    uint32_t partitionBits = partitionBitsFor (threads, slotBits, filterBits);
+
+    const uint32_t partitions = 1U << partitionBits;
+
+    auto partitionOf = [partitionBits] (uint32_t key) -> uint32_t {
+        return partitionBits ? (uint32_t)(key * 2654435761U) >> (32 - partitionBits) : 0;
+    };
+
+    // per thread block counts of every partition.
+    std::vector<uint32_t> counts ((size_t)threads * partitions, 0);
+
+    runThreads (threads, [&] (int t) {
+        uint32_t *own = &counts[(size_t)t * partitions];
+
+        for (uint32_t i = first + (uint32_t)((uint64_t)entryCount * t / threads); i < first + (uint64_t)entryCount * (t + 1) / threads; i++)
+        {
+            own[partitionOf (sums[i])]++;
+        }
+    });
+
+    // partition start in block ids, per thread scatter cursors.
+    std::vector<uint32_t> starts (partitions + 1, 0), cursors ((size_t)threads * partitions);
+
+    uint32_t largest = 0;
+
+    for (uint32_t p = 0; p < partitions; p++)
+    {
+        uint32_t offset = starts[p];
+
+        for (int t = 0; t < threads; t++)
+        {
+            cursors[(size_t)t * partitions + p] = offset;
+            offset += counts[(size_t)t * partitions + p];
+        }
+
+        starts[p + 1] = offset;
+        largest = (std::max)(largest, offset - starts[p]);
+    }
+
+    slotBits = partitionedSlotBits (slotBits, partitionBits, largest);
+
+    storageSize = storageSizeOf (slotBits, entryCount, filterBits, count);
+
+    storage = calloc (1, storageSize);
+
+    if (storage == nullptr)
+    {
+        storageSize = 0;
+        return -1;
+    }
+
+    Header *hdr = (Header *)storage;
+
+    memcpy (hdr->magic, "FOCI", 4);
+    hdr->version = INDEX_CACHE_VERSION;
+    hdr->endianness = getEndianness();
+    hdr->blockSize = blockSize;
+    hdr->blockCount = count;
+    hdr->slotBits = slotBits;
+    hdr->entryCount = entryCount;
+    hdr->filterBits = filterBits;
+    hdr->partitionBits = partitionBits;
+
+    attach ();
+
+    memcpy ((uint32_t *)prints, fingerprints, sizeof (uint32_t) * count);
+
+    // blocks grouped by partition, ascending within each.
+    std::vector<Block> scattered (entryCount);
+
+    runThreads (threads, [&] (int t) {
+        uint32_t *own = &cursors[(size_t)t * partitions];
+
+        for (uint32_t i = first + (uint32_t)((uint64_t)entryCount * t / threads); i < first + (uint64_t)entryCount * (t + 1) / threads; i++)
+        {
+            Block & block = scattered[own[partitionOf (sums[i])]++];
+
+            block.key = sums[i];
+            block.id = i;
+        }
+    });
+
+    std::atomic<uint32_t> next (0);
+
+    runThreads (threads, [&] (int) {
+        for (uint32_t p = next++; p < partitions; p = next++)
+        {
+            fillPartition (p, &scattered[starts[p]], starts[p + 1] - starts[p], starts[p]);
+        }
+    });
+
+    return 0;
+}
+
+// fills slots, filter words and block ids of one partition from its blocks.
+void BlockIndex::fillPartition (uint32_t partition, const Block *blocks, uint32_t count, uint32_t offset)
+{
+    BlockIndexSlot *table = (BlockIndexSlot *)slots;
+    uint32_t *ids = (uint32_t *)entries;
+    uint64_t *words = (uint64_t *)filter;
+
+    const uint32_t first = partition * (partMask + 1), last = first + partMask;
+
+    // first pass: count blocks per checksum.
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t key = blocks[i].key, h = slotOf (key);
+
+        while (table[h].count != 0 && table[h].key != key) h = nextSlot (h);
+
+        table[h].key = key;
+        table[h].count++;
+
+        uint32_t f = key * 0xC2B2AE3DU;
+
+        words[filterWordOf (key)] |= (1ULL << (f >> 26)) | (1ULL << ((f >> 20) & 63));
+    }
+
+    // assign ranges inside entries array. 'first' is used as fill cursor below.
+    for (uint32_t h = first; h <= last; h++)
+    {
+        table[h].first = offset;
+        offset += table[h].count;
+    }
+
+    // second pass: fill block ids, ascending order within every slot is preserved.
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t key = blocks[i].key, h = slotOf (key);
+
+        while (table[h].key != key || table[h].count == 0) h = nextSlot (h);
+
+        ids[table[h].first++] = blocks[i].id;
+    }
+
+    for (uint32_t h = first; h <= last; h++)
+    {
+        table[h].first -= table[h].count;
+    }
+}
+
+int BlockIndex::save (const char *filename, const BaseFileKey & key) const
+{
+    if (storage == nullptr) return -1;
+
+    // write to temporary file first, so concurrent runs never see partial cache.
+    char szTemp [PATH_MAX];
+
+    FILE *fp = createTemporary (filename, szTemp, sizeof (szTemp));
+
+    if (fp == NULL) return -1;
+
+    Header hdr = *header;
+
+    hdr.fileSize = key.fileSize;
+    hdr.mtimeSec = key.mtimeSec;
+    hdr.mtimeNsec = key.mtimeNsec;
+    hdr.inode = key.inode;
+    hdr.checksum = key.checksum;
+
+    bool ok = (fwrite (&hdr, sizeof (hdr), 1, fp) == 1);
+
+    if (ok && fwrite ((const char *)storage + sizeof (Header), storageSize - sizeof (Header), 1, fp) != 1) ok = false;
+
+    if (fclose (fp) != 0) ok = false;
+
+    if (ok && rename (szTemp, filename) != 0) ok = false;
+
+    if (!ok) remove (szTemp);
+
+    return ok ? 0 : -1;
+}
+
+int BlockIndex::map (const char *filename, const BaseFileKey & key, uint32_t blockSize, uint32_t count)
+{
+    release ();
+
+    int handle = open (filename, O_RDONLY);
+
+    if (handle == -1) return -1;
+
+    struct stat buf;
+
+    if (0 != fstat (handle, &buf) || (size_t)buf.st_size < sizeof (Header))
+    {
+        close (handle);
+        return -1;
+    }
+
+    storageSize = (size_t)buf.st_size;
+
+#ifndef _MSC_VER
+    storage = mmap (NULL, storageSize, PROT_READ, MAP_SHARED, handle, 0);
+
+    if (storage == MAP_FAILED)
+    {
+        storage = nullptr;
+    }
+    else
+    {
+        mapped = true;
+    }
+#else
+    storage = malloc (storageSize);
+
+    if (storage && read (handle, storage, (unsigned)storageSize) != (int)storageSize)
+    {
+        free (storage);
+        storage = nullptr;
+    }
+#endif
+
+    close (handle);
+
+    if (storage == nullptr)
+    {
+        storageSize = 0;
+        return -1;
+    }
+
+    const Header *hdr = (const Header *)storage;
+
+    bool valid = memcmp (hdr->magic, "FOCI", 4) == 0 &&
+                 hdr->version == INDEX_CACHE_VERSION &&
+                 hdr->endianness == getEndianness() &&
+                 hdr->fileSize == key.fileSize &&
+                 hdr->mtimeSec == key.mtimeSec &&
+                 hdr->mtimeNsec == key.mtimeNsec &&
+                 hdr->inode == key.inode &&
+                 hdr->checksum == key.checksum &&
+                 hdr->blockSize == blockSize &&
+                 hdr->blockCount == count &&
+                 hdr->entryCount == count &&
+                 hdr->slotBits > 0 && hdr->slotBits < 32 &&
+                 hdr->filterBits > 0 && hdr->filterBits < 32 &&
+                 hdr->partitionBits < hdr->slotBits && hdr->partitionBits <= hdr->filterBits &&
+                 storageSize == storageSizeOf (hdr->slotBits, count, hdr->filterBits, count);
+
+    if (!valid)
+    {
+        release ();
+        return -1;
+    }
+
+    attach ();
+
+    return 0;
+}
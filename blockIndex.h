@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "checksum.h"
+
+// Identity of a base file, used to decide whether a cached index is still valid.
+struct BaseFileKey
+{
+    uint64_t fileSize;
+    int64_t  mtimeSec;
+    int64_t  mtimeNsec;
+    int64_t  ctimeSec;   // status change time, only used for checksum cache.
+    int64_t  ctimeNsec;
+    uint64_t inode;
+    uint32_t checksum;
+
+    BaseFileKey () : fileSize(0), mtimeSec(0), mtimeNsec(0), ctimeSec(0), ctimeNsec(0), inode(0), checksum(0) {}
+};
+
+// fills everything except checksum. returns zero on success.
+int getBaseFileKey (const char *filename, BaseFileKey & key);
+
+// gets CRC of file (open as fp). CRC saved in file.fcc sidecar is reused while
+// size, inode, modification and status change times of the file are the same,
+// unless paranoid is set. Otherwise CRC is computed and saved there (when the
+// directory is writable and save is set). cached tells whether it was reused.
+// returns zero on success.
+int getFileChecksum (const char *filename, FILE *fp, bool paranoid, uint32_t & checksum, bool & cached,
+            bool save = true);
+
+// like getFileChecksum, also gives identity of the file the CRC belongs to in key,
+// without reading the file again. returns zero on success, -1 also when identity
+// is unknown or file changed while it was read.
+int getFileKey (const char *filename, FILE *fp, bool paranoid, BaseFileKey & key, bool & cached, bool save = true);
+
+// saves CRC of file just verified otherwise (e.g. patch output) to its sidecar.
+void saveFileChecksum (const char *filename, uint32_t checksum);
+
+struct BlockIndexSlot
+{
+    uint32_t key;    // block checksum
+    uint32_t first;  // position of the first block id in entries array
+    uint32_t count;  // zero for empty slot
+};
+
+// Flat hash index of file1 blocks: open addressing table of checksums pointing
+// into array of block ids. Block ids with the same checksum are stored in ascending
+// order. A compact Bloom filter (one byte per block, both bits of a key in the same
+// word) answers most lookups of absent checksums without touching the table.
+// Every block also has a strong 32-bit fingerprint, so candidate matches can be
+// compared block by block without reading file1.
+// The whole index lives in one memory region laid out exactly as the cache
+// file, so it can be written out as is and later mapped without any parsing.
+
+struct BlockIndex
+{
+    BlockIndex () : header(nullptr), slots(nullptr), entries(nullptr), filter(nullptr), prints(nullptr),
+                    slotShift(32), partMask(0), filterShift(32), storage(nullptr), storageSize(0), mapped(false) {}
+    ~BlockIndex () { release(); }
+
+    // builds index from per-block checksums and fingerprints (blockFingerprint of
+    // every whole block) using given number of threads. Only blocks [first, last)
+    // of all count are looked up, such index cannot be saved. returns zero on success.
+    int build (const uint32_t *sums, const uint32_t *fingerprints, uint32_t count, uint32_t first, uint32_t last,
+               uint32_t blockSize, int threads = 1);
+
+    // saves index along with file1 identity. returns zero on success.
+    int save (const char *filename, const BaseFileKey & key) const;
+
+    // maps previously saved index. Fails if file is missing or was saved for
+    // a different file1 or block size. returns zero on success.
+    int map (const char *filename, const BaseFileKey & key, uint32_t blockSize, uint32_t count);
+
+    // returns false when there is certainly no block with given checksum.
+    inline bool mayContain (uint32_t key) const
+    {
+        uint32_t h = key * 0xC2B2AE3DU;
+        uint64_t bits = (1ULL << (h >> 26)) | (1ULL << ((h >> 20) & 63));
+
+        return (filter[filterWordOf (key)] & bits) == bits;
+    }
+
+    // hints CPU to load filter word and table slot of a checksum probed soon.
+    inline void prefetch (uint32_t key) const
+    {
+#if defined(__GNUC__)
+        __builtin_prefetch (&filter[filterWordOf (key)]);
+        __builtin_prefetch (&slots[slotOf (key)]);
+#else
+        (void)key;
+#endif
+    }
+
+    // returns ascending block ids for given checksum or nullptr if there are none.
+    inline const uint32_t * find (uint32_t key, uint32_t & count) const
+    {
+        for (uint32_t h = slotOf (key); ; h = nextSlot (h))
+        {
+            const BlockIndexSlot & slot = slots[h];
+
+            if (slot.count == 0) return nullptr;
+
+            if (slot.key == key)
+            {
+                count = slot.count;
+                return entries + slot.first;
+            }
+        }
+    }
+
+    // fingerprint of block id, meaningless for a block not wholly inside file1.
+    inline uint32_t fingerprint (uint32_t id) const { return prints[id]; }
+
+    size_t memorySize () const { return storageSize; }
+
+    // memory taken by index of count blocks, built using given number of threads.
+    static size_t estimateSize (uint32_t count, int threads);
+
+    bool isMapped () const { return mapped; }
+
+private:
+
+    struct Header;
+
+    struct Block { uint32_t key, id; };
+
+    inline uint32_t slotOf (uint32_t key) const
+    {
+        return (uint32_t)(key * 2654435761U) >> slotShift;
+    }
+
+    // linear probing wraps within partition of the slot.
+    inline uint32_t nextSlot (uint32_t h) const
+    {
+        return ((h + 1) & partMask) | (h & ~partMask);
+    }
+
+    // same hash as slot, so every partition has its own range of filter words.
+    inline uint32_t filterWordOf (uint32_t key) const
+    {
+        return (uint32_t)(key * 2654435761U) >> filterShift;
+    }
+
+    void fillPartition (uint32_t partition, const Block *blocks, uint32_t count, uint32_t offset);
+
+    static size_t filterOffset (uint32_t slotBits, uint32_t count);
+    static size_t storageSizeOf (uint32_t slotBits, uint32_t entryCount, uint32_t filterBits, uint32_t blockCount);
+
+    void release ();
+    void attach ();
+
+    const Header *header;
+    const BlockIndexSlot *slots;
+    const uint32_t *entries;
+    const uint64_t *filter;
+    const uint32_t *prints;
+    uint32_t slotShift;
+    uint32_t partMask;
+    uint32_t filterShift;
+
+    void *storage;
+    size_t storageSize;
+    bool mapped;
+
+    BlockIndex (const BlockIndex &);
+    BlockIndex & operator = (const BlockIndex &);
+};
+
+// strong fingerprint of a block of data (truncated xxHash64).
+inline uint32_t blockFingerprint (const void *data, size_t len)
+{
+    return (uint32_t)xxHash64 (data, len, 0x46504349ULL);
+}
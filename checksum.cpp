@@ -6,6 +6,14 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#include <vector>
 
 #include "checksum.h"
 
@@ -23,6 +31,113 @@ static void crc32(const void *data, size_t n_bytes, uint32_t* crc, uint32_t * ta
         *crc = table[(uint8_t)*crc ^ ((uint8_t*)data)[i]] ^ *crc >> 8;
 }
 
+// CRC step over one zero byte is affine over GF(2): x -> M x ^ v. Map of n zero
+// bytes is found by repeated squaring, so holes cost log(n) instead of n.
+struct CrcMap
+{
+    uint32_t col [32];  // images of single bits.
+    uint32_t v;
+
+    uint32_t linear (uint32_t x) const
+    {
+        uint32_t r = 0;
+
+        for (int i = 0; x; i++, x >>= 1) if (x & 1) r ^= col[i];
+
+        return r;
+    }
+
+    uint32_t apply (uint32_t x) const { return linear (x) ^ v; }
+
+    // this map applied after other.
+    CrcMap after (const CrcMap & other) const
+    {
+        CrcMap r;
+
+        for (int i = 0; i < 32; i++) r.col[i] = linear (other.col[i]);
+
+        r.v = apply (other.v);
+
+        return r;
+    }
+};
+
+// crc extended by len zero bytes.
+static uint32_t crc32_zeros (uint32_t crc, uint64_t len, const uint32_t * table)
+{
+    CrcMap step, result;
+
+    for (int i = 0; i < 32; i++)
+    {
+        uint32_t bit = 1U << i;
+
+        step.col[i] = (table[bit & 0xFF] ^ table[0]) ^ (bit >> 8);
+        result.col[i] = bit;
+    }
+
+    step.v = table[0];
+    result.v = 0;
+
+    for (; len; len >>= 1, step = step.after (step))
+    {
+        if (len & 1) result = step.after (result);
+    }
+
+    return result.apply (crc);
+}
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+// reads data extents of file only, holes are accounted as zeros.
+// returns zero on success, -1 on error, 1 when file cannot be read this way.
+static int getSparseChecksum (FILE *fp, uint32_t & checksum, const uint32_t * table)
+{
+    int handle = fileno (fp);
+
+    off_t size = (handle >= 0) ? lseek (handle, 0, SEEK_END) : -1;
+
+    if (size < 0) return 1;
+
+    std::vector<char> buffer (1 << 20);
+
+    uint32_t crc = 0;
+
+    for (off_t pos = 0; pos < size; )
+    {
+        // no data after pos (ENXIO): rest is a hole. Other errors: read as data.
+        off_t data = lseek (handle, pos, SEEK_DATA);
+
+        if (data < 0) data = (errno == ENXIO) ? size : pos;
+
+        if (data > size) data = size;
+
+        if (data > pos) crc = crc32_zeros (crc, (uint64_t)(data - pos), table);
+
+        if (data >= size) break;
+
+        off_t hole = lseek (handle, data, SEEK_HOLE);
+
+        if (hole < 0 || hole > size) hole = size;
+
+        for (pos = data; pos < hole; )
+        {
+            ssize_t r = pread (handle, buffer.data(), (size_t)((hole - pos < (off_t)buffer.size()) ? hole - pos : (off_t)buffer.size()), pos);
+
+            if (r <= 0) return -1;
+
+            crc32 (buffer.data(), (size_t)r, &crc, (uint32_t *)table);
+
+            pos += r;
+        }
+    }
+
+    fseek (fp, 0, SEEK_END);
+
+    checksum = crc;
+
+    return 0;
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////
 // returns zero on success.
 ////////////////////////////////////////////////////////////////////////////
@@ -36,6 +151,13 @@ int getChecksum (FILE *fp, uint32_t & checksum)
 
     fseek (fp, 0, SEEK_SET);
 
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    // holes of sparse files are not read.
+    int ret = getSparseChecksum (fp, checksum, table);
+
+    if (ret <= 0) return ret;
+#endif
+
     char buffer[256];
 
     uint32_t crc = 0;
@@ -51,3 +173,122 @@ int getChecksum (FILE *fp, uint32_t & checksum)
 
     return (0 == ferror(fp)) ? 0 : -1;
 }
+
+uint32_t getBufferChecksum (const void *data, size_t len)
+{
+    uint32_t table [256];
+
+    for(uint32_t i = 0; i < 256; ++i)
+      table[i] = crc32_for_byte(i);
+
+    uint32_t crc = 0;
+
+    crc32(data, len, &crc, table);
+
+    return crc;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// 64-bit xxHash (XXH64) of memory buffer.
+////////////////////////////////////////////////////////////////////////////
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64 (uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64 (const uint8_t *p)
+{
+    uint64_t v;
+    memcpy (&v, p, 8);
+    return v;  // little endian hosts; hashes are only compared on hosts of same endianness.
+}
+
+static inline uint32_t read32 (const uint8_t *p)
+{
+    uint32_t v;
+    memcpy (&v, p, 4);
+    return v;
+}
+
+static inline uint64_t xxhRound (uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64 (acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxhMerge (uint64_t acc, uint64_t val)
+{
+    acc ^= xxhRound (0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t xxHash64 (const void *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+
+    uint64_t h;
+
+    if (len >= 32)
+    {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = xxhRound (v1, read64 (p));
+            v2 = xxhRound (v2, read64 (p + 8));
+            v3 = xxhRound (v3, read64 (p + 16));
+            v4 = xxhRound (v4, read64 (p + 24));
+        }
+
+        h = rotl64 (v1, 1) + rotl64 (v2, 7) + rotl64 (v3, 12) + rotl64 (v4, 18);
+        h = xxhMerge (h, v1);
+        h = xxhMerge (h, v2);
+        h = xxhMerge (h, v3);
+        h = xxhMerge (h, v4);
+    }
+    else
+    {
+        h = seed + PRIME64_5;
+    }
+
+    h += (uint64_t)len;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        h ^= xxhRound (0, read64 (p));
+        h = rotl64 (h, 27) * PRIME64_1 + PRIME64_4;
+    }
+
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)read32 (p) * PRIME64_1;
+        h = rotl64 (h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; p++)
+    {
+        h ^= (*p) * PRIME64_5;
+        h = rotl64 (h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
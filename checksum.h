@@ -5,4 +5,10 @@
 #include <stdlib.h>
 
 // returns zero on success.
-int getChecksum (FILE *fp, uint32_t & checksum);
\ No newline at end of file
+int getChecksum (FILE *fp, uint32_t & checksum);
+
+// same checksum of memory buffer.
+uint32_t getBufferChecksum (const void *data, size_t len);
+
+// 64-bit xxHash of memory buffer.
+uint64_t xxHash64 (const void *data, size_t len, uint64_t seed = 0);
@@ -1,6 +1,51 @@
 #include <string.h>
+#include <errno.h>
+
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
 #include "common.h"
 
+size_t getFileHoles (int handle, long size, std::vector<FileHole> & holes)
+{
+    holes.clear ();
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    off_t saved = lseek (handle, 0, SEEK_CUR);
+
+    if (saved < 0) return 0;
+
+    for (long pos = 0; pos < size; )
+    {
+        off_t hole = lseek (handle, pos, SEEK_HOLE);
+
+        if (hole < 0 || hole >= size) break;
+
+        // no data after hole (ENXIO): it lasts up to end of file.
+        off_t data = lseek (handle, hole, SEEK_DATA);
+
+        if (data < 0 && errno != ENXIO) break;
+
+        long end = (data < 0 || data > size) ? size : (long)data;
+
+        if (end - (long)hole >= FILE_HOLE_MIN)
+        {
+            FileHole item = { (long)hole, end };
+            holes.push_back (item);
+        }
+
+        pos = end;
+    }
+
+    lseek (handle, saved, SEEK_SET);
+#else
+    (void)handle; (void)size;
+#endif
+
+    return holes.size();
+}
+
 static bool is_big_endian(void)
 {
     union {
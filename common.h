@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <vector>
+
 #ifdef _MSC_VER
 #include <io.h>
 #define strdup _strdup
@@ -12,6 +14,8 @@
 #define close _close
 #define F_OK  0
 #define O_ACCMODE 0
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
 #endif
 
 #ifdef _MSC_VER
@@ -24,9 +28,27 @@
 #include <limits.h>
 #endif
 
-#define _VERSION_   1
+#define _VERSION_   3
 #define BYTE_PATCH_EOF 8  // end of patch indicator.
 #define BYTE_PATCH_SEQ 4  // sequence of identical bytes (e.g. AAAAAA).
+#define BYTE_PATCH_SELF 12 // copy of output already written (version 2).
+#define BYTE_PATCH_RUN 0x14 // long run of repeated 1-16 byte pattern (version 3).
+#define RUN_MAX_PERIOD 16   // longest pattern of run.
+#define BYTE_PATCH_ADD 0x10 // copy of file1 with byte-wise differences added (version 3).
+#define BYTE_PATCH_HOLE 0x18 // hole of sparse file 2, reads as zeros (version 3).
+
+#define PAT_HEADER_SIZE 32
+
+// header byte 5: bits 0-1 endianness, bits 2-7 feature flags (version 2).
+#define PATCH_ENDIANNESS_MASK   3
+#define PATCH_FLAG_CHUNK_HASHES 4  // table of output chunk hashes follows body.
+#define PATCH_FLAG_FILTER_X86   8  // body is made from x86 branch converted files.
+#define PATCH_FLAG_FILTER_ARM64 16 // body is made from ARM64 branch converted files.
+#define PATCH_FLAG_STORED       32 // body is file 2 as is, patch would be larger (version 3).
+#define PATCH_FLAG_SEEK_TABLE   64 // table of op offsets for random access follows body (version 3).
+#define PATCH_FLAG_BASES       128 // file 1 is concatenation of several base files listed after body (version 3).
+#define PATCH_KNOWN_FLAGS       (PATCH_FLAG_CHUNK_HASHES | PATCH_FLAG_FILTER_X86 | PATCH_FLAG_FILTER_ARM64 | \
+                                 PATCH_FLAG_STORED | PATCH_FLAG_SEEK_TABLE | PATCH_FLAG_BASES)
 
 struct AutoClose // RAII structure
 {
@@ -55,11 +77,47 @@ struct PatchStats
     long as_is_length ;
     long as_is_count ;
     long as_is_maxed ;
+    long self_count ;
+    long self_length ;
+    long run_count ;
+    long run_length ;
+    long approx_count ;
+    long approx_length ;  // bytes of approximate matches, exact part included
+    long hole_count ;
+    long hole_length ;    // bytes of file #2 holes, not scanned
+    long skip_length ;    // bytes taken as is without probing (incompressible data)
+    long drain_length ;   // bytes taken as is once deadline passed
+    long refine_count ;   // regions encoded again with full matching (--deadline)
+    long refine_bytes ;   // bytes of file #2 in those regions
+    long refine_saved ;   // patch bytes saved by them
+    long ends_length ;    // bytes of common prefix and suffix, referred to without probing
+    long probe_count ;    // index lookups
+    long probe_filtered ; // lookups answered by filter alone
+    long scan_bytes ;     // size of file #2
+    long scan_msec ;      // time spent creating patch body
 
     PatchStats () : refs_count(0), refs_length(0), refs_longest(0), 
-                    as_is_length(0), as_is_count(0), as_is_maxed (0) { };
+                    as_is_length(0), as_is_count(0), as_is_maxed (0),
+                    self_count(0), self_length(0), run_count(0), run_length(0), approx_count(0),
+                    approx_length(0), hole_count(0), hole_length(0), skip_length(0), drain_length(0),
+                    refine_count(0), refine_bytes(0), refine_saved(0), ends_length(0),
+                    probe_count(0),
+                    probe_filtered(0), scan_bytes(0), scan_msec(0) { };
+};
+
+#define FILE_HOLE_MIN 4096  // shorter holes are treated as data.
+
+// hole of sparse file, [start, end).
+struct FileHole
+{
+    long start;
+    long end;
 };
 
+// lists holes of file (open as handle) of given size using SEEK_HOLE / SEEK_DATA,
+// none when the system cannot tell. File offset is kept. returns number of holes.
+size_t getFileHoles (int handle, long size, std::vector<FileHole> & holes);
+
 unsigned char getEndianness();
 char * getEndiannessString (char *buffer, int len);
 
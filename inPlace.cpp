@@ -0,0 +1,443 @@
+/* PatchMaker utility, Copyright (c) 1997-2020 Yuriy Yakimenko
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation.  No representations are made about the suitability of this
+ * software for any purpose.  It is provided "as is" without express or
+ * implied warranty.
+ */
+
+/* In-place patching: file #1 is transformed into file #2 without a second copy.
+
+   Ops (except copies from output) are split into pieces and written in batches,
+   either in ascending or in descending output order, whichever needs less data
+   saved. A reference is in conflict when its source overlaps output written by
+   an earlier batch; conflicting parts are saved to the journal before anything
+   is overwritten. Every batch is first gathered in memory and staged in the
+   journal, then written to file #1, so a batch interrupted by a crash is simply
+   written again on restart. Once a batch is on disk in file #1, header moves on
+   to the next one before staging area is reused, so staged bytes are never
+   taken for those of another batch. Copies from output only read final data and run
+   last, in ascending order.
+
+   JOURNAL (file1 name + ".foj"):
+
+   JournalHeader, then saved source parts (savedBytes), then staging area
+   (batchBytes). Header is written only after saved parts are on disk; a journal
+   without valid header means file #1 was not touched yet.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#include <vector>
+#include <algorithm> // min, max, reverse
+
+#include "common.h"
+#include "patchOps.h"
+
+#define INPLACE_BATCH_BYTES (64L << 20) // default batch (and memory) size.
+#define INPLACE_MIN_BATCH   (1L << 20)
+#define JOURNAL_VERSION     2
+#define NO_BATCH            0xFFFFFFFFFFFFFFFFULL
+
+struct JournalHeader
+{
+    char     magic[4];     // "FOCJ"
+    uint32_t version;
+    uint32_t size1;        // patch identity
+    uint32_t size2;
+    uint32_t checksum1;
+    uint32_t checksum2;
+    uint32_t descending;   // write order of batches.
+    uint32_t phase;        // 0 - batches, 1 - copies from output.
+    uint64_t batchBytes;
+    uint64_t savedBytes;
+    uint64_t stagedBatch;  // batch held in staging area, NO_BATCH if none.
+    uint64_t nextBatch;    // first batch not written to file #1 yet.
+};
+
+struct AutoHandle // RAII structure
+{
+    int fd;
+    AutoHandle () : fd(-1) {}
+    ~AutoHandle () { if (fd != -1) close (fd); }
+};
+
+// part of an op written by one batch.
+struct InPlacePiece
+{
+    PatchOp op;
+    long savedFrom;  // conflicting part, relative to piece start.
+    long savedLen;
+    long savedPos;   // position of conflicting part in journal's saved area.
+};
+
+static int journalName (const char *file1, char *szName, size_t len)
+{
+    return (snprintf (szName, len, "%s.foj", file1) < (int)len) ? 0 : -1;
+}
+
+#ifndef _MSC_VER
+
+static bool syncJournalHeader (int handle, const JournalHeader & hdr)
+{
+    return writeFull (handle, (const char *)&hdr, sizeof (hdr), 0) && fsync (handle) == 0;
+}
+
+// splits ops into batches in given order and finds conflicting source parts.
+// returns number of bytes to be saved.
+static long planBatches (const std::vector<PatchOp> & ops, long batchBytes, bool descending,
+            std::vector<InPlacePiece> & pieces, std::vector<size_t> & batches)
+{
+    pieces.clear ();
+    batches.clear ();
+
+    for (const PatchOp & op : ops)
+    {
+        if (op.type == OP_SELF) continue;
+
+        for (long done = 0; done < (long)op.length; done += batchBytes)
+        {
+            InPlacePiece piece;
+
+            piece.op = op;
+            piece.op.length = (uint32_t)(std::min)((long)op.length - done, batchBytes);
+            piece.op.outPos += done;
+            if (op.type == OP_LITERAL || op.type == OP_REF) piece.op.src += done;
+            if (op.delta != 0) piece.op.delta += done;
+            piece.savedFrom = piece.savedLen = piece.savedPos = 0;
+
+            pieces.push_back (piece);
+        }
+    }
+
+    if (descending)
+    {
+        std::reverse (pieces.begin(), pieces.end());
+    }
+
+    long inBatch = batchBytes, saved = 0;
+
+    // written by earlier batches: [0, edge) when ascending, [edge, ...) when descending.
+    long edge = descending ? LONG_MAX : 0;
+
+    for (size_t i = 0; i < pieces.size(); i++)
+    {
+        InPlacePiece & piece = pieces[i];
+
+        if (inBatch + (long)piece.op.length > batchBytes)
+        {
+            batches.push_back (i);
+            inBatch = 0;
+
+            if (i > 0)
+            {
+                const PatchOp & prev = pieces[i - 1].op;
+                edge = descending ? prev.outPos : prev.outPos + (long)prev.length;
+            }
+        }
+
+        inBatch += piece.op.length;
+
+        if (piece.op.type != OP_REF) continue;
+
+        long src = piece.op.src, end = src + (long)piece.op.length;
+
+        if (!descending && src < edge)
+        {
+            piece.savedFrom = 0;
+            piece.savedLen = (std::min)(end, edge) - src;
+        }
+        else if (descending && end > edge)
+        {
+            piece.savedFrom = (std::max)(src, edge) - src;
+            piece.savedLen = end - src - piece.savedFrom;
+        }
+
+        piece.savedPos = saved;
+        saved += piece.savedLen;
+    }
+
+    batches.push_back (pieces.size());
+
+    return saved;
+}
+
+#endif
+
+// returns zero when file1 has journal of interrupted in-place patching.
+int readInPlaceJournal (const char *file1, uint32_t identity[4])
+{
+    char szName [PATH_MAX];
+
+    if (0 != journalName (file1, szName, sizeof (szName))) return -1;
+
+    FILE *fp = fopen (szName, "rb");
+
+    if (fp == NULL) return -1;
+
+    JournalHeader hdr;
+
+    bool valid = (fread (&hdr, sizeof (hdr), 1, fp) == 1) && memcmp (hdr.magic, "FOCJ", 4) == 0 &&
+                 hdr.version == JOURNAL_VERSION;
+
+    fclose (fp);
+
+    if (!valid) return -1;
+
+    identity[0] = hdr.size1;
+    identity[1] = hdr.size2;
+    identity[2] = hdr.checksum1;
+    identity[3] = hdr.checksum2;
+
+    return 0;
+}
+
+int applyPatchInPlace (const char *file1, FILE *fp3, const std::vector<PatchOp> & ops,
+            const uint32_t identity[4], long long memoryBudget, bool verbose)
+{
+#ifdef _MSC_VER
+    fprintf (stderr, "In-place patching is not supported on this platform\n");
+    return -1;
+#else
+    char szName [PATH_MAX];
+
+    if (0 != journalName (file1, szName, sizeof (szName))) return -1;
+
+    AutoHandle h1, hj;
+
+    h1.fd = open (file1, O_RDWR);
+
+    if (h1.fd == -1)
+    {
+        fprintf (stderr, "Could not open file %s for writing\n", file1);
+        return -1;
+    }
+
+    const int fd1 = h1.fd;
+    const int fd3 = fileno (fp3);
+
+    JournalHeader hdr;
+
+    memset (&hdr, 0, sizeof (hdr));
+
+    uint32_t stored[4] = { 0 };
+
+    bool resume = (0 == readInPlaceJournal (file1, stored)) && 0 == memcmp (stored, identity, sizeof (stored));
+
+    std::vector<InPlacePiece> pieces;
+    std::vector<size_t> batches;
+
+    std::vector<char> buffer (INPLACE_MIN_BATCH);
+
+    if (resume)
+    {
+        hj.fd = open (szName, O_RDWR);
+
+        if (hj.fd == -1 || !readFull (hj.fd, (char *)&hdr, sizeof (hdr), 0)) return -1;
+
+        planBatches (ops, (long)hdr.batchBytes, hdr.descending != 0, pieces, batches);
+
+        if (verbose) printf ("Resuming interrupted in-place patching\n");
+    }
+    else
+    {
+        long batchBytes = INPLACE_BATCH_BYTES;
+
+        if (memoryBudget > 0)
+        {
+            batchBytes = (long)(std::max)((long long)INPLACE_MIN_BATCH, memoryBudget / 2);
+        }
+
+        batchBytes = (std::min)(batchBytes, (std::max)((long)identity[1], INPLACE_MIN_BATCH));
+
+        long savedAsc = planBatches (ops, batchBytes, false, pieces, batches);
+        long savedDesc = planBatches (ops, batchBytes, true, pieces, batches);
+
+        bool descending = (savedDesc < savedAsc);
+
+        long saved = descending ? savedDesc : savedAsc;
+
+        if (!descending) planBatches (ops, batchBytes, false, pieces, batches);
+
+        memcpy (hdr.magic, "FOCJ", 4);
+        hdr.version = JOURNAL_VERSION;
+        hdr.size1 = identity[0];
+        hdr.size2 = identity[1];
+        hdr.checksum1 = identity[2];
+        hdr.checksum2 = identity[3];
+        hdr.descending = descending ? 1 : 0;
+        hdr.phase = 0;
+        hdr.batchBytes = batchBytes;
+        hdr.savedBytes = saved;
+        hdr.stagedBatch = NO_BATCH;
+        hdr.nextBatch = 0;
+
+        if (verbose)
+        {
+            printf ("In-place: %s order, %ld batch(es) of up to %ld bytes, %ld bytes saved in journal\n",
+                    descending ? "descending" : "ascending", (long)batches.size() - 1, batchBytes, saved);
+        }
+
+        hj.fd = open (szName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+        if (hj.fd == -1)
+        {
+            fprintf (stderr, "Could not create journal %s\n", szName);
+            return -1;
+        }
+
+        // save conflicting source parts before anything is overwritten.
+        for (const InPlacePiece & piece : pieces)
+        {
+            for (long done = 0; done < piece.savedLen; done += (long)buffer.size())
+            {
+                size_t len = (size_t)(std::min)(piece.savedLen - done, (long)buffer.size());
+
+                if (!readFull (fd1, buffer.data(), len, piece.op.src + piece.savedFrom + done) ||
+                    !writeFull (hj.fd, buffer.data(), len, (long)sizeof (hdr) + piece.savedPos + done))
+                {
+                    return -1;
+                }
+            }
+        }
+
+        if (fsync (hj.fd) != 0 || !syncJournalHeader (hj.fd, hdr)) return -1;
+    }
+
+    const int fdj = hj.fd;
+
+    if (hdr.phase == 0)
+    {
+        const long staging = (long)sizeof (hdr) + (long)hdr.savedBytes;
+
+        if ((long)hdr.size2 > (long)hdr.size1 && 0 != ftruncate (fd1, hdr.size2)) return -1;
+
+        std::vector<char> batch ((size_t)hdr.batchBytes), deltaBuffer;
+
+        size_t first = (hdr.stagedBatch == NO_BATCH) ? (size_t)hdr.nextBatch : (size_t)hdr.stagedBatch;
+
+        for (size_t b = first; b + 1 < batches.size(); b++)
+        {
+            long total = 0;
+
+            for (size_t i = batches[b]; i < batches[b + 1]; i++) total += pieces[i].op.length;
+
+            if (b == hdr.stagedBatch) // interrupted while writing this batch.
+            {
+                if (!readFull (fdj, batch.data(), total, staging)) return -1;
+            }
+            else
+            {
+                char *dst = batch.data();
+
+                for (size_t i = batches[b]; i < batches[b + 1]; i++)
+                {
+                    const InPlacePiece & piece = pieces[i];
+                    const PatchOp & op = piece.op;
+
+                    bool ok = true;
+
+                    if (op.type == OP_LITERAL)
+                    {
+                        ok = readFull (fd3, dst, op.length, op.src);
+                    }
+                    else if (op.type == OP_SEQ || op.type == OP_HOLE) // holes are written as zeros.
+                    {
+                        memset (dst, (int)op.src, op.length);
+                    }
+                    else if (op.type == OP_RUN)
+                    {
+                        unsigned char pattern [RUN_MAX_PERIOD];
+
+                        ok = readFull (fd3, (char *)pattern, op.period, op.src);
+                        if (ok) fillRun (dst, op.length, op.outPos, pattern, op.period);
+                    }
+                    else if (op.type == OP_REF)
+                    {
+                        long tail = piece.savedFrom + piece.savedLen;
+
+                        if (piece.savedFrom > 0)
+                            ok = readFull (fd1, dst, piece.savedFrom, op.src);
+                        if (ok && piece.savedLen > 0)
+                            ok = readFull (fdj, dst + piece.savedFrom, piece.savedLen, (long)sizeof (hdr) + piece.savedPos);
+                        if (ok && tail < (long)op.length)
+                            ok = readFull (fd1, dst + tail, op.length - tail, op.src + tail);
+                        if (ok && op.delta != 0)
+                            ok = addDeltas (fd3, dst, op.length, op.delta, deltaBuffer);
+                    }
+
+                    if (!ok) return -1;
+
+                    dst += op.length;
+                }
+
+                if (!writeFull (fdj, batch.data(), total, staging) || fsync (fdj) != 0) return -1;
+
+                hdr.stagedBatch = b;
+
+                if (!syncJournalHeader (fdj, hdr)) return -1;
+            }
+
+            const char *src = batch.data();
+
+            for (size_t i = batches[b]; i < batches[b + 1]; i++)
+            {
+                const PatchOp & op = pieces[i].op;
+
+                if (!writeFull (fd1, src, op.length, op.outPos)) return -1;
+
+                src += op.length;
+            }
+
+            if (fsync (fd1) != 0) return -1;
+
+            // staging area is free again: bytes there may belong to next batch
+            // before header says so.
+            hdr.stagedBatch = NO_BATCH;
+            hdr.nextBatch = b + 1;
+
+            if (!syncJournalHeader (fdj, hdr)) return -1;
+        }
+
+        hdr.phase = 1;
+        hdr.stagedBatch = NO_BATCH;
+
+        if (!syncJournalHeader (fdj, hdr)) return -1;
+    }
+
+    // copies from output. Sources are final at this point, so these can be repeated safely.
+    for (const PatchOp & op : ops)
+    {
+        if (op.type != OP_SELF) continue;
+
+        for (long done = 0; done < (long)op.length; done += (long)buffer.size())
+        {
+            size_t len = (size_t)(std::min)((long)op.length - done, (long)buffer.size());
+
+            if (!readFull (fd1, buffer.data(), len, op.src + done) ||
+                !writeFull (fd1, buffer.data(), len, op.outPos + done))
+            {
+                return -1;
+            }
+        }
+    }
+
+    if ((long)hdr.size2 < (long)hdr.size1 && 0 != ftruncate (fd1, hdr.size2)) return -1;
+
+    if (fsync (fd1) != 0) return -1;
+
+    remove (szName);
+
+    return 0;
+#endif
+}
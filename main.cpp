@@ -18,12 +18,23 @@ can achieve significant savings when sending / storing patches.
 
     BYTES 0-2       have "FOC" in them.
     BYTE    3       has version number. This is to be used by "patch applying part" 
-                    (it must verify that this number matches the software version).
+                    (it must verify that this number is not above the software version).
     BYTE    4       contains block size minus 1. Block size can be anywhere from 1 to 256.
                     (higher values are not practical).
     BYTE    5       set to zero when patch is in progress. 
                     when patch is completed indicates endianness (1 - little, 2 - big).
                     Endianness (along with version) should be checked when applying a patch.
+                    (version 2) bits 0-1 hold endianness, bits 2-7 are feature flags
+                    telling which optional sections follow the body:
+                    4 - chunk hashes.
+                    8 - body made from x86 branch converted files (see below).
+                    16 - body made from ARM64 branch converted files.
+                    32 - (version 3) body is file 2 as is, with no sequences
+                         (patch would be larger).
+                    64 - (version 3) seek table.
+                    128 - (version 3) file 1 is concatenation of several base
+                          files, sizes and CRCs of which follow the body.
+                          Header has their total size and CRC of the first.
     BYTES 6-10      has file 1 last modification timestamp. Can be zero.
     BYTES 11-15     has file 2 last modification timestamp. Can be zero.
     BYTES 16-19     has file 1 size in bytes.
@@ -66,8 +77,58 @@ can achieve significant savings when sending / storing patches.
         10 - special value for EOF. Terminate output and compare output length 
              to header info.
 
-        11 - not used.
+        11 - (version 2) copy of output already written. Bits 4-5 of V have
+             LEN as above (1, 2 or 4 bytes). Read next 4 bytes to get output
+             offset to copy from, then LEN bytes to get the <length>. Source
+             range lies entirely before current output position.
 
+    (version 3) V = 0x14 is a long run of repeated pattern. Read next byte to
+    get the pattern size (1, 2, 4, 8 or 16), then the run <length> stored 7
+    bits per byte, lowest bits first, with bit 7 set on every byte but the
+    last one, then the pattern. Byte of output at offset X is pattern byte
+    (X modulo pattern size), so the pattern is stored rotated accordingly.
+
+    (version 3) V = 0x10 is a copy of file #1 with some bytes changed. Read next
+    4 bytes to get file #1 offset, then <length> stored as above. Then follow
+    groups until <length> bytes are covered: count of unchanged bytes, count of
+    changed bytes (both stored as above), then for every changed byte its
+    difference (output byte minus file #1 byte, modulo 256).
+
+    (version 3) V = 0x18 is a hole of sparse file #2. Read <length> stored as
+    above. Output gets <length> zero bytes, left unallocated where possible.
+
+    OPTIONAL SECTIONS (version 2) follow EOF sequence, in order of their flag
+    bits. Every section ends with its own length (4 bytes, not counting the
+    length itself), so sections are located from the end of the patch.
+
+    CHUNK HASHES    4 bytes chunk size, then 8-byte xxHash64 of every chunk of
+                    file 2 (last one may be shorter).
+    SEEK TABLE      4 bytes interval, then for every interval of file 2 two
+                    8-byte values: body offset of the sequence covering start
+                    of the interval and output offset that sequence starts at.
+    BASES           4 bytes count, then 4 bytes size and 4 bytes CRC of every
+                    base file, in order of concatenation.
+
+    TREE ARCHIVE SCHEMA (--tree):
+
+    BYTES 0-2       have "FOT" in them.
+    BYTE    3       has archive version (2).
+    BYTE    4       has endianness as in patch header.
+    BYTES 5-7       reserved.
+    BYTES 8-11      number of old files.
+    BYTES 12-15     number of entries.
+
+    OLD FILES, sorted by path: 4 bytes size, 4 bytes CRC, 2 bytes path length
+    and the path (relative, '/' separated). Non-empty old files in this order
+    are the base files of every patch in the archive. Since version 2 patches
+    are stored without their BASES section, the list above stands for it.
+
+    ENTRIES: 1 byte type, 2 bytes path length and the path, then
+        1 - unchanged: 4 bytes old file index, 5 bytes timestamp.
+        2 - copy of another old file (renamed or copied): the same.
+        3 - patched: 8 bytes length and the patch.
+        4 - stored as is: 4 bytes CRC, 5 bytes timestamp, 8 bytes length and data.
+        5 - deleted old file (path is the old one), nothing follows.
 
 Arguments for program:
 
@@ -80,9 +141,101 @@ Arguments for program:
     -s  print stats (creation only)
     -i  ignore timestamp information
     -d  disable I/O buffering
-    -x  maximize compression";
+    -x  maximize compression. Without it, common start and end of file1 and
+        file2 are referred to as they are and only the changed middle of file1
+        is indexed.
+    -k  cache index of file1 in file1.fci sidecar (creation only). The cache is
+        keyed by file1 size, modification time, inode and checksum, and is
+        rebuilt when any of them changes.
     
-    syntax: ./patch [caqfsei] file1 file2 [patch]
+    --output-dir=DIR  create patches from file1 to each of several new files
+        in a single run (creation only). file1 is read, checksummed and indexed
+        once; new files are processed in parallel against the shared index, and
+        each patch is written to DIR with .foc extension. New files which would
+        get the same patch name are refused.
+
+    --in-place  apply patch to file1 itself, transforming it into file2 without
+        a second copy (apply only). Progress is kept in file1.foj journal, an
+        interrupted run is resumed by running the same command again.
+    --base=FILE  one more base file, may be repeated. References address
+        concatenation of file1 and the base files in given order, indexed
+        together (loaded in memory when creating if the memory plan allows,
+        read in place otherwise). The same list is given when applying. Not
+        available with -k, --filter or --in-place.
+    --tree  file1 and file2 are directories, patch is a tree archive (.fot by
+        default). Files are matched by path, then by size and CRC, so
+        unchanged, renamed and copied files take a few bytes. Other new files
+        are patched in parallel against one index of all old files, so
+        content moved between files is referenced. Applying reads the
+        archive once, checks every old file once and builds new files in
+        parallel, opening old files only when referred to and keeping a
+        limited number of them open. Links are left out. Every regular file is part of the tree,
+        and no .fcc sidecars are written into either tree.
+    --max-memory=SIZE  memory budget (K, M or G suffix). Limits batch size of
+        in-place patching. When creating, defaults to 3/4 of the cgroup memory
+        limit (if any) and decides block size, file buffering, density of self
+        copy index and number of threads; a tight budget gives larger patches
+        instead of failure. The plan is printed in verbose mode.
+    --chunk-hashes[=SIZE]  store hash of every SIZE bytes (default 1M) of file2
+        in the patch (creation only). Each chunk is verified as soon as it is
+        written, and an interrupted apply is resumed by running the same
+        command again: intact chunks are kept, the rest is rewritten. Progress
+        is marked by file2.fop while output is incomplete.
+    --filter=x86|arm64  convert relative branch targets of executables to
+        absolute before matching (creation only). x86: E8/E9 with 32-bit
+        displacement within +-16MB; ARM64: BL. Both files are converted in
+        memory, header flag tells applier to convert file1 the same way and to
+        convert output back. Sizes and checksums in header are those of the
+        original files. Filtered patches cannot be applied --in-place.
+    --approx  extend matches through scattered changed bytes as long as most
+        bytes still match, e.g. tables of offsets or timestamps (creation only).
+        Such match is written as a single sequence carrying differences of the
+        changed bytes when it is shorter than exact encoding. Regions of file2
+        are encoded both ways and the shorter kept, so the patch is never
+        larger than without --approx.
+    --estimate  predict patch size without creating it (creation only). One
+        64 KB window of every 1/64 of file2 is encoded against file1 index and
+        the estimate is printed along with its 95% confidence bounds. Files up
+        to 8 MB are encoded entirely.
+    --deadline=SECONDS  finish patch within SECONDS of wall-clock time
+        (creation only). File2 is first scanned with cheap matching; regions of
+        it taking most patch bytes are then encoded again with full matching
+        (approximate matches, every position probed) while time remains, and
+        shorter encodings replace original ones. Once deadline passes the rest
+        of file2 is written as is, so the patch is always complete.
+    --both  also create patch from file2 back to file1 (creation only), named
+        after file1 unless given as the fourth file name. Both files are read,
+        checksummed and indexed once, on two threads, and the two patches are
+        made in parallel, each file being base of one and new file of the
+        other. Memory budget is split between them.
+    --paranoid  always compute checksums by reading whole files. Otherwise CRC
+        saved in file.fcc sidecar is reused while size, inode, modification and
+        status change times of the file are unchanged. Sidecars are written for
+        every checksummed input and for verified output.
+    --seek-table[=SIZE]  store a seek table (creation only): for every SIZE
+        bytes (default 1M) of file2, where in the body the sequence covering
+        them starts. Not available with --filter.
+    --range=OFFSET,LENGTH  build only this part of file2 (apply only), given
+        length is clipped to file2 size. Patch must have a seek table (or store
+        file2 as is); decoding starts at the table entry of OFFSET, and copies
+        of earlier output read their sources the same way. Checksums of whole
+        chunks in range are verified when patch has chunk hashes.
+
+    syntax: ./patch [caqfseidxk] file1 file2 [patch]
+            ./patch -c [qfseidxk] --output-dir=DIR file1 new1 new2 ... newN
+            ./patch -c [qfseidxk] --chunk-hashes[=SIZE] file1 file2 [patch]
+            ./patch -c [qfseidxk] --max-memory=SIZE file1 file2 [patch]
+            ./patch -c [qfseidxk] --filter=x86|arm64 file1 file2 [patch]
+            ./patch -c [qfseidxk] --approx file1 file2 [patch]
+            ./patch -a [qfvi] --in-place [--max-memory=SIZE] file1 patch
+            ./patch -c|-a [flags] --paranoid file1 file2 [patch]
+            ./patch -c [qfseidxk] --estimate file1 file2
+            ./patch -c [qfseidxk] --seek-table[=SIZE] file1 file2 [patch]
+            ./patch -c [qfseidxk] --deadline=SECONDS file1 file2 [patch]
+            ./patch -c [qfseidxk] --both file1 file2 [patch [backpatch]]
+            ./patch -c|-a [flags] --tree dir1 dir2 [archive]
+            ./patch -c|-a [flags] --base=FILE1B [--base=FILE1C ...] file1 file2 [patch]
+            ./patch -a [qfi] --range=OFFSET,LENGTH file1 file2 patch
 */
 
 #include <stdio.h>
@@ -91,6 +244,7 @@ Arguments for program:
 
 #include "common.h"
 #include "progArgs.h"
+#include "treeArchive.h"
   
 int main (int argc, char *argv[])
 {
@@ -103,6 +257,11 @@ int main (int argc, char *argv[])
 
     // at this point file name are set and flags are valid.
 
+    if (args.flagTree)
+    {
+        return args.flagCreate ? createTreeArchive (args) : applyTreeArchive (args);
+    }
+
     if (args.flagCreate)
     {
         return createPatch (args);
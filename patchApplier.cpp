@@ -20,109 +20,461 @@
 #include <assert.h>
 
 #include <limits.h>
+#include <string.h>
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm> // min, max
 
 #include "common.h"
 #include "progArgs.h"
 
 #include "timeutil.h"
 #include "checksum.h"
+#include "blockIndex.h"
+#include "patchOps.h"
+#include "patchedReader.h"
+#include "bcjFilter.h"
+
+#define OP_BUFFER_SIZE   (1L << 20)  // per thread copy buffer.
+#define OP_THREAD_BYTES  (4L << 20)  // minimum output per thread worth starting it.
+#define READAHEAD_WINDOW (8L << 20)  // file1 bytes requested ahead of the op being executed.
+#define PROGRESS_VERSION 1
+
+// progress journal (file2 name + ".fop"), exists while output of a patch with
+// chunk hashes is being written. Output left by an interrupted run is only
+// reused when this journal matches the patch.
+struct ProgressHeader
+{
+    char     magic[4];     // "FOCP"
+    uint32_t version;
+    uint32_t identity[4];  // size1, size2, checksum1, checksum2
+    uint32_t chunkSize;
+};
 
-#define PAT_HEADER_SIZE 32
+static int progressName (const char *file2, char *szName, size_t len)
+{
+    return (snprintf (szName, len, "%s.fop", file2) < (int)len) ? 0 : -1;
+}
 
-static int applyPatchBody (AutoClose & ac, const long blockSize, const progArguments & args)
+// returns zero when file2 has progress journal of given patch.
+static int readProgress (const char *file2, const uint32_t identity[4], uint32_t chunkSize)
 {
-    long pos = 0;
+    char szName [PATH_MAX];
 
-    bool rwError = false;
+    if (0 != progressName (file2, szName, sizeof (szName))) return -1;
 
-    FILE * fp1 = ac.fp1;
-    FILE * fp2 = ac.fp2;
-    FILE * fp3 = ac.fp3;
+    FILE *fp = fopen (szName, "rb");
+
+    if (fp == NULL) return -1;
+
+    ProgressHeader hdr;
+
+    bool valid = (fread (&hdr, sizeof (hdr), 1, fp) == 1) && memcmp (hdr.magic, "FOCP", 4) == 0 &&
+                 hdr.version == PROGRESS_VERSION && memcmp (hdr.identity, identity, sizeof (hdr.identity)) == 0 &&
+                 hdr.chunkSize == chunkSize;
+
+    fclose (fp);
+
+    return valid ? 0 : -1;
+}
+
+static int writeProgress (const char *file2, const uint32_t identity[4], uint32_t chunkSize)
+{
+    char szName [PATH_MAX];
+
+    if (0 != progressName (file2, szName, sizeof (szName))) return -1;
+
+    ProgressHeader hdr;
+
+    memcpy (hdr.magic, "FOCP", 4);
+    hdr.version = PROGRESS_VERSION;
+    memcpy (hdr.identity, identity, sizeof (hdr.identity));
+    hdr.chunkSize = chunkSize;
+
+    FILE *fp = fopen (szName, "wb");
+
+    if (fp == NULL) return -1;
+
+    bool ok = (fwrite (&hdr, sizeof (hdr), 1, fp) == 1);
+
+    if (fclose (fp) != 0) ok = false;
+
+    return ok ? 0 : -1;
+}
+
+static void removeProgress (const char *file2)
+{
+    char szName [PATH_MAX];
+
+    if (0 == progressName (file2, szName, sizeof (szName))) remove (szName);
+}
+
+#ifndef _MSC_VER
+
+// Output chunks of a patch with chunk hashes. Every chunk counts bytes still to
+// be written; chunk is read back and verified as soon as its last byte is written,
+// so corruption is reported right away instead of after the whole output is done.
+// Chunks already intact (resumed output) start at zero and are never written.
+struct ChunkTracker
+{
+    ChunkTracker (const PatchSections & sections, const long size2, const int fd2) :
+        sections(sections), size2(size2), fd2(fd2), remaining(sections.chunkHashes.size()), failed(false)
+    {
+        for (size_t i = 0; i < remaining.size(); i++)
+        {
+            remaining[i] = (uint32_t)(chunkEnd (i) - (long)i * sections.chunkSize);
+        }
+    }
+
+    size_t chunkOf (const long pos) const { return (size_t)(pos / sections.chunkSize); }
+
+    long chunkEnd (const size_t chunk) const { return (std::min)((long)(chunk + 1) * sections.chunkSize, size2); }
+
+    bool isPending (const size_t chunk) const { return remaining[chunk] != 0; }
 
-    uint8_t bLen = 0;
-    uint16_t iLen = 0, iStart = 0;
-    uint32_t lStart = 0;
-    int32_t maxL = 0;
+    // reads chunk back. returns true when it matches its hash.
+    bool verify (const size_t chunk, std::vector<char> & buffer) const
+    {
+        long pos = (long)chunk * sections.chunkSize;
+        size_t len = (size_t)(chunkEnd (chunk) - pos);
+
+        buffer.resize (sections.chunkSize);
+
+        return readFull (fd2, buffer.data(), len, pos) && xxHash64 (buffer.data(), len) == sections.chunkHashes[chunk];
+    }
+
+    // accounts len bytes written at pos (within one chunk). returns false when
+    // this completed the chunk and it does not match its hash.
+    bool written (const long pos, const size_t len, std::vector<char> & buffer)
+    {
+        size_t chunk = chunkOf (pos);
+
+        if (remaining[chunk].fetch_sub ((uint32_t)len) != (uint32_t)len) return true;
+
+        if (verify (chunk, buffer)) return true;
+
+        fprintf (stderr, "Chunk %ld at offset %ld does not match patch.\n", (long)chunk, (long)chunk * sections.chunkSize);
+
+        failed = true;
+
+        return false;
+    }
+
+    // verifies chunks of existing output using several threads, intact chunks
+    // are marked as done. returns number of intact chunks.
+    size_t verifyExisting (const int threadCount)
+    {
+        std::atomic<size_t> next (0), intact (0);
+
+        auto worker = [&] () {
+            std::vector<char> buffer;
+
+            for (size_t chunk = next++; chunk < remaining.size(); chunk = next++)
+            {
+                if (verify (chunk, buffer))
+                {
+                    remaining[chunk] = 0;
+                    intact++;
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
 
-    unsigned char szBuff [256];
+        for (int t = 1; t < threadCount; t++) threads.push_back (std::thread (worker));
 
-    bool eofFound = false;
+        worker ();
 
-    while (!rwError)
+        for (auto & th : threads) th.join();
+
+        return intact;
+    }
+
+    const PatchSections & sections;
+    const long size2;
+    const int fd2;
+    std::vector<std::atomic<uint32_t>> remaining;
+    std::atomic<bool> failed;
+};
+
+// Asks kernel to read file1 ranges referenced by upcoming ops, so random access
+// to file1 does not stall on every seek. Keeps about READAHEAD_WINDOW bytes
+// requested ahead of the current op; adjacent ranges are merged into one request.
+struct Readahead
+{
+    Readahead (const std::vector<PatchOp> & ops, const size_t first, const size_t last, const BaseFiles & bases) :
+        ops(ops), last(last), bases(bases), next(first), ahead(0), start(0), end(0) {}
+
+    // called before executing op i.
+    void advance (const size_t i)
     {
-        int byte = fgetc (fp3);
-        
-        if (byte == EOF) break;
+        if (i < next && ops[i].type == OP_REF) ahead -= clipped (ops[i]);
 
-        if (byte == 0)
+        for ( ; next < last && ahead < READAHEAD_WINDOW; next++)
         {
-            if (fread (&bLen, 1, 1, fp3) != 1) { rwError = true; break; }
-            iLen = bLen + 1;
-            if (fread (szBuff, iLen, 1, fp3) != 1) { rwError = true; break; }
-            if (fwrite (szBuff, iLen, 1, fp2) != 1) { rwError = true; break; }
-            pos += iLen;
+            const PatchOp & op = ops[next];
+
+            if (op.type != OP_REF) continue;
+
+            long len = clipped (op);
+
+            if (op.src != end) flush ();
+
+            if (start == end) start = op.src;
+
+            end = op.src + len;
+            ahead += len;
         }
-        else if (byte == BYTE_PATCH_EOF) 
+
+        flush ();
+    }
+
+private:
+
+    // long copies are only requested partially, kernel readahead takes over
+    // once they are read sequentially.
+    static long clipped (const PatchOp & op) { return (std::min)((long)op.length, READAHEAD_WINDOW); }
+
+    void flush ()
+    {
+        if (end > start) bases.willNeed (start, end - start);
+
+        start = end = 0;
+    }
+
+    const std::vector<PatchOp> & ops;
+    const size_t last;
+    const BaseFiles & bases;
+    size_t next;    // ops before this one are already requested.
+    long ahead;     // bytes requested for ops not executed yet.
+    long start, end;
+};
+
+// executes ops [first, last). Output copies are skipped unless selfOnly is set,
+// in which case only they are executed. With tracker, writes are split at chunk
+// boundaries and only chunks still pending are written. returns zero on success.
+static int applyOps (const std::vector<PatchOp> & ops, size_t first, size_t last, bool selfOnly,
+            const BaseFiles & bases, int fd2, int fd3, ChunkTracker *tracker)
+{
+    std::vector<char> buffer (OP_BUFFER_SIZE), chunkBuffer, deltaBuffer;
+
+    char *szBuff = buffer.data();
+
+    Readahead readahead (ops, first, selfOnly ? first : last, bases);
+
+    for (size_t i = first; i < last; i++)
+    {
+        const PatchOp & op = ops[i];
+
+        if ((op.type == OP_SELF) != selfOnly) continue;
+
+        if (tracker && tracker->failed) return -1;
+
+        readahead.advance (i);
+
+        unsigned char pattern [RUN_MAX_PERIOD];
+
+        if (op.type == OP_SEQ)
         {
-            eofFound = true;
-            break;
+            memset (szBuff, (int)op.src, (std::min)((long)op.length, OP_BUFFER_SIZE));
         }
-        else if (byte == BYTE_PATCH_SEQ) // sequence of identical bytes.
+        else if (op.type == OP_RUN)
         {
-            if (fread (&bLen, 1, 1, fp3) != 1) { rwError = true; break; }
-            iLen = bLen + 1;
-            if (fread (&bLen, 1, 1, fp3) != 1) { rwError = true; break; }
-            for (int i=0; i < iLen && !rwError; i++)
-            if (fwrite (&bLen, 1, 1, fp2) != 1) { rwError = true; }
-            pos += iLen;
+            if (!readFull (fd3, (char *)pattern, op.period, op.src)) return -1;
         }
-        else
+
+        for (long done = 0; done < (long)op.length; )
         {
-            if (fread (&iStart, 2, 1, fp3) != 1)
+            long pos = op.outPos + done;
+
+            // holes need no buffer, they are punched as a whole.
+            size_t len = (size_t)(op.type == OP_HOLE ? (long)op.length - done : (std::min)((long)op.length - done, OP_BUFFER_SIZE));
+
+            if (tracker)
             {
-                rwError = true;
-                break;
-            }
+                size_t chunk = tracker->chunkOf (pos);
 
-            lStart = byte >> 2;
-            lStart = (lStart << 16) + iStart;
-            byte &= 3;
+                len = (std::min)(len, (size_t)(tracker->chunkEnd (chunk) - pos));
 
-            if (0 != fseek (fp1, lStart * blockSize, SEEK_SET))
-            { 
-                rwError = true;
-                break;
+                if (!tracker->isPending (chunk))
+                {
+                    done += (long)len;
+                    continue;
+                }
             }
 
-            if (byte == 1)
-            {
-                if (fread (&bLen, 1, 1, fp3) != 1) rwError = true;
-                maxL = bLen;
-            }
-            else if (byte == 2)
+            bool ok = true;
+
+            if (op.type == OP_LITERAL) ok = readFull (fd3, szBuff, len, op.src + done);
+            else if (op.type == OP_REF) ok = bases.read (szBuff, len, op.src + done) &&
+                                              (op.delta == 0 || addDeltas (fd3, szBuff, len, op.delta + done, deltaBuffer));
+            else if (op.type == OP_SELF) ok = readFull (fd2, szBuff, len, op.src + done);
+            else if (op.type == OP_RUN) fillRun (szBuff, len, pos, pattern, op.period);
+
+            if (op.type == OP_HOLE) ok = zeroFull (fd2, len, pos);
+            else if (ok) ok = writeFull (fd2, szBuff, len, pos);
+
+            if (!ok) return -1;
+
+            if (tracker && !tracker->written (pos, len, chunkBuffer)) return -1;
+
+            done += (long)len;
+        }
+    }
+
+    return 0;
+}
+
+#endif
+
+// writes decoded ops to output. Output is preallocated to its final size and
+// split into disjoint ranges filled by separate threads. Copies from output are
+// done afterwards in order, as they depend on data written by other threads.
+// When patch has chunk hashes, every chunk is verified once complete; resumed
+// output is verified first and its intact chunks are kept. returns zero on success.
+static int applyPatchBody (AutoClose & ac, const BaseFiles & bases, const std::vector<PatchOp> & ops, const long size2,
+            const PatchSections & sections, const bool resume, const progArguments & args)
+{
+#ifndef _MSC_VER
+    int fd2 = fileno (ac.fp2), fd3 = fileno (ac.fp3);
+
+    if (0 != ftruncate (fd2, size2)) return -1;
+
+#ifdef __linux__
+    // best effort, file system may not support it. Sparse output is not
+    // allocated, its holes are punched by hole ops.
+    bool sparse = false;
+
+    for (const PatchOp & op : ops) sparse = sparse || op.type == OP_HOLE;
+
+    if (size2 > 0 && !sparse) (void)fallocate (fd2, 0, 0, size2);
+#endif
+
+    int threadCount = (int)(std::min)((long)(std::max)(1U, std::thread::hardware_concurrency()),
+                                      (std::max)(1L, size2 / OP_THREAD_BYTES));
+
+    std::unique_ptr<ChunkTracker> tracker;
+
+    if (sections.chunkSize)
+    {
+        tracker.reset (new ChunkTracker (sections, size2, fd2));
+
+        if (resume)
+        {
+            int verifyThreads = (int)(std::max)(1U, std::thread::hardware_concurrency());
+
+            size_t intact = tracker->verifyExisting (verifyThreads);
+
+            if (!args.flagQuiet)
             {
-                if (fread (&iLen, 2, 1, fp3) != 1) rwError = true;
-                maxL = iLen;
+                printf ("Resuming: %ld of %ld chunks already complete\n", (long)intact, (long)sections.chunkHashes.size());
             }
-            else if (byte == 3)
+        }
+    }
+
+    if (args.flagVerbose)
+    {
+        printf ("Applying %ld operations using %d thread(s)\n", (long)ops.size(), threadCount);
+    }
+
+    ChunkTracker *pTracker = tracker.get();
+
+    // split ops into ranges of about the same output size.
+    std::vector<size_t> bounds (1, 0);
+
+    for (size_t i = 0; i < ops.size() && (int)bounds.size() < threadCount; i++)
+    {
+        if (ops[i].outPos >= (long)((double)size2 * bounds.size() / threadCount))
+        {
+            bounds.push_back (i);
+        }
+    }
+
+    bounds.push_back (ops.size());
+
+    std::vector<int> results (bounds.size() - 1, 0);
+
+    std::vector<std::thread> threads;
+
+    for (size_t t = 1; t < results.size(); t++)
+    {
+        threads.push_back (std::thread ([&, t] () {
+            results[t] = applyOps (ops, bounds[t], bounds[t + 1], false, bases, fd2, fd3, pTracker);
+        }));
+    }
+
+    results[0] = applyOps (ops, bounds[0], bounds[1], false, bases, fd2, fd3, pTracker);
+
+    for (auto & th : threads) th.join();
+
+    for (int r : results)
+    {
+        if (r != 0) return -1;
+    }
+
+    return applyOps (ops, 0, ops.size(), true, bases, fd2, fd3, pTracker);
+#else
+    (void)resume; // whole output is rewritten.
+
+    FILE * fp2 = ac.fp2;
+    FILE * fp3 = ac.fp3;
+
+    unsigned char szBuff [256], szDelta [256];
+    unsigned char pattern [RUN_MAX_PERIOD];
+
+    for (const PatchOp & op : ops)
+    {
+        if (op.type == OP_RUN && (0 != fseek (fp3, op.src, SEEK_SET) || fread (pattern, op.period, 1, fp3) != 1)) return -1;
+
+        for (long done = 0; done < (long)op.length; done += 256)
+        {
+            size_t len = (size_t)(std::min)((long)op.length - done, 256L);
+
+            bool ok = true;
+
+            if (op.type == OP_SEQ || op.type == OP_HOLE) memset (szBuff, (int)op.src, len);
+            else if (op.type == OP_LITERAL) ok = (0 == fseek (fp3, op.src + done, SEEK_SET)) && fread (szBuff, len, 1, fp3) == 1;
+            else if (op.type == OP_REF)
             {
-                if (fread (&maxL, 4, 1, fp3) != 1) rwError = true;
+                ok = bases.read ((char *)szBuff, len, op.src + done);
+
+                if (ok && op.delta != 0)
+                {
+                    ok = (0 == fseek (fp3, op.delta + done, SEEK_SET)) && fread (szDelta, len, 1, fp3) == 1;
+                    for (size_t i = 0; ok && i < len; i++) szBuff[i] = (unsigned char)(szBuff[i] + szDelta[i]);
+                }
             }
-            else 
-                break;
+            else if (op.type == OP_SELF) ok = (0 == fseek (fp2, op.src + done, SEEK_SET)) && fread (szBuff, len, 1, fp2) == 1;
+            else if (op.type == OP_RUN) fillRun ((char *)szBuff, len, op.outPos + done, pattern, op.period);
+
+            if (!ok || 0 != fseek (fp2, op.outPos + done, SEEK_SET) || fwrite (szBuff, len, 1, fp2) != 1) return -1;
+        }
+    }
 
-            pos += maxL;
+    if (sections.chunkSize)
+    {
+        std::vector<char> buffer (sections.chunkSize);
+
+        for (size_t chunk = 0; chunk < sections.chunkHashes.size(); chunk++)
+        {
+            long pos = (long)chunk * sections.chunkSize;
+            size_t len = (size_t)((std::min)(pos + (long)sections.chunkSize, size2) - pos);
 
-            for ( ; maxL > 0 && !rwError; maxL -= 256)
+            if (0 != fseek (fp2, pos, SEEK_SET) || fread (buffer.data(), len, 1, fp2) != 1) return -1;
+
+            if (xxHash64 (buffer.data(), len) != sections.chunkHashes[chunk])
             {
-                iLen = maxL > 256 ? 256 : maxL;
-                if (fread (szBuff, iLen, 1, fp1) != 1) rwError = true;
-                if (fwrite (szBuff, iLen, 1, fp2) != 1) rwError = true;
+                fprintf (stderr, "Chunk %ld at offset %ld does not match patch.\n", (long)chunk, pos);
+                return -1;
             }
         }
     }
 
-    return ((rwError == false) && eofFound) ? 0 : 1;
+    return 0;
+#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -131,8 +483,100 @@ static int applyPatchBody (AutoClose & ac, const long blockSize, const progArgum
 //
 ///////////////////////////////////////////////////////////////////////////
 
+// writes [rangeOffset, rangeOffset + rangeLength) of file2 (clipped to its size)
+// to file2 using the patch seek table. Chunks of the range with hashes in patch
+// are checked. returns EXIT_SUCCESS or EXIT_FAILURE.
+static int extractRange (const struct progArguments & args)
+{
+    PatchedReader reader;
+
+    if (0 != reader.open (args.file1, args.file3, args.flagParanoid, args.bases, args.baseCount))
+    {
+        return EXIT_FAILURE;
+    }
+
+    long offset = (long)args.rangeOffset;
+
+    if (offset > reader.size ())
+    {
+        fprintf (stderr, "Range starts beyond new file size %ld\n", reader.size ());
+        return EXIT_FAILURE;
+    }
+
+    long end = offset + (long)(std::min)(args.rangeLength, (long long)(reader.size () - offset));
+
+    if (access (args.file2, F_OK) == 0 && !args.flagForce)
+    {
+        printf ("File %s already exists. Use -f flag to overwrite.\n", args.file2);
+        return EXIT_SUCCESS;
+    }
+
+    AutoClose ac;
+
+    ac.fp2 = fopen (args.file2, "wb");
+
+    if (ac.fp2 == NULL)
+    {
+        fprintf (stderr, "Could not open file %s.\n", args.file2);
+        return EXIT_FAILURE;
+    }
+
+    const PatchSections & sections = reader.patchSections ();
+
+    std::vector<char> buffer (OP_BUFFER_SIZE);
+
+    for (long pos = offset; pos < end; )
+    {
+        long len = (std::min)(end - pos, OP_BUFFER_SIZE);
+
+        // whole chunks are read at once, so their hashes can be checked.
+        if (sections.chunkSize)
+        {
+            long chunk = pos / sections.chunkSize;
+            long chunkEnd = (std::min)((chunk + 1) * (long)sections.chunkSize, reader.size ());
+
+            len = (std::min)(end, chunkEnd) - pos;
+            buffer.resize ((size_t)(std::max)((long)buffer.size (), len));
+        }
+
+        if (0 != reader.read (pos, (size_t)len, buffer.data ()))
+        {
+            fprintf (stderr, "Incomplete or corrupted patch\n");
+            return EXIT_FAILURE;
+        }
+
+        if (sections.chunkSize && pos % sections.chunkSize == 0 &&
+            (pos + len) == (std::min)(pos + (long)sections.chunkSize, reader.size ()) &&
+            xxHash64 (buffer.data (), (size_t)len) != sections.chunkHashes[pos / sections.chunkSize])
+        {
+            fprintf (stderr, "Output chunk hash mismatch at %ld.\n", pos);
+            return EXIT_FAILURE;
+        }
+
+        if (fwrite (buffer.data (), (size_t)len, 1, ac.fp2) != 1)
+        {
+            fprintf (stderr, "Read/write error\n");
+            return EXIT_FAILURE;
+        }
+
+        pos += len;
+    }
+
+    if (!args.flagQuiet)
+    {
+        printf ("Range %ld-%ld successfully built.\n", offset, end);
+    }
+
+    return EXIT_SUCCESS;
+}
+
 int applyPatch (const struct progArguments & args)
 {
+    if (args.flagRange)
+    {
+        return extractRange (args);
+    }
+
     struct ftime actual_time1 = ftime(), // filling values with zeros
                 time1 = ftime(), time2 = ftime();
 
@@ -200,7 +644,7 @@ int applyPatch (const struct progArguments & args)
         return EXIT_FAILURE;
     }
 
-    if (szCheck[3] != _VERSION_ )
+    if (szCheck[3] == 0 || szCheck[3] > _VERSION_ )
     {
         fprintf (stderr, "Patch version %d not supported.\n", (int)szCheck[3]);
         return EXIT_FAILURE;
@@ -212,12 +656,34 @@ int applyPatch (const struct progArguments & args)
         return EXIT_FAILURE;
     }
 
-    if (szCheck[5] != getEndianness())
+    if ((szCheck[5] & PATCH_ENDIANNESS_MASK) != getEndianness())
     {
         fprintf (stderr, "Endinanness not supported.\n");
         return EXIT_FAILURE;
     }
 
+    unsigned flags = szCheck[5] & ~PATCH_ENDIANNESS_MASK;
+
+    if (flags & ~PATCH_KNOWN_FLAGS)
+    {
+        fprintf (stderr, "Patch uses features not supported by this version.\n");
+        return EXIT_FAILURE;
+    }
+
+    int filter = (flags & PATCH_FLAG_FILTER_X86) ? FILTER_X86 : ((flags & PATCH_FLAG_FILTER_ARM64) ? FILTER_ARM64 : FILTER_NONE);
+
+    if (filter != FILTER_NONE && args.flagInPlace)
+    {
+        fprintf (stderr, "Patch made with --filter cannot be applied in place.\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((flags & PATCH_FLAG_BASES) && args.flagInPlace)
+    {
+        fprintf (stderr, "Patch made from several base files cannot be applied in place.\n");
+        return EXIT_FAILURE;
+    }
+
     long blockSize = (long)szCheck [4] + 1;
     
     // we already know the file is at least as large as header, adding assert to fix warnings.
@@ -247,25 +713,73 @@ int applyPatch (const struct progArguments & args)
         return EXIT_FAILURE;
     }
 
-    if (size1 != actual_size1)
+    uint32_t identity[4] = { size1, size2, checksum1, checksum2 }, journal[4] = { 0 };
+
+    // interrupted in-place patching, file1 is already partially transformed.
+    bool resume = args.flagInPlace && 0 == readInPlaceJournal (args.file1, journal);
+
+    if (resume && 0 != memcmp (journal, identity, sizeof (identity)))
+    {
+        fprintf (stderr, "%s has journal of another patch.\n", args.file1);
+        return EXIT_FAILURE;
+    }
+
+    PatchSections sections;
+
+    if (0 != readPatchSections (ac.fp3, patch_size, flags, (long)size2, sections))
+    {
+        fprintf (stderr, "Incomplete or corrupted patch\n");
+        return EXIT_FAILURE;
+    }
+
+    // patch made from several base files refers to their concatenation, header
+    // has its size and CRC of the first file.
+    BaseFiles bases;
+
+    // tree archive shares its base files among patches, they may not be listed in them.
+    if (args.sharedBases)
+    {
+        actual_size1 = args.sharedBases->size ();
+    }
+    else if (!resume && (args.baseCount || (flags & PATCH_FLAG_BASES)))
+    {
+        if (0 != bases.open (ac.fp1, args.bases, args.baseCount, sections, args.flagParanoid, !args.flagBasesVerified))
+        {
+            return EXIT_FAILURE;
+        }
+
+        actual_size1 = bases.size ();
+    }
+
+    if (!resume && size1 != actual_size1)
     {
         fprintf (stderr, "Original file size mismatch: %ld vs %ld\n", (long)size1, (long)actual_size1);
         return EXIT_FAILURE;
     }
 
-    if (0 != getChecksum (ac.fp1, actual_checksum1))
+    bool cached = false;
+
+    // caller (tree archive) may have checked file1 already.
+    bool check1 = !resume && !args.flagBasesVerified;
+
+    if (check1 && 0 != getFileChecksum (args.file1, ac.fp1, args.flagParanoid, actual_checksum1, cached, !args.flagNoSidecars))
     {
         fprintf (stderr, "Error validating %s.\n", args.file1);
         return EXIT_FAILURE;
     }
 
-    if (actual_checksum1 != checksum1)
+    if (check1 && actual_checksum1 != checksum1)
     {
         fprintf (stderr, "Original file checksum mismatch.\n");
         return EXIT_FAILURE;
     }
 
-    if (memcmp (&actual_time1, &time1, sizeof(struct ftime)) != 0)
+    if (cached && args.flagVerbose)
+    {
+        printf ("Checksum of %s reused from its .fcc sidecar.\n", args.file1);
+    }
+
+    if (check1 && memcmp (&actual_time1, &time1, sizeof(struct ftime)) != 0)
     {
         // file timestamp can be all zeros (ivalid value), 
         // in this case no warning is given.
@@ -281,30 +795,101 @@ int applyPatch (const struct progArguments & args)
         }
     }
 
-    if (access(args.file2, F_OK) == 0 && !args.flagForce)
+    std::vector<PatchOp> ops;
+
+    if (0 != ((flags & PATCH_FLAG_STORED) ? storedBodyOps ((long)size2, sections.bodyEnd, ops) :
+                decodePatchBody (ac.fp3, blockSize, (long)size1, (long)size2, sections.bodyEnd, ops)))
     {
-        printf("File %s already exists. Use -f flag to overwrite.\n", args.file2);
-        return EXIT_SUCCESS;
+        fprintf (stderr, "Incomplete or corrupted patch\n");
+        return EXIT_FAILURE;
     }
 
-    ac.fp2 = fopen (args.file2, "w+b");
+    int ret = 0;
 
-    if (ac.fp2 == NULL)
+    if (args.flagInPlace)
     {
-        fprintf (stderr, "Could not open file %s.\n", args.file2);
-        return EXIT_FAILURE;
+        ret = applyPatchInPlace (args.file1, ac.fp3, ops, identity, args.maxMemory, args.flagVerbose);
+
+        // reopen to verify result.
+        fclose (ac.fp1);
+        ac.fp1 = fopen (args.file1, "rb");
+
+        if (ac.fp1 == NULL) ret = -1;
+    }
+    else
+    {
+        // output of interrupted run is completed rather than rebuilt.
+        bool resumeOutput = sections.chunkSize && 0 == readProgress (args.file2, identity, sections.chunkSize) &&
+                            access (args.file2, F_OK) == 0;
+
+        if (!resumeOutput && access(args.file2, F_OK) == 0 && !args.flagForce)
+        {
+            printf("File %s already exists. Use -f flag to overwrite.\n", args.file2);
+            return EXIT_SUCCESS;
+        }
+
+        ac.fp2 = fopen (args.file2, resumeOutput ? "r+b" : "w+b");
+
+        if (ac.fp2 == NULL)
+        {
+            fprintf (stderr, "Could not open file %s.\n", args.file2);
+            return EXIT_FAILURE;
+        }
+
+        if (sections.chunkSize && !resumeOutput && 0 != writeProgress (args.file2, identity, sections.chunkSize))
+        {
+            fprintf (stderr, "Could not create progress file for %s.\n", args.file2);
+            return EXIT_FAILURE;
+        }
+
+        // references point into converted file #1, output is converted back afterwards.
+        if (filter != FILTER_NONE)
+        {
+            FILE *converted = tmpfile ();
+
+            if (converted == NULL || 0 != fseek (ac.fp1, 0L, SEEK_SET) || 0 != branchFilterFile (filter, ac.fp1, converted, true))
+            {
+                fprintf (stderr, "Could not convert %s.\n", args.file1);
+                if (converted) fclose (converted);
+                return EXIT_FAILURE;
+            }
+
+            fclose (ac.fp1);
+            ac.fp1 = converted;
+        }
+
+        if (!(flags & PATCH_FLAG_BASES) && args.sharedBases == NULL) bases.single (ac.fp1, (long)size1);
+
+        ret = applyPatchBody (ac, args.sharedBases ? *args.sharedBases : bases, ops, (long)size2, sections,
+                              resumeOutput, args);
+
+        if (ret == 0 && filter != FILTER_NONE)
+        {
+            fflush (ac.fp2);
+
+            if (0 != fseek (ac.fp2, 0L, SEEK_SET) || 0 != branchFilterFile (filter, ac.fp2, ac.fp2, false)) ret = -1;
+        }
     }
 
-    int ret = applyPatchBody (ac, blockSize, args);
+    FILE *& fpOut = args.flagInPlace ? ac.fp1 : ac.fp2;
 
     if (ret != 0)
     {
         fprintf(stderr, "Read/write error\n");
+
+        if (args.flagInPlace && 0 == readInPlaceJournal (args.file1, journal))
+        {
+            fprintf (stderr, "Run the same command again to resume patching %s.\n", args.file1);
+        }
+        else if (!args.flagInPlace && sections.chunkSize)
+        {
+            fprintf (stderr, "Run the same command again to resume building %s.\n", args.file2);
+        }
     }
     else 
     {
-        fseek (ac.fp2, 0L, SEEK_END);
-        actual_size2 = ftell (ac.fp2);
+        fseek (fpOut, 0L, SEEK_END);
+        actual_size2 = ftell (fpOut);
 
         if (actual_size2 != (long)size2)
         {
@@ -312,7 +897,7 @@ int applyPatch (const struct progArguments & args)
             return EXIT_FAILURE;
         }
 
-        getChecksum (ac.fp2, actual_checksum2);
+        getChecksum (fpOut, actual_checksum2);
 
         if (checksum2 != actual_checksum2)
         {
@@ -320,8 +905,13 @@ int applyPatch (const struct progArguments & args)
             return EXIT_FAILURE;
         }
 
-        fclose (ac.fp2);
-        ac.fp2 = nullptr;
+        fclose (fpOut);
+        fpOut = nullptr;
+
+        if (!args.flagInPlace && sections.chunkSize)
+        {
+            removeProgress (args.file2);
+        }
 
         if (!args.flagIgnoreTimestamps && is_valid (&time2))
         {
@@ -331,6 +921,9 @@ int applyPatch (const struct progArguments & args)
             }
         }
 
+        // output is verified, so it needs no checksum pass when used as a base.
+        if (!args.flagNoSidecars) saveFileChecksum (args.file2, actual_checksum2);
+
         if (!args.flagQuiet)
         {
             printf ("File successfully built.\n");
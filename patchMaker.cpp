@@ -15,97 +15,70 @@
 
 #ifndef _MSC_VER
 #include <unistd.h>
+#else
+#include <io.h>
 #endif
 
+#include <sys/stat.h>
+
 #include <new>
 #include <assert.h>
-
-#define USE_MAP
-
-#ifdef USE_MAP
-#include <unordered_map>
 #include <vector>
-#include <utility>
-#endif
+#include <unordered_map>
+#include <thread>
+#include <atomic>
 
-#include <algorithm> // lower_bound
+#include <algorithm> // min, max
+#include <random>
+#include <math.h>
 
 #include "common.h"
 #include "progArgs.h"
 
 #include "checksum.h"
 #include "timeutil.h"
+#include "blockIndex.h"
+#include "pipeline.h"
+#include "bcjFilter.h"
+#include "patchOps.h"
 
 #include <chrono>
 
-#define W_BUFFER_SIZE 4096L
-#define USE_STD_BINARY_SEARCH  // only used wjen USE_MAP is off
-
-#define USE_MAP // comment out to use sorted list of RefStructs and binary search. The difference in performance is marginal.
-
-#ifndef USE_MAP
-
-struct RefStruct 
-{
-    uint32_t   checkValue;
-    uint32_t   index;
-
-    static int compareRefs (const void * _a, const void * _b)
-    {
-        const RefStruct * a = (RefStruct *)_a;
-        const RefStruct * b = (RefStruct *)_b;
-
-        if (a->checkValue < b->checkValue) return -1;
-        if (a->checkValue > b->checkValue) return 1;
-
-        if (a->index < b->index) return -1;
-        
-        if (a->index > b->index) return 1;
-
-        return 0;
-    }
-
-#ifdef USE_STD_BINARY_SEARCH
-    static bool ref_comp (const RefStruct & a, const unsigned long val)
-    {
-        return (a.checkValue < val);
-    }
-#endif     
-
-    static long RefIndex (unsigned long cSum, const RefStruct *elements, const int iCount)
-    {
-#ifndef USE_STD_BINARY_SEARCH        
-        long index = 0, left, right;
-        left = 0;
-        right = iCount - 1;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-        while (left <= right)
-        {
-            index = (left + right) >> 1;
-            if (cSum == elements[index].checkValue) break;
-            else if (cSum < elements[index].checkValue) right = index - 1;
-            else left = index + 1;
-        }
+#define W_BUFFER_SIZE 4096L
 
-        if (cSum != elements[index].checkValue) return (-1L);
+#define SELF_CANDIDATES  16  // max. number of earlier output positions tried per lookup.
+#define SELF_MIN_LENGTH  12  // copy within output is longer to encode than file1 reference.
 
-        while (index > 0 && elements[index - 1].checkValue == cSum) index--;
+#define SCAN_BATCH       4096 // positions of file #2 fingerprinted at once.
+#define INDEX_READ_BLOCKS 65536 // blocks of file #1 read at once while building index.
+#define SCAN_PREFETCH    16   // distance (in positions) of index prefetch ahead of probe.
+#define SELF_FILTER_BITS 20   // log2 of bits in filter of self index checksums.
 
-        return index;
-#else         
+#define SKIP_TRIGGER     6    // log2 of misses in a row before scan step grows by one byte.
+#define SKIP_MAX_STEP    32   // longest scan step over data that does not match.
+#define SKIP_KEEP        (SKIP_MAX_STEP * 256) // bytes taken as is held back while skipping.
 
-        RefStruct *rs = std::lower_bound (elements, elements + iCount, cSum, ref_comp);
+#define REFINE_REGIONS   256  // regions of file #2 considered for refinement with --deadline.
+#define REFINE_MIN_REGION (64L << 10) // smallest refined region.
+#define REFINE_MIN_BYTES 1024 // regions taking fewer patch bytes are not refined (--deadline).
 
-        if (rs == nullptr) return -1L;
+#define ENDS_READ_SIZE   (1L << 20) // bytes of both files compared at once looking for common ends.
+#define ENDS_GAP_MAX     64   // longest changed stretch within common ends.
+#define ENDS_RESUME      32   // equal bytes after it needed to go on.
 
-        if (rs->checkValue != cSum) return -1;
+#define RUN_MIN_LENGTH   32   // shorter repeats of a pattern (not single byte) are left to other ops.
+#define RUN_READ_SIZE    65536 // bytes of file #2 compared at once while measuring a run.
 
-        return rs - elements;
-#endif         
-    }
+#define ESTIMATE_WINDOWS 64   // windows of file #2 sampled by --estimate.
+#define ESTIMATE_WINDOW_SIZE (64L << 10) // bytes of every sampled window.
 
-};
-#endif // USE_MAP
+#define APPROX_MIN_LENGTH 16  // shorter approximate extension of a match is not used.
+#define APPROX_MAX_LENGTH (1L << 20) // longest approximate extension of a match.
+#define APPROX_SLACK     32   // extension stops once its score drops this far below the best.
 
 // input is 8 byte buffer
 static uint32_t checkSum (const unsigned char *szBuff32, bool & left_right_match)
@@ -148,20 +121,265 @@ static bool EqSequence (const unsigned char *szBuff32) // all 8 bytes are the sa
     return (i == 8);
 }
 
-#ifdef USE_MAP
+// returns number of leading bytes equal in a and b, comparing 16 bytes at once where possible.
+static size_t matchingPrefix (const unsigned char *a, const unsigned char *b, size_t len)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i x = _mm_loadu_si128 ((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128 ((const __m128i *)(b + i));
+
+        unsigned diff = (unsigned)_mm_movemask_epi8 (_mm_cmpeq_epi8 (x, y)) ^ 0xFFFFU;
+
+        if (diff != 0) return i + __builtin_ctz (diff);
+    }
+#endif
+
+    while (i < len && a[i] == b[i]) i++;
+
+    return i;
+}
+
+// returns number of trailing bytes equal in a and b, comparing 16 bytes at once where possible.
+static size_t matchingSuffix (const unsigned char *a, const unsigned char *b, size_t len)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i x = _mm_loadu_si128 ((const __m128i *)(a + len - i - 16));
+        __m128i y = _mm_loadu_si128 ((const __m128i *)(b + len - i - 16));
+
+        unsigned diff = (unsigned)_mm_movemask_epi8 (_mm_cmpeq_epi8 (x, y)) ^ 0xFFFFU;
+
+        if (diff != 0) return i + __builtin_clz (diff) - 16;
+    }
+#endif
+
+    while (i < len && a[len - i - 1] == b[len - i - 1]) i++;
+
+    return i;
+}
+
+static long gcd (long a, long b)
+{
+    while (b != 0) { long t = a % b; a = b; b = t; }
+
+    return a;
+}
+
+// returns smallest period (2, 4, 8 or 16) of pattern repeated from the start of
+// data for at least RUN_MIN_LENGTH bytes, or zero.
+static int RunPeriod (const unsigned char *data, long len)
+{
+    for (int period = 2; period <= RUN_MAX_PERIOD; period *= 2)
+    {
+        if (len < RUN_MIN_LENGTH) break;
+
+        if (data[0] != data[period] || data[1] != data[period + 1]) continue;
+
+        if (matchingPrefix (data + period, data, RUN_MIN_LENGTH - period) == (size_t)(RUN_MIN_LENGTH - period)) return period;
+    }
+
+    return 0;
+}
+
+// returns length of run of given period starting at pos of file #2. The first
+// len bytes are already in data.
+static long RunLength (InputReader & in, const long pos, const long size2, const int period,
+            const unsigned char *data, const long len, bool & rwError)
+{
+    long runLen = period + (long)matchingPrefix (data + period, data, len - period);
+
+    if (runLen < len) return runLen;
+
+    // pattern repeated over buffer, so any phase of it can be compared at once.
+    std::vector<unsigned char> tile (RUN_READ_SIZE + RUN_MAX_PERIOD), buffer (RUN_READ_SIZE);
+
+    for (size_t i = 0; i < tile.size(); i++) tile[i] = data[i % period];
+
+    while (pos + runLen < size2)
+    {
+        long count = (std::min)((long)RUN_READ_SIZE, size2 - pos - runLen);
+
+        if (0 != in.read (pos + runLen, count, buffer.data())) { rwError = true; break; }
+
+        long same = (long)matchingPrefix (buffer.data(), &tile[runLen % period], count);
+
+        runLen += same;
+
+        if (same < count) break;
+    }
+
+    return runLen;
+}
+
+// fingerprints of whole blocks of file #2 at pos, pos + blockSize, ... are computed
+// as candidates need them: at least the first needed ones, twice as many as before
+// when more are read, but no more than available. returns false on read error.
+static bool fingerprints2 (std::vector<uint32_t> & prints, size_t needed, size_t available, const long pos,
+            const long blockSize, FILE *fp2, bool & rwError)
+{
+    if (prints.size() >= needed) return true;
+
+    unsigned char buffer [W_BUFFER_SIZE];
+
+    const size_t perRead = (size_t)(W_BUFFER_SIZE / blockSize);
+
+    for (size_t want = (std::min)((std::max)(needed, prints.size() * 2), available); prints.size() < want; )
+    {
+        size_t n = (std::min)(want - prints.size(), perRead);
+
+        if (0 != fseek (fp2, pos + (long)prints.size() * blockSize, SEEK_SET) || fread (buffer, n * blockSize, 1, fp2) != 1)
+        {
+            rwError = true;
+            return false;
+        }
+
+        for (size_t k = 0; k < n; k++) prints.push_back (blockFingerprint (buffer + k * blockSize, blockSize));
+    }
+
+    return true;
+}
+
+// number of equal bytes at offset1 of file #1 and offset2 of file #2, up to limit.
+static long matchLength (FILE *fp1, long offset1, FILE *fp2, long offset2, long limit, bool & rwError)
+{
+    unsigned char buffer1 [W_BUFFER_SIZE], buffer2[W_BUFFER_SIZE];
+
+    long j = 0;
+
+    for (long chunk = 64; j < limit; chunk = (std::min)(chunk * 2, W_BUFFER_SIZE))
+    {
+        size_t mx = (size_t)(std::min)(chunk, limit - j);
+
+        if (0 != fseek (fp1, offset1 + j, SEEK_SET) || fread (buffer1, mx, 1, fp1) != 1 ||
+            0 != fseek (fp2, offset2 + j, SEEK_SET) || fread (buffer2, mx, 1, fp2) != 1)
+        {
+            rwError = true;
+            return 0;
+        }
+
+        size_t z = matchingPrefix (buffer1, buffer2, mx);
+
+        j += (long)z;
+
+        if (z < mx) break;
+    }
+
+    return j;
+}
 
-static bool WorthReferring (const std::vector<uint32_t> * indexes, uint32_t & maxL, uint32_t & iStart, const long pos,
-            const long blockSize, FILE *fp1, FILE *fp2, const size_t file1_size, const size_t file2_size, bool & rwError)
+// Candidates are compared by block fingerprints of the index, without reading
+// file #1: a candidate has to match the block right after the longest match so
+// far before the blocks up to it are checked, so most of them are rejected by a
+// single comparison. Candidates matching as many blocks are told apart by their
+// bytes past the last block. Only the winner is compared byte by byte, which also
+// catches fingerprint collisions. Matches shorter than a block are looked for
+// byte by byte.
+static bool WorthReferring (const BlockIndex & index, const uint32_t * indexes, const uint32_t count, uint32_t & maxL,
+            uint32_t & iStart, const long pos, const long blockSize, FILE *fp1, FILE *fp2, const size_t file1_size,
+            const size_t file2_size, std::vector<uint32_t> & prints2, bool & rwError)
 {
+    if (indexes == nullptr || count == 0) return false;
+
+    const long blocks1 = (long)file1_size / blockSize, blocks2 = ((long)file2_size - pos) / blockSize;
+
+    long best = 0, bestTail = -1;
+    uint32_t iBest = 0;
+
+    prints2.clear ();
+
+    for (uint32_t k = 0; k < count; k++)
+    {
+        uint32_t i = indexes[k];
+
+        // indexes are in ascending order, so later candidates cannot match more blocks.
+        long limit = (std::min)(blocks1 - (long)i, blocks2);
+
+        if (limit < best || limit <= 0) break;
+
+        if (limit > best)
+        {
+            if (!fingerprints2 (prints2, best + 1, limit, pos, blockSize, fp2, rwError)) return false;
+
+            if (index.fingerprint (i + best) != prints2[best]) continue;
+        }
+
+        long j = 0;
+
+        while (j < best && index.fingerprint (i + j) == prints2[j]) j++;
+
+        if (j < best) continue;
+
+        for (j = best + (limit > best ? 1 : 0); j < limit; j++)
+        {
+            if (!fingerprints2 (prints2, j + 1, limit, pos, blockSize, fp2, rwError)) return false;
+
+            if (index.fingerprint (i + j) != prints2[j]) break;
+        }
+
+        if (j == best && best > 0)
+        {
+            // as many blocks as the best one: longer tail wins.
+            auto tailOf = [&] (uint32_t id) -> long {
+                long offset1 = (long)(id + best) * blockSize, offset2 = pos + best * blockSize;
+
+                return matchLength (fp1, offset1, fp2, offset2, (std::min)(blockSize,
+                                    (std::min)((long)file1_size - offset1, (long)file2_size - offset2)), rwError);
+            };
+
+            if (bestTail < 0) bestTail = tailOf (iBest);
+
+            long tail = tailOf (i);
+
+            if (rwError) return false;
+
+            if (tail > bestTail)
+            {
+                bestTail = tail;
+                iBest = i;
+            }
+
+            continue;
+        }
+
+        best = j;
+        bestTail = -1;
+        iBest = i;
+    }
+
+    if (best > 0)
+    {
+        long len = matchLength (fp1, (long)iBest * blockSize, fp2, pos,
+                                (std::min)((long)file1_size - (long)iBest * blockSize, (long)file2_size - pos), rwError);
+
+        fseek (fp2, pos, SEEK_SET);
+
+        if (rwError) return false;
+
+        if (len >= 8)
+        {
+            maxL = (uint32_t)len;
+            iStart = iBest;
+
+            return true;
+        }
+    }
+
     long j, lStart, lLongest = 0;
     uint32_t iLongest = 0;
 
     char buffer1 [W_BUFFER_SIZE], buffer2[W_BUFFER_SIZE];
 
-    if (indexes == nullptr || indexes->empty()) return false;
-
-    for (auto i : *indexes)
+    for (uint32_t k = 0; k < count; k++)
     {
+        uint32_t i = indexes[k];
+
         lStart = (long)i * blockSize;
 
         // indexes are in ascending order, so we can break if:
@@ -240,624 +458,2622 @@ static bool WorthReferring (const std::vector<uint32_t> * indexes, uint32_t & ma
   
     return false;
 }
-#else 
-static bool WorthReferring (const long index, uint32_t & maxL, uint32_t & iStart, const long pos,
-            const long blockSize, const RefStruct *refs, const long iCount, FILE *fp1, FILE *fp2, bool & rwError)
+
+// looks for the longest match of file #2 data at pos within data before pos (already
+// written to output by the time patch is applied). Most recent candidates are tried first.
+static bool WorthSelfReferring (const std::vector<uint32_t> * indexes, uint32_t & maxL, uint32_t & iStart,
+            const long pos, FILE *fp2, const size_t file2_size, bool & rwError)
 {
-    long i, j, lStart, lLongest = 0;
+    long lLongest = 0;
     uint32_t iLongest = 0;
-    int byte1, byte2;
 
     char buffer1 [W_BUFFER_SIZE], buffer2[W_BUFFER_SIZE];
 
-    if (index < 0) return false;
-
-    for (i = index; i < iCount; i++)
-    {
-        if (refs[i].checkValue != refs[index].checkValue) break;
+    if (indexes == nullptr || indexes->empty()) return false;
 
-        lStart = (long)refs[i].index * blockSize;
+    int tried = 0;
 
-        if (0 != fseek(fp1, lStart, SEEK_SET)) rwError = true;
+    for (auto it = indexes->rbegin(); it != indexes->rend() && tried < SELF_CANDIDATES; ++it, ++tried)
+    {
+        long src = *it;
 
-        if (0 != fseek(fp2, pos, SEEK_SET)) rwError = true;
+        // copy must not overlap with its own output.
+        long limit = (std::min)(pos - src, (long)file2_size - pos);
 
-        if (rwError)
-        {
-            return false;
-        }
+        if (limit <= lLongest) continue;
 
-        j = 0;
+        long j = 0;
 
-        if (lLongest > 0)
+        for (long chunk = 64; j < limit; chunk = (std::min)(chunk * 2, W_BUFFER_SIZE))
         {
-            long len = lLongest;
-
-            int mismatch = 0;
+            size_t mx = (std::min)(chunk, limit - j);
 
-            while (len > 0)
-            {
-                size_t mx = (std::min)(len, W_BUFFER_SIZE);
+            if (0 != fseek (fp2, src + j, SEEK_SET) || fread (buffer1, mx, 1, fp2) != 1) rwError = true;
 
-                if (fread (buffer1, mx, 1, fp1) != 1) { mismatch = 1; break; }
-                if (fread (buffer2, mx, 1, fp2) != 1) { mismatch = 1; break; }
+            if (0 != fseek (fp2, pos + j, SEEK_SET) || fread (buffer2, mx, 1, fp2) != 1) rwError = true;
 
-                if (memcmp (buffer1, buffer2, mx) != 0)
-                {
-                    mismatch = 1;
-                    break;
-                }
-                len -= (long)mx;
-            }
+            if (rwError) return false;
 
-            if (mismatch) continue;
+            size_t z = 0;
 
-            j = lLongest;
-        }
+            while (z < mx && buffer1[z] == buffer2[z]) z++;
 
-        for (; ; j++)
-        {
-            byte1 = fgetc(fp1);
-            byte2 = fgetc(fp2);
+            j += (long)z;
 
-            if (byte1==EOF || byte2==EOF) break;
-            if (byte1 != byte2) break;
+            if (z < mx) break;
         }
 
         if (j > lLongest)
         {
             lLongest = j;
-            iLongest = refs[i].index;
+            iLongest = (uint32_t)src;
         }
     }
 
     fseek(fp2, pos, SEEK_SET);
-  
-    if (lLongest >= 8)
+
+    if (lLongest >= SELF_MIN_LENGTH)
     {
         maxL = lLongest;
         iStart = iLongest;
 
         return true;
     }
-  
+
     return false;
 }
-#endif 
 
-////////////////////////////////////////////////////////////////////////////////////////////
+// stores value 7 bits per byte, lowest first. returns number of bytes.
+static int putVarint (unsigned char *dest, uint32_t value)
+{
+    int n = 0;
+
+    for (; ; value >>= 7)
+    {
+        dest[n++] = (unsigned char)((value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+
+        if (value <= 0x7F) break;
+    }
+
+    return n;
+}
 
-static int createPatchBody (AutoClose & ac, 
-#ifndef USE_MAP
-            RefStruct *refs, int refCount, 
-#else  
-            const std::unordered_map<uint32_t, std::vector<uint32_t> > & u_map,           
-#endif 
-            long blockSize, long size1, long size2, const progArguments & args)
+// bytes taken by reference of len bytes.
+static long refSize (long len)
 {
-    unsigned char szBuff32 [8];
+    return len <= 255 ? 4 : (len <= 0xFFFFL ? 5 : 7);
+}
 
-    unsigned char szBuff [256];
+// bytes taken by n bytes as is.
+static long literalSize (long n)
+{
+    return n + 2 * ((n + 255) / 256);
+}
 
-    bool chStarted = false ;  // changed sequence. It was not found in file1 so it must be written as is.
+// smallest size of exact ops for exact match of exactLen bytes (src in file #1)
+// followed by count bytes with given differences: unchanged stretches which hold
+// a whole block of file #1 are referred to from its start, other bytes are taken
+// as is. Patch is not compressed, so this is what approximate match competes with.
+static long exactEncodingSize (const std::vector<unsigned char> & diffs, long count, long src, long exactLen,
+            long blockSize)
+{
+    long size = refSize (exactLen), literal = 0;
 
-    bool rwError = false;
+    for (long i = 0; i < count; )
+    {
+        if (diffs[i] != 0)
+        {
+            literal++;
+            i++;
+            continue;
+        }
 
-    uint8_t bLen = 0;
+        long start = i;
 
-    int32_t iLen = 0;
-#ifndef USE_MAP    
-    long index = 0;
-#else 
-    const std::vector<uint32_t> * indexes_ptr = NULL;
-#endif     
+        for (; i < count && diffs[i] == 0; i++);
 
-    PatchStats stats;
+        long from = src + exactLen + start, to = src + exactLen + i;
+        long aligned = (from + blockSize - 1) / blockSize * blockSize;
 
-    FILE *fp1 = ac.fp1;
-    FILE *fp2 = ac.fp2;
-    FILE *fp3 = ac.fp3;
+        if (aligned + blockSize <= to)
+        {
+            size += literalSize (literal + aligned - from) + refSize (to - aligned);
+            literal = 0;
+        }
+        else
+        {
+            literal += i - start;
+        }
+    }
+
+    return size + literalSize (literal);
+}
+
+// extends exact match (src in file #1, pos in file #2, exactLen bytes long) through
+// mismatching bytes while most of the bytes still match: like bsdiff, takes the
+// extension with most matching minus mismatching bytes. Fills groups with
+// (unchanged count, changed count, changed bytes minus file #1 bytes) covering the
+// whole extended match. returns extension length, zero when there is none or when
+// the approximate match would take more bytes than exact ops for the same span.
+static long ApproxExtension (FILE *fp1, FILE *fp2, const long src, const long pos, const long exactLen,
+            const long size1, const long size2, const long blockSize, std::vector<unsigned char> & groups,
+            bool & rwError)
+{
+    long limit = (std::min)(APPROX_MAX_LENGTH, (std::min)(size1 - src, size2 - pos) - exactLen);
 
-    long pos = 0;
+    if (limit < APPROX_MIN_LENGTH) return 0;
 
-    for (pos = 0; (pos < size2) && !rwError; )
+    unsigned char buffer1 [W_BUFFER_SIZE], buffer2[W_BUFFER_SIZE];
+
+    std::vector<unsigned char> diffs;
+
+    long score = 0, best = 0, bestLen = 0, j = 0;
+
+    for (long chunk = 64; j < limit && score > best - APPROX_SLACK; chunk = (std::min)(chunk * 2, W_BUFFER_SIZE))
     {
-        if (size2 - pos >= 8)
+        size_t mx = (std::min)(chunk, limit - j);
+
+        if (0 != fseek (fp1, src + exactLen + j, SEEK_SET) || fread (buffer1, mx, 1, fp1) != 1) rwError = true;
+
+        if (0 != fseek (fp2, pos + exactLen + j, SEEK_SET) || fread (buffer2, mx, 1, fp2) != 1) rwError = true;
+
+        if (rwError) return 0;
+
+        for (size_t z = 0; z < mx && score > best - APPROX_SLACK; z++, j++)
         {
-            if (chStarted)
-            {
-                fseek(fp2, pos + 7, SEEK_SET);
+            unsigned char d = (unsigned char)(buffer2[z] - buffer1[z]);
 
-                for (int i=0; i < 7; i++) { szBuff32[i] = szBuff32[i+1]; }
-                
-                if (fread(szBuff32 + 7, 1, 1, fp2) != 1) { rwError = true; }
-            }
-            else
+            diffs.push_back (d);
+
+            score += (d == 0) ? 1 : -1;
+
+            if (score > best)
             {
-                fseek(fp2, pos, SEEK_SET);
-                if (fread(szBuff32, 8, 1, fp2) != 1) { rwError = true; }
+                best = score;
+                bestLen = j + 1;
             }
+        }
+    }
 
-            bool leftRightMatch = false;
+    if (bestLen < APPROX_MIN_LENGTH) return 0;
 
-            unsigned long lSum = checkSum (szBuff32, leftRightMatch);
+    groups.clear ();
 
-            if (lSum == 0L || (leftRightMatch && EqSequence (szBuff32)))
-            {
-                if (chStarted)
-                {
-                    stats.as_is_length += iLen;
-                    stats.as_is_count++;
+    unsigned char v [10];
 
-                    bLen = iLen - 1;
-                    fwrite (&bLen, 1, 1, fp3);
-                    if (fwrite(szBuff, iLen, 1, fp3) != 1) { rwError = true; }
-                    chStarted = 0;
-                }
+    for (long i = 0, same = exactLen; i < bestLen; same = 0)
+    {
+        for (; i < bestLen && diffs[i] == 0; i++) same++;
 
-                iLen = 8;
-                pos += 8;
-        
-                while ((iLen < 256) && (getc(fp2) == *szBuff32))
-                    pos++, iLen++;
-
-                bLen = BYTE_PATCH_SEQ;  // 4 is flag for sequence.
-        
-                fwrite (&bLen, 1, 1, fp3);
-                bLen = iLen - 1;
-                fwrite (&bLen, 1, 1, fp3);
-                bLen = *szBuff32;
-                if (fwrite (&bLen, 1, 1, fp3) != 1) { rwError = true; }
-                continue;
-            }
-            else 
-            {
-#ifndef USE_MAP                
-                index = RefStruct::RefIndex (lSum, refs, refCount);
-#else 
-                auto it = u_map.find(lSum);
+        long start = i;
 
-                if (it == u_map.end())
-                {
-                    indexes_ptr = NULL;
-                }
-                else 
-                {
-                    indexes_ptr = &(it->second);
-                }
-#endif                 
-            }
-        }
-        else // last 8 bytes of "new" file, we cannof fully read all 8 bytes.
-        {
-            fseek (fp2, pos, SEEK_SET);
-            if (fread (szBuff32, 1, 1, fp2) != 1) { rwError = true; }
-#ifndef USE_MAP            
-            index = -1L;
-#else 
-            indexes_ptr = NULL;
-#endif             
-        }
+        for (; i < bestLen && diffs[i] != 0; i++);
 
-        uint32_t maxLen = 0;
+        int n = putVarint (v, (uint32_t)same);
 
-        uint32_t iStart = 0;
+        n += putVarint (v + n, (uint32_t)(i - start));
 
-#ifndef USE_MAP
-        bool useRef = WorthReferring (index, maxLen, iStart, pos, blockSize, refs, refCount, fp1, fp2, rwError);
-#else 
-        bool useRef = WorthReferring (indexes_ptr, maxLen, iStart, pos, blockSize, fp1, fp2, size1, size2, rwError);
-#endif         
+        groups.insert (groups.end(), v, v + n);
+        groups.insert (groups.end(), diffs.begin() + start, diffs.begin() + i);
+    }
 
-        if (rwError) break;
+    // op byte, 4-byte offset, varint length and groups.
+    long approxSize = 1 + 4 + putVarint (v, (uint32_t)(exactLen + bestLen)) + (long)groups.size();
 
-        if (!useRef)
-        {
-            if (chStarted)
-            {
-                pos++;
-                szBuff[iLen] = *szBuff32;
-                iLen++;
-                if (iLen == 256)
-                {
-                    stats.as_is_length += 256;
-                    stats.as_is_count++;
-                    stats.as_is_maxed++;
-
-                    bLen = 255;
-                    fwrite(&bLen, 1, 1, fp3);
-                    if (fwrite(szBuff, 256, 1, fp3) != 1) rwError = true;
-                    chStarted = 0;
-                }
-            }
-            else
+    if (approxSize >= exactEncodingSize (diffs, bestLen, src, exactLen, blockSize)) return 0;
+
+    return bestLen;
+}
+
+// collects seek table while patch body is written: for every interval boundary
+// of output, the op covering it. Ops are reported in output order as they start.
+struct SeekTableBuilder
+{
+    explicit SeekTableBuilder (uint32_t interval) : interval(interval), next(0), lastStart(0), lastPatch(0) {}
+
+    void opStarts (long outPos, long patchPos)
+    {
+        if (interval == 0) return;
+
+        for (; next < outPos; next += interval)
+        {
+            SeekEntry entry = { lastPatch, lastStart };
+            entries.push_back (entry);
+        }
+
+        lastStart = (uint64_t)outPos;
+        lastPatch = (uint64_t)patchPos;
+    }
+
+    // adds boundaries covered by the last op.
+    void finish (long size2) { opStarts (size2, 0); }
+
+    uint32_t interval;  // zero when no table is made.
+    long next;          // next boundary.
+    uint64_t lastStart, lastPatch;
+    std::vector<SeekEntry> entries;
+};
+
+// part of file #2 equal to file #1 at start1.
+struct EqualRange
+{
+    long start2;
+    long start1;
+    long length;
+};
+
+// parts of file #2 equal to file #1 at the same distance from start (prefix) or
+// end (suffix), see findCommonEnds.
+struct CommonEnds
+{
+    std::vector<EqualRange> ranges;  // ascending.
+    long prefixEnd;    // offset (in both files) where prefix ranges end.
+    long suffixStart;  // file #1 offset where suffix ranges start.
+    long growth;       // size of file #2 minus size of file #1.
+
+    CommonEnds () : prefixEnd(0), suffixStart(0), growth(0) {}
+};
+
+// reads len bytes at offset1 of fp1 and offset2 of fp2. returns zero on success.
+static int readBoth (FILE *fp1, long offset1, FILE *fp2, long offset2, long len, unsigned char *a, unsigned char *b)
+{
+    if (0 != fseek (fp1, offset1, SEEK_SET) || fread (a, len, 1, fp1) != 1) return -1;
+    if (0 != fseek (fp2, offset2, SEEK_SET) || fread (b, len, 1, fp2) != 1) return -1;
+
+    return 0;
+}
+
+// finds where file2 equals file1 from the start (prefix) and up to the end (suffix)
+// of both, comparing large pieces 16 bytes at a time. Both step over changed
+// stretches of up to ENDS_GAP_MAX bytes followed by ENDS_RESUME equal ones, such
+// as a rewritten header field. returns zero on success.
+static int findCommonEnds (const char *file1, const char *file2, CommonEnds & ends)
+{
+    AutoClose ac;
+
+    ac.fp1 = fopen (file1, "rb");
+    ac.fp2 = fopen (file2, "rb");
+
+    if (ac.fp1 == NULL || ac.fp2 == NULL || 0 != fseek (ac.fp1, 0, SEEK_END) || 0 != fseek (ac.fp2, 0, SEEK_END)) return -1;
+
+    const long size1 = ftell (ac.fp1), size2 = ftell (ac.fp2), common = (std::min)(size1, size2);
+
+    std::vector<unsigned char> a (ENDS_READ_SIZE), b (ENDS_READ_SIZE);
+
+    ends = CommonEnds ();
+
+    long pos = 0, start = 0;
+
+    while (pos < common)
+    {
+        long len = (std::min)(ENDS_READ_SIZE, common - pos);
+
+        if (0 != readBoth (ac.fp1, pos, ac.fp2, pos, len, a.data(), b.data())) return -1;
+
+        long same = (long)matchingPrefix (a.data(), b.data(), len);
+
+        pos += same;
+
+        if (same == len) continue;
+
+        // pos differs: equal bytes go on after a short gap or the prefix ends here.
+        long n = (std::min)((long)(ENDS_GAP_MAX + ENDS_RESUME), common - pos), gap = 1;
+
+        if (0 != readBoth (ac.fp1, pos, ac.fp2, pos, n, a.data(), b.data())) return -1;
+
+        while (gap + ENDS_RESUME <= n && matchingPrefix (&a[gap], &b[gap], ENDS_RESUME) < ENDS_RESUME) gap++;
+
+        if (gap > ENDS_GAP_MAX || gap + ENDS_RESUME > n) break;
+
+        if (pos > start) ends.ranges.push_back (EqualRange { start, start, pos - start });
+
+        start = pos = pos + gap;
+    }
+
+    if (pos > start) ends.ranges.push_back (EqualRange { start, start, pos - start });
+
+    ends.prefixEnd = pos;
+
+    // suffix: bytes before the last len of both files, not overlapping prefix.
+    std::vector<EqualRange> suffix;
+
+    const long limit = common - ends.prefixEnd;
+
+    long tail = 0, end = 0;
+
+    while (tail < limit)
+    {
+        long len = (std::min)(ENDS_READ_SIZE, limit - tail);
+
+        if (0 != readBoth (ac.fp1, size1 - tail - len, ac.fp2, size2 - tail - len, len, a.data(), b.data())) return -1;
+
+        long same = (long)matchingSuffix (a.data(), b.data(), len);
+
+        tail += same;
+
+        if (same == len) continue;
+
+        long n = (std::min)((long)(ENDS_GAP_MAX + ENDS_RESUME), limit - tail), gap = 1;
+
+        if (0 != readBoth (ac.fp1, size1 - tail - n, ac.fp2, size2 - tail - n, n, a.data(), b.data())) return -1;
+
+        while (gap + ENDS_RESUME <= n && matchingSuffix (a.data(), b.data(), n - gap) < ENDS_RESUME) gap++;
+
+        if (gap > ENDS_GAP_MAX || gap + ENDS_RESUME > n) break;
+
+        if (tail > end) suffix.push_back (EqualRange { size2 - tail, size1 - tail, tail - end });
+
+        end = tail = tail + gap;
+    }
+
+    if (tail > end) suffix.push_back (EqualRange { size2 - tail, size1 - tail, tail - end });
+
+    ends.suffixStart = size1 - tail;
+    ends.growth = size2 - size1;
+
+    ends.ranges.insert (ends.ranges.end(), suffix.rbegin(), suffix.rend());
+
+    return 0;
+}
+
+// how createPatchBody matches file #2.
+struct ScanOptions
+{
+    bool approx;      // extend matches through changed bytes.
+    bool accelerate;  // probe data that does not match at growing steps.
+    bool limited;     // once deadline passes, the rest is taken as is.
+    std::chrono::high_resolution_clock::time_point deadline;
+    const CommonEnds *ends;  // referred to without probing, when set.
+
+    ScanOptions (bool approx, bool accelerate) : approx(approx), accelerate(accelerate), limited(false), ends(nullptr) {}
+};
+
+// bytes of file #2 taken as is, written as sequences of up to 256 bytes once
+// something else follows. Some may be held back, so a match found late can
+// still take the bytes before it.
+struct PendingLiterals
+{
+    // writes pending bytes but the last keep ones (whole sequences only when
+    // keeping some), pos being the output offset right after pending bytes.
+    void flush (size_t keep, long pos, OutputWriter & out, SeekTableBuilder & seek, PatchStats & stats)
+    {
+        size_t done = 0;
+
+        for (size_t left = bytes.size(); left > 0 && (keep == 0 || left >= keep + 256); )
+        {
+            size_t n = (std::min)(left, (size_t)256);
+
+            seek.opStarts (pos - (long)left, PAT_HEADER_SIZE + out.position());
+
+            unsigned char head [2] = { 0, (unsigned char)(n - 1) };
+
+            out.write (head, 2);
+            out.write (&bytes[done], n);
+
+            stats.as_is_length += (long)n;
+            stats.as_is_count++;
+            if (n == 256) stats.as_is_maxed++;
+
+            done += n;
+            left -= n;
+        }
+
+        bytes.erase (bytes.begin(), bytes.begin() + done);
+    }
+
+    std::vector<unsigned char> bytes;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef __linux__
+// file #1 made of several base files, read through BaseFiles when they are not
+// loaded in memory. Streams of all threads share the files.
+struct BaseStream
+{
+    const BaseFiles *files;
+    long pos;
+};
+
+static ssize_t baseStreamRead (void *cookie, char *buffer, size_t size)
+{
+    BaseStream *stream = (BaseStream *)cookie;
+
+    size_t len = (size_t)(std::max)(0L, (std::min)((long)size, stream->files->size() - stream->pos));
+
+    if (len > 0 && !stream->files->read (buffer, len, stream->pos)) return -1;
+
+    stream->pos += (long)len;
+
+    return (ssize_t)len;
+}
+
+static int baseStreamSeek (void *cookie, off64_t *offset, int whence)
+{
+    BaseStream *stream = (BaseStream *)cookie;
+
+    long pos = (long)*offset + (whence == SEEK_CUR ? stream->pos : whence == SEEK_END ? stream->files->size() : 0L);
+
+    if (pos < 0) return -1;
+
+    *offset = stream->pos = pos;
+
+    return 0;
+}
+
+static int baseStreamClose (void *cookie)
+{
+    delete (BaseStream *)cookie;
+
+    return 0;
+}
+#endif
+
+// opens file #1, or with several base files (files set) their concatenation.
+// returns NULL on failure.
+static FILE *openBase (const char *file1, const BaseFiles & files)
+{
+    if (files.count() > 1)
+    {
+#ifdef __linux__
+        BaseStream *stream = new BaseStream ();
+
+        stream->files = &files;
+        stream->pos = 0;
+
+        cookie_io_functions_t io = { baseStreamRead, NULL, baseStreamSeek, baseStreamClose };
+
+        FILE *fp = fopencookie (stream, "rb", io);
+
+        if (fp == NULL) delete stream;
+
+        return fp;
+#else
+        return NULL; // several base files are always loaded.
+#endif
+    }
+
+    return fopen (file1, "rb");
+}
+
+// checksums blocks [first, last) of file #1, from image when it is in memory or
+// else from file read in large pieces. Pieces within holes of file #1 are not
+// read. returns zero on success.
+static int checksumBlocks (const char *file1, const BaseFiles & files, const char *image, const long blockSize,
+            const long size1,
+            unsigned long first, const unsigned long last, const std::vector<FileHole> & holes1,
+            uint32_t *sums, uint32_t *prints)
+{
+    bool dummy = false;
+
+    // blocks wholly inside file #1 get fingerprints, the few last ones do not.
+    const unsigned long whole = (unsigned long)(size1 / blockSize);
+
+    if (image)
+    {
+        for (unsigned long i = first; i < last; i++)
+        {
+            sums[i] = checkSum ((const unsigned char *)image + i * blockSize, dummy);
+            prints[i] = i < whole ? blockFingerprint (image + i * blockSize, blockSize) : 0;
+        }
+
+        return 0;
+    }
+
+    FILE *fp = openBase (file1, files);
+
+    if (fp == NULL) return -1;
+
+    std::vector<unsigned char> buffer (INDEX_READ_BLOCKS * blockSize + 8);
+
+    bool ok = true;
+
+    size_t hole = 0;
+
+    const std::vector<unsigned char> zeros (blockSize + 8, 0);
+
+    const uint32_t zeroSum = checkSum (zeros.data(), dummy);
+
+    const uint32_t zeroPrint = blockFingerprint (zeros.data(), blockSize);
+
+    for (; ok && first < last; first += INDEX_READ_BLOCKS)
+    {
+        unsigned long count = (std::min)(last - first, (unsigned long)INDEX_READ_BLOCKS);
+
+        long start = (long)first * blockSize;
+
+        // whole blocks are read for fingerprints, the last block of file only up to its 8 bytes.
+        size_t len = (size_t)(std::min)((long)count * blockSize, size1 - start);
+
+        while (hole < holes1.size() && holes1[hole].end <= start) hole++;
+
+        if (hole < holes1.size() && holes1[hole].start <= start && holes1[hole].end >= start + (long)len)
+        {
+            for (unsigned long k = 0; k < count; k++)
             {
-                pos++;
-                bLen = 0;
-                fwrite (&bLen, 1, 1, fp3);
-                *szBuff = *szBuff32;
-                chStarted = 1;
-                iLen = 1;
+                sums[first + k] = zeroSum;
+                prints[first + k] = first + k < whole ? zeroPrint : 0;
             }
+
+            continue;
         }
-        else // referring pos.
+
+        if (0 != fseek (fp, start, SEEK_SET) || fread (buffer.data(), len, 1, fp) != 1) ok = false;
+
+        for (unsigned long k = 0; ok && k < count; k++)
         {
-            stats.refs_length += maxLen;
-            stats.refs_count++;
-            stats.refs_longest = (std::max)(stats.refs_longest, (long)maxLen);
+            sums[first + k] = checkSum (&buffer[k * blockSize], dummy);
+            prints[first + k] = first + k < whole ? blockFingerprint (&buffer[k * blockSize], blockSize) : 0;
+        }
+    }
 
-            pos += maxLen;
+    fclose (fp);
 
-            if (chStarted)
-            {
-                stats.as_is_length += iLen;
-                stats.as_is_count++;
+    return ok ? 0 : -1;
+}
 
-                bLen = iLen-1;
-                fwrite (&bLen, 1, 1, fp3);
-                if (fwrite(szBuff, iLen, 1, fp3) != 1) { rwError = true; }
-                chStarted = 0;
-            }
+// checksums and fingerprints blocks [first, last) of file #1 and builds index of
+// them, both using several threads over disjoint block ranges. returns zero on success.
+static int buildIndex (const char *file1, const BaseFiles & files, const char *image, const long blockSize,
+            const long size1, const unsigned long iCount, const unsigned long first, const unsigned long last,
+            BlockIndex & index)
+{
+    std::vector<uint32_t> sums (iCount), prints (iCount);
 
-            uint16_t wStart = iStart & 0xFFFF;
+    std::vector<FileHole> holes1;
 
-            iStart >>= 16;
+    if (image == NULL)
+    {
+        FILE *fp = fopen (file1, "rb");
 
-            if (maxLen <= 255)
-            {
-                bLen = (iStart << 2) + 1;
+        if (fp == NULL) return -1;
 
-                fwrite (&bLen, 1, 1, fp3);
-                fwrite (&wStart, 2, 1, fp3);
-                bLen = maxLen;
-                if (fwrite(&bLen, 1, 1, fp3) != 1) { rwError = true; }
-            }
-            else if (maxLen <= 0xFFFFL)
+        // holes of file1 itself, other base files follow it.
+        getFileHoles (fileno (fp), files.count() > 1 ? files.sizeOf (0) : size1, holes1);
+
+        fclose (fp);
+    }
+
+    const unsigned long count = last - first;
+
+    int threads = (int)(std::min)((unsigned long)(std::max)(1U, std::thread::hardware_concurrency()),
+                                  count / INDEX_READ_BLOCKS + 1);
+
+    std::vector<int> results (threads, 0);
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++)
+    {
+        unsigned long from = first + count * t / threads, to = first + count * (t + 1) / threads;
+
+        workers.push_back (std::thread ([&, t, from, to] () {
+            results[t] = checksumBlocks (file1, files, image, blockSize, size1, from, to, holes1, sums.data(), prints.data());
+        }));
+    }
+
+    for (auto & th : workers) th.join();
+
+    for (int r : results)
+    {
+        if (r != 0) return -1;
+    }
+
+    return index.build (sums.data(), prints.data(), (uint32_t)iCount, (uint32_t)first, (uint32_t)last,
+                        (uint32_t)blockSize, (int)(std::max)(1U, std::thread::hardware_concurrency()));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Runs as a pipeline of three threads: file #2 is read sequentially ahead of
+// the scan by InputReader, matching is done here, and encoded ops are collected
+// into large buffers written to patch by OutputWriter. Only [begin, size2) of
+// file #2 is encoded (begin is nonzero when estimating from samples). Holes of
+// sparse file #2 become hole ops, and no other op runs into them. With accelerate,
+// data that keeps failing to match (compressed or encrypted) is probed at growing
+// steps, as LZ4 does, and byte by byte again after the next match. Once a deadline
+// passes, the rest of file #2 is taken as is, so the patch is still complete.
+static int createPatchBody (AutoClose & ac, const char *file2, const char *image2,
+            const BlockIndex & index, long blockSize, long selfStride, long size1,
+            long begin, long size2, const ScanOptions & options, const std::vector<FileHole> & holes2,
+            SeekTableBuilder & seek, PatchStats & stats)
+{
+    const bool approx = options.approx, accelerate = options.accelerate;
+
+    unsigned char szBuff32 [8];
+
+    PendingLiterals literals;  // changed sequence. It was not found in file1 so it must be written as is.
+
+    std::vector<uint32_t> prints2;  // block fingerprints of file #2 at pos, see WorthReferring.
+
+    bool rwError = false;
+
+    uint8_t bLen = 0;
+
+    int32_t iLen = 0;
+    const uint32_t * indexes_ptr = NULL;
+    uint32_t indexes_count = 0;
+
+    // positions of file #2 before pos, for copies within output. Grows as we go.
+    // Bit filter of its checksums saves most hash map lookups.
+    std::unordered_map<uint32_t, std::vector<uint32_t> > selfIndex;
+    std::vector<uint64_t> selfFilter ((1UL << SELF_FILTER_BITS) / 64);
+    const std::vector<uint32_t> * self_ptr = NULL;
+    long selfIndexed = begin;
+
+    std::vector<unsigned char> groups; // differences of approximate match.
+
+    // fingerprints of positions [scanStart, scanEnd) of file #2, computed a batch
+    // at a time, so index slots can be prefetched ahead of the probes.
+    std::vector<unsigned char> scanData (SCAN_BATCH + 7);
+    std::vector<uint32_t> scanSums (SCAN_BATCH);
+    std::vector<bool> scanMatch (SCAN_BATCH);
+    long scanStart = 0, scanEnd = 0;
+
+    FILE *fp1 = ac.fp1;
+    FILE *fp2 = ac.fp2;
+
+    InputReader in;
+    OutputWriter out;
+
+    if (0 != in.start (file2, image2, size2, begin) || 0 != out.start (ac.fp3)) return 1;
+
+    std::chrono::high_resolution_clock::time_point scanTime = std::chrono::high_resolution_clock::now();
+
+    long pos = begin;
+
+    size_t hole = 0;  // first hole not entirely before pos.
+
+    long misses = 0;  // positions probed in a row without a match.
+    long rescanEnd = 0;  // positions before it are probed one by one.
+
+    bool draining = false;  // deadline passed.
+
+    size_t range = 0;  // first common end range not before pos.
+
+    for (; (pos < size2) && !rwError; )
+    {
+        for (; selfIndexed + 8 <= pos; selfIndexed += selfStride)
+        {
+            unsigned char szSelf [8];
+
+            if (0 != fseek (fp2, selfIndexed, SEEK_SET) || fread (szSelf, 8, 1, fp2) != 1) { rwError = true; break; }
+
+            bool dummy = false;
+
+            uint32_t sum = checkSum (szSelf, dummy);
+
+            selfIndex[sum].push_back ((uint32_t)selfIndexed);
+
+            uint32_t bit = (uint32_t)(sum * 2654435761U) >> (32 - SELF_FILTER_BITS);
+
+            selfFilter[bit / 64] |= 1ULL << (bit % 64);
+        }
+
+        if (rwError) break;
+
+        while (hole < holes2.size() && holes2[hole].end <= pos) hole++;
+
+        long nextHole = size2;  // ops end here at the latest.
+
+        if (hole < holes2.size() && holes2[hole].start <= pos)
+        {
+            literals.flush (0, pos, out, seek, stats);
+
+            long holeLen = (std::min)((std::min)(holes2[hole].end, size2) - pos, 0x7FFFFFFFL);
+
+            stats.hole_length += holeLen;
+            stats.hole_count++;
+
+            seek.opStarts (pos, PAT_HEADER_SIZE + out.position());
+
+            misses = 0;
+
+            unsigned char op [1 + 5];
+
+            op[0] = BYTE_PATCH_HOLE;
+
+            out.write (op, 1 + putVarint (op + 1, (uint32_t)holeLen));
+
+            pos += holeLen;
+
+            // zeros of the hole are not worth indexing for copies.
+            if (selfIndexed < pos) selfIndexed += (pos - selfIndexed) / selfStride * selfStride;
+
+            continue;
+        }
+
+        if (hole < holes2.size()) nextHole = (std::min)(holes2[hole].start, size2);
+
+        // common ends are referred to from their first block boundary of file #1
+        // on, only bytes before it are scanned.
+        long nextForced = size2;
+
+        if (options.ends)
+        {
+            const std::vector<EqualRange> & ranges = options.ends->ranges;
+
+            for (; range < ranges.size(); range++)
             {
-                bLen = (iStart << 2) + 2;
+                long from = (std::max)(pos, ranges[range].start2);
+                long src = ranges[range].start1 + (from - ranges[range].start2);
 
-                fwrite (&bLen, 1, 1, fp3);
-                fwrite (&wStart, 2, 1, fp3);
-                iLen = maxLen;
-                if (fwrite(&iLen, 2, 1, fp3) != 1) { rwError = true; }
+                from += (blockSize - src % blockSize) % blockSize;
+
+                if (from + 8 <= ranges[range].start2 + ranges[range].length)
+                {
+                    nextForced = from;
+                    break;
+                }
+            }
+        }
+
+        // past deadline, bytes are taken as is, common ends are still referred to.
+        if (draining && pos != nextForced)
+        {
+            long len = (std::min)((std::min)(nextHole, nextForced) - pos, (long)RUN_READ_SIZE);
+            size_t had = literals.bytes.size();
+
+            literals.bytes.resize (had + len);
+
+            if (0 != in.read (pos, len, &literals.bytes[had])) { rwError = true; break; }
+
+            pos += len;
+            stats.drain_length += len;
+
+            literals.flush (0, pos, out, seek, stats);
+            continue;
+        }
+
+        uint32_t maxLen = 0;
+
+        uint32_t iStart = 0;
+
+        if (pos == nextForced)
+        {
+            const EqualRange & r = options.ends->ranges[range];
+
+            maxLen = (uint32_t)((std::min)(r.start2 + r.length, nextHole) - pos);
+            iStart = (uint32_t)((r.start1 + (pos - r.start2)) / blockSize);
+
+            indexes_ptr = NULL;
+            self_ptr = NULL;
+        }
+        else if (size2 - pos >= 8)
+        {
+            // refill also when too little is left to recognize a repeated pattern.
+            if (pos < scanStart || pos >= scanEnd || (scanEnd + 7 - pos < RUN_MIN_LENGTH && scanEnd + 7 < size2))
+            {
+                if (options.limited && std::chrono::high_resolution_clock::now() >= options.deadline)
+                {
+                    draining = true;
+                    continue;
+                }
+
+                long count = (std::min)((long)SCAN_BATCH, size2 - 7 - pos);
+
+                if (0 != in.read (pos, count + 7, scanData.data())) { rwError = true; break; }
+
+                for (long k = 0; k < count; k++)
+                {
+                    bool match = false;
+
+                    scanSums[k] = checkSum (&scanData[k], match);
+                    scanMatch[k] = match;
+                }
+
+                for (long k = 0; k < (std::min)(count, (long)SCAN_PREFETCH); k++) index.prefetch (scanSums[k]);
+
+                scanStart = pos;
+                scanEnd = pos + count;
+            }
+
+            long k = pos - scanStart;
+
+            if (k + SCAN_PREFETCH < scanEnd - scanStart) index.prefetch (scanSums[k + SCAN_PREFETCH]);
+
+            memcpy (szBuff32, &scanData[k], 8);
+
+            bool leftRightMatch = scanMatch[k];
+
+            unsigned long lSum = scanSums[k];
+
+            // repeated pattern: single byte (quick check by checksum) or up to 16 bytes.
+            int period = (lSum == 0L || (leftRightMatch && EqSequence (szBuff32))) ? 1 :
+                         RunPeriod (&scanData[k], scanEnd + 7 - pos);
+
+            if (period != 0)
+            {
+                literals.flush (0, pos, out, seek, stats);
+
+                long runLen = RunLength (in, pos, size2, period, &scanData[k], scanEnd + 7 - pos, rwError);
+
+                runLen = (std::min)(runLen, nextHole - pos);
+
+                misses = 0;
+
+                if (rwError) break;
+
+                seek.opStarts (pos, PAT_HEADER_SIZE + out.position());
+
+                if (period == 1 && runLen <= 256)
+                {
+                    bLen = BYTE_PATCH_SEQ;  // 4 is flag for sequence.
+            
+                    out.write (&bLen, 1);
+                    bLen = runLen - 1;
+                    out.write (&bLen, 1);
+                    bLen = *szBuff32;
+                    out.write (&bLen, 1);
+                }
+                else
+                {
+                    runLen = (std::min)(runLen, 0x7FFFFFFFL);
+
+                    stats.run_length += runLen;
+                    stats.run_count++;
+
+                    // op, period, length as 7 bits per byte (lowest first), pattern.
+                    // Pattern is stored rotated, so byte of output position x is
+                    // pattern[x % period] wherever the run is split on apply.
+                    unsigned char run [2 + 5 + RUN_MAX_PERIOD];
+                    int n = 0;
+
+                    run[n++] = BYTE_PATCH_RUN;
+                    run[n++] = (unsigned char)period;
+
+                    n += putVarint (run + n, (uint32_t)runLen);
+
+                    for (int j = 0; j < period; j++) run[n + (pos + j) % period] = scanData[k + j];
+
+                    out.write (run, n + period);
+                }
+
+                pos += runLen;
+                continue;
+            }
+            else 
+            {
+                stats.probe_count++;
+
+                if (index.mayContain ((uint32_t)lSum))
+                {
+                    indexes_ptr = index.find ((uint32_t)lSum, indexes_count);
+                }
+                else
+                {
+                    stats.probe_filtered++;
+                    indexes_ptr = NULL;
+                }
+
+                uint32_t bit = (uint32_t)(lSum * 2654435761U) >> (32 - SELF_FILTER_BITS);
+
+                self_ptr = NULL;
+
+                if (selfFilter[bit / 64] & (1ULL << (bit % 64)))
+                {
+                    auto it = selfIndex.find ((uint32_t)lSum);
+
+                    if (it != selfIndex.end()) self_ptr = &(it->second);
+                }
+            }
+        }
+        else // last 8 bytes of "new" file, we cannof fully read all 8 bytes.
+        {
+            fseek (fp2, pos, SEEK_SET);
+            if (fread (szBuff32, 1, 1, fp2) != 1) { rwError = true; }
+            indexes_ptr = NULL;
+            self_ptr = NULL;
+        }
+
+        bool useRef = pos == nextForced ||
+                      WorthReferring (index, indexes_ptr, indexes_count, maxLen, iStart, pos, blockSize, fp1, fp2,
+                                      size1, size2, prints2, rwError);
+
+        uint32_t selfLen = 0;
+
+        uint32_t selfStart = 0;
+
+        bool useSelf = WorthSelfReferring (self_ptr, selfLen, selfStart, pos, fp2, nextHole, rwError) &&
+                       (!useRef || selfLen > maxLen + 4); // self copy takes up to 4 bytes more
+
+        if (rwError) break;
+
+        // match found while skipping may start within bytes just taken as is:
+        // those still pending are scanned again byte by byte.
+        if ((useRef || useSelf) && accelerate && (misses >> SKIP_TRIGGER) > 0 && pos > rescanEnd &&
+            !literals.bytes.empty())
+        {
+            rescanEnd = pos;
+            pos -= (long)literals.bytes.size();
+            literals.bytes.clear ();
+            misses = 0;
+            range = 0;
+            continue;
+        }
+
+        if (pos == nextForced)
+        {
+            stats.ends_length += maxLen;
+
+            // like holes, common ends are not indexed for copies: time stays proportional to changes.
+            if (selfIndexed < pos + (long)maxLen) selfIndexed += (pos + (long)maxLen - selfIndexed) / selfStride * selfStride;
+        }
+
+        if (useRef && pos + (long)maxLen > nextHole) maxLen = (uint32_t)(nextHole - pos);
+
+        if (!useRef && !useSelf)
+        {
+            // bytes up to the next probe are taken as is, they are still in scan batch.
+            long step = 1;
+
+            if (accelerate && size2 - pos >= 8 && pos >= rescanEnd)
+            {
+                step = (std::min)(1 + (misses >> SKIP_TRIGGER), (long)SKIP_MAX_STEP);
+
+                // file #1 is indexed every blockSize bytes: steps sharing no factor with
+                // it probe every offset within a block over blockSize probes.
+                while (step > 1 && gcd (step, blockSize) != 1) step--;
+
+                step = (std::min)(step, (std::min)(scanEnd - pos, (std::min)(nextHole, nextForced) - pos));
+
+                stats.skip_length += step - 1;
+            }
+
+            misses++;
+
+            for (long j = 0; j < step; j++)
+            {
+                literals.bytes.push_back ((j == 0) ? *szBuff32 : scanData[pos - scanStart]);
+                pos++;
+            }
+
+            if (!accelerate && literals.bytes.size() == 256) literals.flush (0, pos, out, seek, stats);
+            else if (literals.bytes.size() >= SKIP_KEEP + 4096) literals.flush (SKIP_KEEP, pos, out, seek, stats);
+        }
+        else // referring pos.
+        {
+            misses = 0;
+
+            literals.flush (0, pos, out, seek, stats);
+
+            if (useSelf)
+            {
+                stats.self_length += selfLen;
+                stats.self_count++;
+
+                seek.opStarts (pos, PAT_HEADER_SIZE + out.position());
+
+                pos += selfLen;
+
+                uint8_t width = selfLen <= 255 ? 1 : (selfLen <= 0xFFFFL ? 2 : 3);
+
+                bLen = BYTE_PATCH_SELF | (width << 4);
+
+                out.write (&bLen, 1);
+
+                out.write (&selfStart, 4);
+
+                out.write (&selfLen, width == 3 ? 4 : width);
+
+                continue;
+            }
+
+            long extLen = approx ? ApproxExtension (fp1, fp2, (long)iStart * blockSize, pos, maxLen,
+                                                    size1, nextHole, blockSize, groups, rwError) : 0;
+
+            if (rwError) break;
+
+            if (extLen > 0) // 4-byte file #1 offset, length, groups of differences.
+            {
+                stats.approx_length += maxLen + extLen;
+                stats.approx_count++;
+
+                unsigned char head [1 + 4 + 5];
+
+                uint32_t src = iStart * (uint32_t)blockSize;
+
+                head[0] = BYTE_PATCH_ADD;
+                memcpy (head + 1, &src, 4);
+
+                int n = 5 + putVarint (head + 5, (uint32_t)(maxLen + extLen));
+
+                seek.opStarts (pos, PAT_HEADER_SIZE + out.position());
+
+                out.write (head, n);
+                out.write (groups.data(), groups.size());
+
+                pos += maxLen + extLen;
+                continue;
+            }
+
+            stats.refs_length += maxLen;
+            stats.refs_count++;
+            stats.refs_longest = (std::max)(stats.refs_longest, (long)maxLen);
+
+            seek.opStarts (pos, PAT_HEADER_SIZE + out.position());
+
+            pos += maxLen;
+
+            uint16_t wStart = iStart & 0xFFFF;
+
+            iStart >>= 16;
+
+            if (maxLen <= 255)
+            {
+                bLen = (iStart << 2) + 1;
+
+                out.write (&bLen, 1);
+                out.write (&wStart, 2);
+                bLen = maxLen;
+                out.write (&bLen, 1);
+            }
+            else if (maxLen <= 0xFFFFL)
+            {
+                bLen = (iStart << 2) + 2;
+
+                out.write (&bLen, 1);
+                out.write (&wStart, 2);
+                iLen = maxLen;
+                out.write (&iLen, 2);
             }
             else
             {
                 bLen = (iStart << 2) + 3;
 
-                fwrite (&bLen, 1, 1, fp3);
-                fwrite (&wStart, 2, 1, fp3);
-                if (fwrite(&maxLen, 4, 1, fp3) != 1) { rwError = true; }
-            }
+                out.write (&bLen, 1);
+                out.write (&wStart, 2);
+                out.write (&maxLen, 4);
+            }
+        }
+    }  // end for
+
+    // write the tail portion
+
+    if (!rwError) literals.flush (0, pos, out, seek, stats);
+
+    if (!rwError)
+    {
+        bLen = BYTE_PATCH_EOF;
+        out.write (&bLen, 1);
+
+        seek.finish (size2);
+    }
+
+    if (0 != out.finish ()) rwError = true;
+
+    stats.scan_bytes = size2 - begin;
+    stats.scan_msec = (long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::high_resolution_clock::now() - scanTime).count();
+
+    return (rwError == false) ? 0 : 1;  
+}
+
+// appends chunk hash section: chunk size, xxHash64 of every chunk of file2, section length.
+static int writeChunkHashes (FILE *fp2, FILE *fp3, const long size2, const uint32_t chunkSize)
+{
+    std::vector<unsigned char> buffer (chunkSize);
+
+    if (0 != fseek (fp2, 0, SEEK_SET)) return -1;
+
+    if (fwrite (&chunkSize, 4, 1, fp3) != 1) return -1;
+
+    uint32_t sectionSize = 4;
+
+    for (long pos = 0; pos < size2; pos += chunkSize)
+    {
+        size_t len = (size_t)std::min ((long)chunkSize, size2 - pos);
+
+        if (fread (buffer.data(), len, 1, fp2) != 1) return -1;
+
+        uint64_t hash = xxHash64 (buffer.data(), len);
+
+        if (fwrite (&hash, 8, 1, fp3) != 1) return -1;
+
+        sectionSize += 8;
+    }
+
+    return (fwrite (&sectionSize, 4, 1, fp3) == 1) ? 0 : -1;
+}
+
+// replaces patch body with entire file2. returns zero on success.
+static int storeFile (FILE *fp2, FILE *fp3, const long size2)
+{
+    std::vector<char> buffer (PIPELINE_BLOCK_SIZE);
+
+    if (0 != fseek (fp2, 0, SEEK_SET) || 0 != fseek (fp3, PAT_HEADER_SIZE, SEEK_SET)) return -1;
+
+    for (long pos = 0; pos < size2; )
+    {
+        size_t len = (size_t)(std::min)(PIPELINE_BLOCK_SIZE, size2 - pos);
+
+        if (fread (buffer.data(), len, 1, fp2) != 1 || fwrite (buffer.data(), len, 1, fp3) != 1) return -1;
+
+        pos += (long)len;
+    }
+
+    if (0 != fflush (fp3)) return -1;
+
+#ifdef _MSC_VER
+    return (0 == _chsize_s (_fileno (fp3), PAT_HEADER_SIZE + size2)) ? 0 : -1;
+#else
+    return (0 == ftruncate (fileno (fp3), PAT_HEADER_SIZE + size2)) ? 0 : -1;
+#endif
+}
+
+static void printStats (const PatchStats & stats)
+{
+    printf ("\tAs-is length : %ld\n", stats.as_is_length);
+    printf ("\tAs-is count  : %ld (maxed %ld)\n", stats.as_is_count, stats.as_is_maxed);
+    printf ("\tRefs count   : %ld\n", stats.refs_count);
+    printf ("\tRefs length  : %ld\n", stats.refs_length);
+    printf ("\tRefs longest : %ld\n", stats.refs_longest);
+    printf ("\tSelf count   : %ld\n", stats.self_count);
+    printf ("\tSelf length  : %ld\n", stats.self_length);
+    printf ("\tRuns count   : %ld\n", stats.run_count);
+    printf ("\tRuns length  : %ld\n", stats.run_length);
+    printf ("\tApprox count : %ld\n", stats.approx_count);
+    printf ("\tApprox length: %ld\n", stats.approx_length);
+    printf ("\tHoles count  : %ld\n", stats.hole_count);
+    printf ("\tHoles length : %ld\n", stats.hole_length);
+    printf ("\tSkipped      : %ld\n", stats.skip_length);
+    printf ("\tDeadline cut : %ld\n", stats.drain_length);
+    printf ("\tRefined      : %ld region(s), %ld bytes, %ld patch bytes saved\n", stats.refine_count,
+            stats.refine_bytes, stats.refine_saved);
+    printf ("\tCommon ends  : %ld\n", stats.ends_length);
+    printf ("\tProbes       : %ld (%.1lf%% filtered)\n", stats.probe_count,
+            100.0 * stats.probe_filtered / (std::max)(stats.probe_count, 1L));
+    printf ("\tScan speed   : %.2lf MB/s\n", (double)stats.scan_bytes / 1048576.0 / (std::max)(stats.scan_msec, 1L) * 1000.0);
+}
+
+// how memory is spent, derived from --max-memory or the cgroup limit.
+struct MemoryPlan
+{
+    long long budget;   // zero when unlimited.
+    long selfStride;    // spacing of output positions indexed for self copies.
+    bool buffer1;       // keep entire file #1 in memory.
+    bool buffer2;       // keep entire new file in memory.
+    int threads;        // patches created in parallel.
+
+    MemoryPlan () : budget(0), selfStride(0), buffer1(true), buffer2(true), threads(1) {}
+};
+
+// file #1 data, shared (read only) by all patches created in one run.
+struct PatchBase
+{
+    struct ftime time1;
+    long size1;
+    uint32_t checksum1;
+    long blockSize;
+    unsigned long iCount;
+    bool buffered;
+    BlockIndex index;
+    MemoryPlan plan;
+    char *image; // entire file #1, only loaded when creating several patches.
+    std::vector<uint32_t> baseSizes;     // with several base files (file #1 is their
+    std::vector<uint32_t> baseChecksums; // concatenation) size and CRC of every one,
+    BaseFiles files;                     // and the files, read unless loaded.
+    bool limited;                        // --deadline set.
+    std::chrono::high_resolution_clock::time_point deadline;
+    CommonEnds ends;                     // with the only new file, left out of index.
+
+    PatchBase () : time1(ftime()), size1(0), checksum1(0), blockSize(0), iCount(0),
+                   buffered(false), image(NULL), limited(false) {}
+    ~PatchBase () { if (image) { free (image); image = NULL; } }
+};
+
+// outcome of creating a single patch.
+struct TargetResult
+{
+    int ret;
+    const char *note; // set when patch was skipped.
+    bool stored;      // file2 stored as is, patch would be larger.
+    long size2;
+    long patchSize;
+    double seconds;
+    PatchStats stats;
+
+    TargetResult () : ret(EXIT_FAILURE), note(NULL), stored(false), size2(0), patchSize(0), seconds(0) {}
+};
+
+// returns memory limit of the cgroup we run in, or zero when there is none.
+static long long getMemoryLimit ()
+{
+#ifdef __linux__
+    const char *files[] = { "/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes" };
+
+    for (const char *name : files)
+    {
+        FILE *fp = fopen (name, "r");
+
+        if (fp == NULL) continue;
+
+        long long limit = 0;
+
+        // "max" (cgroup v2) fails to parse and means no limit.
+        bool parsed = (fscanf (fp, "%lld", &limit) == 1);
+
+        fclose (fp);
+
+        // cgroup v1 reports a huge number when unlimited.
+        return (parsed && limit < (1LL << 60)) ? limit : 0;
+    }
+#endif
+    return 0;
+}
+
+#define SELF_ENTRY_BYTES 64  // approximate cost of one self index position.
+
+// splits memory budget between file #1 index, self index of every new file,
+// file buffers and threads. Without budget everything is buffered, as before.
+// Block size is raised when index would not fit, and self index gets sparser,
+// so the patch gets larger rather than creation failing.
+static void planMemory (const progArguments & args, const long size1, long & blockSize, MemoryPlan & plan)
+{
+    int targets = args.outputDir ? args.targetCount : 1;
+    long size2 = 0;
+
+    for (int t = 0; t < targets; t++)
+    {
+        long fsize = 0;
+        struct ftime time = ftime();
+
+        if (0 == getftime (args.outputDir ? args.targets[t] : args.file2, &time, &fsize)) size2 = (std::max)(size2, fsize);
+    }
+
+    plan.budget = args.maxMemory ? args.maxMemory : getMemoryLimit () / 4 * 3;
+
+    // with --both, each direction has half of the budget.
+    if (args.flagBoth)
+    {
+        plan.budget /= 2;
+        size2 = (std::max)(size2, size1);
+    }
+    plan.threads = (std::min)(targets, (int)(std::max)(1U, std::thread::hardware_concurrency()));
+    plan.buffer1 = plan.buffer2 = !args.flagDiskIO;
+    plan.selfStride = blockSize;
+
+    if (plan.budget == 0) return;
+
+    // index is built by all cores, see buildIndex.
+    const int indexThreads = (int)(std::max)(1U, std::thread::hardware_concurrency());
+
+    // index (with temporary checksums) takes at most half of the budget.
+    for (; blockSize < 256; blockSize++)
+    {
+        uint32_t count = (uint32_t)((size1 - 8 + blockSize) / blockSize);
+
+        if ((long long)(BlockIndex::estimateSize (count, indexThreads) + 12L * count) <= plan.budget / 2) break;
+    }
+
+    uint32_t count = (uint32_t)((size1 - 8 + blockSize) / blockSize);
+    long long rest = plan.budget - (long long)(BlockIndex::estimateSize (count, indexThreads) + 12L * count);
+
+    // whole file buffers from what is left, file #1 first as it is read randomly.
+    if (plan.buffer1 && size1 <= rest / 2) rest -= size1;
+    else plan.buffer1 = false;
+
+    // every thread needs a self index, and its new file buffer if there is room.
+    plan.threads = (int)(std::max)(1LL, (std::min)((long long)plan.threads, rest / (std::max)(size2, 1L) / 2));
+    plan.buffer2 = plan.buffer2 && (long long)plan.threads * size2 <= rest / 2;
+
+    if (plan.buffer2) rest -= (long long)plan.threads * size2;
+
+    // reader and writer buffers of every thread come first.
+    long long selfBudget = (std::max)(1LL, rest / plan.threads - 2LL * PIPELINE_BLOCKS * PIPELINE_BLOCK_SIZE);
+    long long stride = (long long)size2 / (std::max)(1LL, selfBudget / SELF_ENTRY_BYTES) + 1;
+
+    plan.selfStride = (long)(std::max)((long long)blockSize, (stride + blockSize - 1) / blockSize * blockSize);
+}
+
+#ifndef _MSC_VER
+// replaces fp (file of given size) with in-memory copy converted by branch filter.
+// image may already hold file contents, it receives memory which must outlive
+// fp. returns zero on success.
+static int filterOpenFile (FILE *& fp, char *& image, const long size, const int filter)
+{
+    char *data = image;
+
+    if (data == NULL)
+    {
+        data = (char *)malloc (size);
+
+        if (data == NULL || 0 != fseek (fp, 0, SEEK_SET) || fread (data, size, 1, fp) != 1)
+        {
+            free (data);
+            return -1;
+        }
+    }
+
+    branchFilterImage (filter, (unsigned char *)data, size, true);
+
+    FILE *memory = fmemopen (data, size, "rb");
+
+    if (memory == NULL)
+    {
+        if (data != image) free (data);
+        return -1;
+    }
+
+    fclose (fp);
+
+    fp = memory;
+    image = data;
+
+    return 0;
+}
+#endif
+
+// opens file #1 (args.file1, or args.file2 for the way back with --both) as ac.fp1,
+// computes its checksum and block index. returns zero on success.
+static int prepareBase (const progArguments & args, const char *file1, AutoClose & ac, PatchBase & base, bool shared)
+{
+    long fsize1 = 0;
+
+    if (sizeof(struct ftime) != 5)
+    {
+      fprintf(stderr, "Wrong time struct size. Cannot proceed.\n");
+      return -1;
+    }
+
+    int ret = getftime (file1, &base.time1, &fsize1);
+
+    if (0 != ret)
+    {
+        fprintf(stderr, "Could not get latest modification time for %s\n", file1);
+        return -1;
+    }
+
+    if (fsize1 == 0)
+    {
+        fprintf(stderr, "Input file %s size zero\n", file1);
+        return -1;
+    }
+
+    // other base files follow file #1, references address their concatenation.
+    long total1 = fsize1;
+
+    for (int i = 0; i < args.baseCount; i++)
+    {
+        struct ftime time = ftime();
+        long fsize = 0;
+
+        if (0 != getftime (args.bases[i], &time, &fsize) || fsize == 0)
+        {
+            fprintf(stderr, "Could not use base file %s\n", args.bases[i]);
+            return -1;
+        }
+
+        if (i == 0) base.baseSizes.push_back ((uint32_t)fsize1);
+
+        base.baseSizes.push_back ((uint32_t)fsize);
+        total1 += fsize;
+    }
+
+    if (total1 > 0xFFFFFFFFL)
+    {
+        fprintf (stderr, "Base files too large.\n");
+        return -1;
+    }
+
+    if (args.baseCount)
+    {
+        std::vector<std::string> names (1, file1);
+
+        names.insert (names.end(), args.bases, args.bases + args.baseCount);
+
+        base.files.lazy (names, base.baseSizes);
+    }
+
+    if (args.flagVerbose)
+    {
+        printf ("Latest modification time 1 : %s", timefToString (&base.time1) );
+    }
+
+    long size1 = total1;
+    long blockSize = 0;
+
+    if ((size1 - 8) < 0x40000L) 
+        blockSize = 4;
+    else
+    {
+        blockSize = (size1 - 8) >> 16;
+        if ((blockSize << 16) < size1 - 8) blockSize++;
+
+        if (args.flagMaximizeCompression)
+        {
+            blockSize = (size1 - 8) >> 18;
+            if ((blockSize << 18) < size1 - 8) blockSize++;
+        }
+    }
+
+    if (blockSize > 256)
+    {
+        printf ("Block size too large (%ld)\n", blockSize);
+        return -1;
+    }
+
+    planMemory (args, size1, blockSize, base.plan);
+
+    if (args.flagVerbose)
+    {
+        printf ("Block size %ld\n", blockSize);
+    }
+
+    unsigned long iCount = (size1 - 8 + blockSize) / blockSize;
+
+    if (iCount > 0x3FFFFF)
+    {
+        fprintf (stderr, "Input file too large.\n");
+        return -1;
+    }
+
+    if (args.flagVerbose)
+    {
+        printf ("Allocating %ld ref. points\n", iCount);
+    }
+
+    if (args.flagVerbose && base.plan.budget)
+    {
+        printf ("Memory plan for %lld KB: file 1 %s, new file %s, self copies every %ld bytes, %d thread(s)\n",
+                base.plan.budget >> 10, base.plan.buffer1 ? "buffered" : "unbuffered",
+                base.plan.buffer2 ? "buffered" : "unbuffered", base.plan.selfStride, base.plan.threads);
+    }
+
+    base.blockSize = blockSize;
+    base.iCount = iCount;
+
+#ifndef _MSC_VER
+    // several patches are created in parallel from one in-memory copy of file #1.
+    // Several base files are loaded as well when the memory plan has room for
+    // them, else they are read through BaseFiles.
+    bool load = base.plan.buffer1 && (shared || args.baseCount);
+#ifndef __linux__
+    load = load || args.baseCount;
+#endif
+    if (load)
+    {
+        base.image = (char *)malloc (size1);
+
+        long offset = 0;
+
+        for (int i = 0; base.image && i <= args.baseCount; i++)
+        {
+            const char *name = i ? args.bases[i - 1] : file1;
+            long len = base.baseSizes.empty() ? fsize1 : (long)base.baseSizes[i];
+
+            FILE *fp = fopen (name, "rb");
+
+            if (fp == NULL || fread (base.image + offset, len, 1, fp) != 1)
+            {
+                free (base.image);
+                base.image = NULL;
+            }
+            else if (args.baseCount)
+            {
+                // checksum of loaded data, base file is not read again.
+                base.baseChecksums.push_back (getBufferChecksum (base.image + offset, len));
+            }
+
+            if (fp) fclose (fp);
+
+            offset += len;
+        }
+
+        if (base.image)
+        {
+            ac.fp1 = fmemopen (base.image, size1, "rb");
+            base.buffered = (ac.fp1 != NULL);
+        }
+
+    }
+
+    if (ac.fp1 == NULL && args.baseCount)
+    {
+        base.baseChecksums.clear ();
+
+        ac.fp1 = openBase (file1, base.files);
+
+        if (ac.fp1 == NULL)
+        {
+            fprintf (stderr, "Could not open base files\n");
+            return -1;
+        }
+    }
+#endif
+
+    if (ac.fp1 == NULL)
+    {
+        ac.fp1 = fopen(file1, "rb");
+
+        if (ac.fp1 == NULL)
+        {
+            fprintf (stderr, "Could not open file %s\n", file1);
+            return -1;
+        }
+
+        // try buffering entire file in memory if possible.
+        if (base.plan.buffer1)
+        {
+            ac.buffer1 = (char *)malloc (fsize1);
+            if (ac.buffer1)
+            {
+                setvbuf (ac.fp1, ac.buffer1, _IOFBF, fsize1);
+                base.buffered = true;
+            }
+        }
+    }
+
+    fseek (ac.fp1, 0L, SEEK_END);
+    base.size1 = ftell(ac.fp1);
+
+    if (base.size1 != size1)
+    {
+        fprintf(stderr, "Stat and actual file size mismatch. Exiting.\n");
+        return -1;
+    }
+
+    // get checksum of file 1.
+
+    bool cached = false;
+
+    BaseFileKey key;  // identity of file #1 for index cache.
+
+    if (args.baseCount)
+    {
+        // header has CRC of file #1, the others are listed after patch body.
+        // Loaded base files have them already.
+        for (int i = (int)base.baseChecksums.size(); i <= args.baseCount; i++)
+        {
+            const char *name = i ? args.bases[i - 1] : file1;
+            uint32_t checksum = 0;
+
+            FILE *fp = fopen (name, "rb");
+
+            if (fp == NULL || 0 != getFileChecksum (name, fp, args.flagParanoid, checksum, cached, !args.flagNoSidecars))
+            {
+                if (fp) fclose (fp);
+                fprintf (stderr, "Failed calculating checksum\n");
+                return -1;
+            }
+
+            fclose (fp);
+
+            base.baseChecksums.push_back (checksum);
+        }
+
+        base.checksum1 = base.baseChecksums[0];
+    }
+    else if (args.flagIndexCache)
+    {
+        // cache is keyed by CRC along with identity of the very file checksummed.
+        if (0 != getFileKey (file1, ac.fp1, args.flagParanoid, key, cached, !args.flagNoSidecars))
+        {
+            fprintf (stderr, "Could not use index cache for %s\n", file1);
+            return -1;
+        }
+
+        base.checksum1 = key.checksum;
+    }
+    else if (0 != getFileChecksum (file1, ac.fp1, args.flagParanoid, base.checksum1, cached, !args.flagNoSidecars))
+    {
+        fprintf (stderr, "Failed calculating checksum\n");
+        return -1;
+    }
+
+    if (args.flagVerbose)
+    {
+        printf ("Cksum 1: %X%s\n", (int)base.checksum1, cached ? " (cached)" : "");
+    }
+
+#ifndef _MSC_VER
+    // index and matching work on converted file #1, its checksum stays that of the original.
+    if (args.branchFilter)
+    {
+        if (0 != filterOpenFile (ac.fp1, base.image, size1, args.branchFilter))
+        {
+            fprintf (stderr, "Could not convert %s\n", file1);
+            return -1;
+        }
+
+        free (ac.buffer1);
+        ac.buffer1 = NULL;
+        base.buffered = true;
+    }
+#endif
+
+    std::chrono::high_resolution_clock::time_point indexStart = std::chrono::high_resolution_clock::now();
+
+    bool cacheHit = false;
+
+    char szCacheName [PATH_MAX] = { 0 };
+
+    if (args.flagIndexCache)
+    {
+        // index of converted file #1 is kept separately.
+        int len = args.branchFilter ? snprintf (szCacheName, sizeof (szCacheName), "%s.%s.fci", file1, branchFilterName (args.branchFilter))
+                                    : snprintf (szCacheName, sizeof (szCacheName), "%s.fci", file1);
+
+        if (len >= (int)sizeof (szCacheName))
+        {
+            fprintf (stderr, "Could not use index cache for %s\n", file1);
+            return -1;
+        }
+
+        cacheHit = (0 == base.index.map (szCacheName, key, (uint32_t)blockSize, (uint32_t)iCount));
+
+        if (!cacheHit && args.flagVerbose)
+        {
+            printf ("Index cache %s missing or stale, rebuilding\n", szCacheName);
+        }
+    }
+
+    // common ends with new file are referred to as they are, only the middle of
+    // file #1 is indexed, along with as many bytes around it as new file has
+    // changed (appended lines are much like recent ones), unless most of file #1
+    // is there. Cached index is whole.
+    unsigned long first = 0, last = iCount;
+
+    if (!base.ends.ranges.empty())
+    {
+        const long margin = base.ends.suffixStart + base.ends.growth - base.ends.prefixEnd;
+
+        first = (unsigned long)((std::max)(0L, base.ends.prefixEnd - margin) / blockSize);
+        last = (std::max)(first, (std::min)(iCount, (unsigned long)((base.ends.suffixStart + margin + blockSize - 1) / blockSize)));
+
+        if (last - first > iCount / 2) base.ends = CommonEnds ();
+
+        if (args.flagIndexCache || base.ends.ranges.empty())
+        {
+            first = 0;
+            last = iCount;
+        }
+
+        if (args.flagVerbose && !base.ends.ranges.empty())
+        {
+            printf ("Common prefix %ld, suffix %ld bytes, blocks %lu to %lu indexed\n", base.ends.prefixEnd,
+                    size1 - base.ends.suffixStart, first, last);
+        }
+    }
+
+    if (!cacheHit)
+    {
+        if (0 != buildIndex (file1, base.files, base.image, blockSize, size1, iCount, first, last, base.index))
+        {
+            fprintf(stderr, "Read error. Exiting.\n");
+            return -1;
+        }
+
+        if (args.flagIndexCache && 0 != base.index.save (szCacheName, key))
+        {
+            fprintf (stderr, "Could not save index cache %s\n", szCacheName);
+        }
+    }
+
+    if (args.flagVerbose)
+    {
+        auto indexEnd = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(indexEnd - indexStart);
+
+        printf ("Index %s in %.2lf seconds (%ld bytes)\n", cacheHit ? "mapped" : "built",
+                0.001 * duration.count(), (long)base.index.memorySize());
+    }
+
+    return 0;
+}
+
+// copies len bytes at offset of one file to current position of another.
+// returns zero on success.
+static int copyRange (FILE *from, long offset, long len, FILE *to)
+{
+    std::vector<char> buffer (PIPELINE_BLOCK_SIZE);
+
+    if (0 != fseek (from, offset, SEEK_SET)) return -1;
+
+    while (len > 0)
+    {
+        size_t n = (size_t)(std::min)(len, PIPELINE_BLOCK_SIZE);
+
+        if (fread (buffer.data(), n, 1, from) != 1 || fwrite (buffer.data(), n, 1, to) != 1) return -1;
+
+        len -= (long)n;
+    }
+
+    return 0;
+}
+
+// Body of patch is first made with one kind of matching, its regions being
+// recorded (op covering every boundary), then regions taking at least minBytes
+// patch bytes, most first, are encoded again with given options and the shorter
+// encodings replace original ones: with --deadline cheap matching is followed by
+// full matching (every position probed, approximate matches) while time remains,
+// with --approx exact matching by approximate one, so that approximate matches
+// never make patch larger. Output is the same whichever way a region is
+// encoded, so copies of earlier output in later regions stay valid. Body
+// (positioned at its end) is rewritten in place. returns zero on success.
+static int refinePatchBody (const PatchBase & base, AutoClose & ac, const char *file2, const char *image2,
+            const long size2, const std::vector<FileHole> & holes2, const SeekTableBuilder & regions,
+            const ScanOptions & options, const long minBytes, PatchStats & stats)
+{
+    const long bodyEnd = ftell (ac.fp3);  // EOF sequence included.
+    const size_t count = regions.entries.size();
+
+    std::vector<size_t> order;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        long patchEnd = (i + 1 < count) ? (long)regions.entries[i + 1].patchPos : bodyEnd - 1;
+        long outEnd = (i + 1 < count) ? (long)regions.entries[i + 1].outPos : size2;
+
+        if (outEnd > (long)regions.entries[i].outPos && patchEnd - (long)regions.entries[i].patchPos >= minBytes)
+        {
+            order.push_back (i);
+        }
+    }
+
+    // most patch bytes first.
+    std::sort (order.begin(), order.end(), [&] (size_t a, size_t b) {
+        long lenA = ((a + 1 < count) ? (long)regions.entries[a + 1].patchPos : bodyEnd - 1) - (long)regions.entries[a].patchPos;
+        long lenB = ((b + 1 < count) ? (long)regions.entries[b + 1].patchPos : bodyEnd - 1) - (long)regions.entries[b].patchPos;
+        return lenA > lenB;
+    });
+
+    AutoClose refined;  // new encodings of regions, one after another.
+
+    refined.fp3 = tmpfile ();
+
+    if (refined.fp3 == NULL) return -1;
+
+    // new encoding of region: offset in refined file and length, zero when not replaced.
+    std::vector<long> newStart (count, 0), newLength (count, 0);
+
+    SeekTableBuilder noSeek (0);
+
+    FILE *body = ac.fp3;
+
+    for (size_t i : order)
+    {
+        if (options.limited && std::chrono::high_resolution_clock::now() >= options.deadline) break;
+
+        long outStart = (long)regions.entries[i].outPos;
+        long outEnd = (i + 1 < count) ? (long)regions.entries[i + 1].outPos : size2;
+        long length = ((i + 1 < count) ? (long)regions.entries[i + 1].patchPos : bodyEnd - 1) - (long)regions.entries[i].patchPos;
+
+        if (0 != fseek (refined.fp3, 0, SEEK_END)) return -1;
+
+        long start = ftell (refined.fp3);
+
+        PatchStats scratch;
+
+        ac.fp3 = refined.fp3;
+
+        int ret = createPatchBody (ac, file2, image2, base.index, base.blockSize, base.plan.selfStride, base.size1,
+                                   outStart, outEnd, options, holes2, noSeek, scratch);
+
+        ac.fp3 = body;
+
+        if (ret != 0 || 0 != fseek (refined.fp3, 0, SEEK_END)) return -1;
+
+        long encoded = ftell (refined.fp3) - start - 1;  // without EOF sequence.
+
+        stats.refine_count++;
+        stats.refine_bytes += outEnd - outStart;
+
+        if (encoded < length)
+        {
+            newStart[i] = start;
+            newLength[i] = encoded;
+            stats.refine_saved += length - encoded;
+        }
+    }
+
+    if (stats.refine_saved == 0)
+    {
+        return (0 == fseek (ac.fp3, bodyEnd, SEEK_SET)) ? 0 : -1;
+    }
+
+    // new body is put together aside, then copied over the original one.
+    AutoClose joined;
+
+    joined.fp3 = tmpfile ();
+
+    if (joined.fp3 == NULL) return -1;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        long length = ((i + 1 < count) ? (long)regions.entries[i + 1].patchPos : bodyEnd - 1) - (long)regions.entries[i].patchPos;
+
+        int ret = newLength[i] ? copyRange (refined.fp3, newStart[i], newLength[i], joined.fp3)
+                               : copyRange (ac.fp3, (long)regions.entries[i].patchPos, length, joined.fp3);
+
+        if (ret != 0) return -1;
+    }
+
+    unsigned char eof = BYTE_PATCH_EOF;
+
+    if (fwrite (&eof, 1, 1, joined.fp3) != 1) return -1;
+
+    long joinedSize = ftell (joined.fp3);
+
+    if (0 != fseek (ac.fp3, PAT_HEADER_SIZE, SEEK_SET) || 0 != copyRange (joined.fp3, 0, joinedSize, ac.fp3) ||
+        0 != fflush (ac.fp3))
+    {
+        return -1;
+    }
+
+#ifdef _MSC_VER
+    return (0 == _chsize_s (_fileno (ac.fp3), PAT_HEADER_SIZE + joinedSize)) ? 0 : -1;
+#else
+    return (0 == ftruncate (fileno (ac.fp3), PAT_HEADER_SIZE + joinedSize)) ? 0 : -1;
+#endif
+}
+
+// fills seek table from ops of complete patch body. returns zero on success.
+static int rebuildSeekTable (FILE *fp3, const long blockSize, const long size1, const long size2,
+            SeekTableBuilder & seek)
+{
+    const long bodyEnd = ftell (fp3);
+
+    std::vector<PatchOp> ops;
+
+    if (0 != fseek (fp3, PAT_HEADER_SIZE, SEEK_SET)) return -1;
+
+    for (long pos = 0; ; ops.clear ())
+    {
+        long outPos = pos, patchPos = ftell (fp3);
+
+        int ret = decodeOp (fp3, blockSize, size1, size2, bodyEnd, pos, ops);
+
+        if (ret == 1) break;
+        if (ret != 0) return -1;
+
+        seek.opStarts (outPos, patchPos);
+    }
+
+    seek.finish (size2);
+
+    return (0 == fseek (fp3, bodyEnd, SEEK_SET)) ? 0 : -1;
+}
+
+// creates patch from file #1 (already open as ac.fp1) to file2.
+// When report is false (several patches created in parallel) all informational
+// output is left to the caller. mirror is the base made of file2 when patches in
+// both directions are created: its checksum and in-memory copy of file2 (converted
+// with --filter) are used instead of reading file2 again.
+// Returns EXIT_SUCCESS or EXIT_FAILURE.
+static int createTargetPatch (const PatchBase & base, AutoClose & ac, const char *file2, const char *file3,
+            const progArguments & args, TargetResult & result, bool report, const PatchBase *mirror = NULL)
+{
+    struct ftime time2 = ftime();
+    long fsize2 = 0;
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    int ret = getftime (file2, &time2, &fsize2);
+
+    if (0 != ret)
+    {
+        fprintf(stderr, "Could not get latest modification time for %s\n", file2);
+        return EXIT_FAILURE;
+    }
+
+    if (report && args.flagVerbose)
+    {
+        printf ("Latest modification time 2 : %s", timefToString (&time2) );
+    }
+
+    const char *image2 = NULL; // file2 (converted with --filter) already in memory.
+
+#ifndef _MSC_VER
+    if (mirror && mirror->image && mirror->size1 == fsize2)
+    {
+        image2 = mirror->image;
+        ac.fp2 = fmemopen ((void *)image2, fsize2, "rb");
+    }
+    else
+#endif
+    {
+        ac.fp2 = fopen (file2, "rb");
+    }
+
+    if (ac.fp2 == NULL)
+    {
+        printf("Could not open file %s\n", file2);
+        return EXIT_FAILURE;
+    }
+
+    // try buffering entire file in memory if possible.
+    if (base.plan.buffer2 && image2 == NULL)
+    { 
+        ac.buffer2 = (char *)malloc (fsize2);
+        if (ac.buffer2)
+        {
+            setvbuf (ac.fp2, ac.buffer2, _IOFBF, fsize2);
+        }
+
+        if (ac.buffer2 && base.buffered && report && args.flagVerbose)
+        {
+            printf("Full disk I/O buffering enabled\n");
+        }
+    }
+
+    long size1 = base.size1, size2 = 0;
+
+    fseek (ac.fp2, 0L, SEEK_END);
+    size2 = ftell(ac.fp2);
+
+    if (size2 != fsize2)
+    {
+        fprintf(stderr, "Stat and actual file size mismatch. Exiting.\n");
+        return EXIT_FAILURE;
+    }
+
+    result.size2 = size2;
+
+    // get checksum of file 2.
+
+    uint32_t checksum2 = mirror ? mirror->checksum1 : 0;
+
+    bool cached = false;
+
+    if (mirror == NULL && 0 != getFileChecksum (file2, ac.fp2, args.flagParanoid, checksum2, cached, !args.flagNoSidecars))
+    {
+        fprintf (stderr, "Failed calculating checksum\n");
+        return EXIT_FAILURE;
+    }
+
+    if (report && args.flagVerbose)
+    {
+        printf ("Cksum 2: %X%s\n", (int)checksum2, cached ? " (cached)" : "");
+    }
+
+    if ((checksum2 == base.checksum1) && (size1 == size2))
+    {
+        if (!args.flagForce)
+        {
+            result.note = "identical to base, skipped";
+
+            if (report) printf ("Two input files seem to be identical. Nothing to do.\n");
+
+            return EXIT_SUCCESS;
+        }
+        else if (report)
+        {
+            printf ("Two input files seem to be identical. Forcing output.\n");
+        }
+    }
+
+    if (access(file3, F_OK) == 0 && !args.flagForce)
+    {
+        result.note = "patch file already exists, use -f flag to overwrite";
+
+        if (report) printf("File %s already exists. Use -f flag to overwrite.\n", file3);
+
+        return EXIT_SUCCESS;
+    }
+
+    const char *filtered2 = NULL; // converted file2, matched instead of file2.
+
+#ifndef _MSC_VER
+    if (args.branchFilter && image2)
+    {
+        filtered2 = image2;
+    }
+    else if (args.branchFilter && size2 > 0)
+    {
+        char *image = NULL;
+
+        if (0 != filterOpenFile (ac.fp2, image, size2, args.branchFilter))
+        {
+            fprintf (stderr, "Could not convert %s\n", file2);
+            return EXIT_FAILURE;
+        }
+
+        free (ac.buffer2);
+        ac.buffer2 = image;
+        filtered2 = image;
+    }
+#endif
+
+    ac.fp3 = fopen(file3, "w+b");
+
+    if (ac.fp3 == NULL)
+    {
+        fprintf (stderr, "Could not open patch file %s.\n", file3);
+        return EXIT_FAILURE;
+    }
+
+    // write header output ///////////////////////////////////////////////////
+
+    unsigned char szHead [6] = "FOC";
+
+    szHead[3] = _VERSION_;
+    szHead[4] = (unsigned char)(base.blockSize - 1);
+    szHead[5] = 0; // set to 0 to indicate that we have not finished (aborted). Set to endianness (1 or 2) when completed. 
+    fwrite (szHead, 6, 1, ac.fp3);
+
+    fwrite (&base.time1, 5, 1, ac.fp3);
+    fwrite (&time2, 5, 1, ac.fp3);
+
+    // we are expecting file size to fit 4 bytes.
+    uint32_t _size1 = size1;
+    uint32_t _size2 = size2;
+
+    assert (_size1 == size1);
+    assert (_size2 == size2);
+
+    if (report && args.flagVerbose)
+    {
+        printf("Input file 1 size: %ld\n", (long)_size1);
+        printf("Input file 2 size: %ld\n", (long)_size2);
+    }
+
+    fwrite (&_size1, 4, 1, ac.fp3);
+    fwrite (&_size2, 4, 1, ac.fp3);
+
+    fwrite (&base.checksum1, 4, 1, ac.fp3);
+    fwrite (&checksum2, 4, 1, ac.fp3);
+
+    // End of header. Now write patch body.
+
+    // holes of sparse file #2 are kept (converted file has none).
+    std::vector<FileHole> holes2;
+
+    if (filtered2 == NULL && image2 == NULL)
+    {
+        getFileHoles (fileno (ac.fp2), size2, holes2);
+    }
+    else if (filtered2 == NULL)
+    {
+        int handle = open (file2, O_RDONLY);
+
+        if (handle != -1)
+        {
+            getFileHoles (handle, size2, holes2);
+            close (handle);
+        }
+    }
+
+    SeekTableBuilder seek ((uint32_t)args.seekInterval);
+
+    // with deadline, first pass is cheap and records regions for refinement; with
+    // --approx it is exact and records them.
+    ScanOptions options (false, !args.flagMaximizeCompression || base.limited);
+
+    options.limited = base.limited;
+    options.deadline = base.deadline;
+    options.ends = base.ends.ranges.empty() ? nullptr : &base.ends;
+
+    SeekTableBuilder regions ((uint32_t)(std::max)(REFINE_MIN_REGION, size2 / REFINE_REGIONS + 1));
+
+    // regions encoded again with approximate matches: all of them with --approx,
+    // with --deadline also every position probed while time remains.
+    const bool refine = base.limited || args.flagApprox;
+
+    ScanOptions second (true, !base.limited && options.accelerate);
+
+    second.limited = base.limited;
+    second.deadline = base.deadline;
+    second.ends = options.ends;
+
+    if (image2 == NULL) image2 = filtered2;
+
+    ret = createPatchBody (ac, file2, image2, base.index, base.blockSize, base.plan.selfStride, size1, 0, size2,
+                           options, holes2, refine ? regions : seek, result.stats);
+
+    if (ret == 0 && refine)
+    {
+        ret = refinePatchBody (base, ac, file2, image2, size2, holes2, regions, second,
+                               base.limited ? REFINE_MIN_BYTES : 1, result.stats);
+
+        if (ret == 0 && args.seekInterval) ret = rebuildSeekTable (ac.fp3, base.blockSize, size1, size2, seek);
+    }
+
+    if (ret != 0)
+    {
+        fclose (ac.fp3);
+        ac.fp3 = nullptr;
+
+        fprintf(stderr, "Read/write error\n");
+        remove(file3);
+
+        return EXIT_FAILURE;
+    }
+
+    unsigned char flags = 0;
+
+    if (args.branchFilter == FILTER_X86) flags |= PATCH_FLAG_FILTER_X86;
+    if (args.branchFilter == FILTER_ARM64) flags |= PATCH_FLAG_FILTER_ARM64;
+
+    FILE *fpHashed = ac.fp2; // data chunk hashes are made of.
+
+    AutoClose original; // file2 itself when matching used converted one.
+
+    // patch body would be larger than file2 itself, store it as is instead.
+    if (ftell (ac.fp3) - PAT_HEADER_SIZE >= size2)
+    {
+        if (filtered2) original.fp2 = fopen (file2, "rb");
+
+        fpHashed = filtered2 ? original.fp2 : ac.fp2;
+
+        if (fpHashed == NULL || 0 != storeFile (fpHashed, ac.fp3, size2))
+        {
+            fclose (ac.fp3);
+            ac.fp3 = nullptr;
+
+            fprintf(stderr, "Read/write error\n");
+            remove(file3);
+
+            return EXIT_FAILURE;
         }
-    }  // end for
 
-    // write the tail portion
+        flags = PATCH_FLAG_STORED;
+        result.stored = true;
+    }
 
-    if (chStarted && !rwError)
+    if (args.chunkHashSize)
     {
-        stats.as_is_length += iLen;
-        stats.as_is_count++;
+        if (0 != writeChunkHashes (fpHashed, ac.fp3, size2, (uint32_t)args.chunkHashSize))
+        {
+            fclose (ac.fp3);
+            ac.fp3 = nullptr;
 
-        bLen = iLen-1;
-        fwrite(&bLen, 1, 1, fp3);
-        if (fwrite(szBuff, iLen, 1, fp3) != 1) { rwError = true; }
+            fprintf(stderr, "Read/write error\n");
+            remove(file3);
+
+            return EXIT_FAILURE;
+        }
+
+        flags |= PATCH_FLAG_CHUNK_HASHES;
     }
 
-    if (!rwError)
+    // stored file needs no seek table.
+    if (args.seekInterval && !result.stored)
     {
-        bLen = BYTE_PATCH_EOF;
-        if (fwrite(&bLen, 1, 1, fp3) != 1) { rwError = true; }
+        uint32_t sectionSize = 4 + (uint32_t)(sizeof (SeekEntry) * seek.entries.size());
 
-        if (args.flagShowStats)
+        if (fwrite (&seek.interval, 4, 1, ac.fp3) != 1 ||
+            (!seek.entries.empty() && fwrite (seek.entries.data(), sizeof (SeekEntry) * seek.entries.size(), 1, ac.fp3) != 1) ||
+            fwrite (&sectionSize, 4, 1, ac.fp3) != 1)
         {
-            printf ("\tAs-is length : %ld\n", stats.as_is_length);
-            printf ("\tAs-is count  : %ld (maxed %ld)\n", stats.as_is_count, stats.as_is_maxed);
-            printf ("\tRefs count   : %ld\n", stats.refs_count);
-            printf ("\tRefs length  : %ld\n", stats.refs_length);
-            printf ("\tRefs longest : %ld\n", stats.refs_longest);
+            fclose (ac.fp3);
+            ac.fp3 = nullptr;
+
+            fprintf(stderr, "Read/write error\n");
+            remove(file3);
+
+            return EXIT_FAILURE;
         }
+
+        flags |= PATCH_FLAG_SEEK_TABLE;
     }
 
-    return (rwError == false) ? 0 : 1;  
-}
+    // tree archive lists its base files once for all patches.
+    if (!base.baseSizes.empty() && !args.flagNoBaseList)
+    {
+        uint32_t count = (uint32_t)base.baseSizes.size(), sectionSize = 4 + 8 * count;
+        bool ok = (fwrite (&count, 4, 1, ac.fp3) == 1);
 
-///////////////////////////////////////////////////////////////////////////
-//
-//  This is the only exposed function from this file.
-//
-///////////////////////////////////////////////////////////////////////////
+        for (uint32_t i = 0; ok && i < count; i++)
+        {
+            ok = fwrite (&base.baseSizes[i], 4, 1, ac.fp3) == 1 && fwrite (&base.baseChecksums[i], 4, 1, ac.fp3) == 1;
+        }
 
-int createPatch (const struct progArguments & args)
-{
-    // get timestamps
-    struct ftime time1 = ftime(), time2 = ftime();
-    long fsize1 = 0, fsize2 = 0;
+        if (!ok || fwrite (&sectionSize, 4, 1, ac.fp3) != 1)
+        {
+            fclose (ac.fp3);
+            ac.fp3 = nullptr;
 
-    if (sizeof(struct ftime) != 5)
-    {
-      fprintf(stderr, "Wrong time struct size. Cannot proceed.\n");
-      return -1;
+            fprintf(stderr, "Read/write error\n");
+            remove(file3);
+
+            return EXIT_FAILURE;
+        }
+
+        flags |= PATCH_FLAG_BASES;
     }
 
+    // set byte 6 to endianness and feature flags to indicate completion.
+
+    fseek (ac.fp3, 5, SEEK_SET);
+    unsigned char byte = getEndianness() | flags;
+    fwrite (&byte, 1, 1, ac.fp3);
+
+    fseek(ac.fp3, 0L, SEEK_END);
+    result.patchSize = ftell(ac.fp3);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    result.seconds = 0.001 * duration.count();
+
+    return EXIT_SUCCESS;
+}
+
+// predicts patch size without creating it: file #2 is split into equal strata and
+// one window at random offset of every stratum is encoded against the index. The
+// share of patch bytes per window gives the estimate and its 95% confidence
+// bounds. Small files are encoded entirely. returns EXIT_SUCCESS or EXIT_FAILURE.
+static int estimatePatch (const PatchBase & base, AutoClose & ac, const progArguments & args)
+{
     std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
-  
-    int ret = getftime (args.file1, &time1, &fsize1);
 
-    if (0 != ret)
-    {
-        fprintf(stderr, "Could not get latest modification time for %s\n", args.file1);
-        return EXIT_FAILURE;
-    }
+    ac.fp2 = fopen (args.file2, "rb");
 
-    if (fsize1 == 0)
+    if (ac.fp2 == NULL)
     {
-        fprintf(stderr, "Input file %s size zero\n", args.file1);
+        fprintf (stderr, "Could not open file %s\n", args.file2);
         return EXIT_FAILURE;
     }
-      
-    ret = getftime (args.file2, &time2, &fsize2);
 
-    if (0 != ret)
-    {
-        fprintf(stderr, "Could not get latest modification time for %s\n", args.file2);
-        return EXIT_FAILURE;
-    }
+    fseek (ac.fp2, 0L, SEEK_END);
+    long size2 = ftell (ac.fp2);
 
-    if (args.flagVerbose)
+    const char *filtered2 = NULL;
+
+#ifndef _MSC_VER
+    if (args.branchFilter && size2 > 0)
     {
-        // print latest modif. times.
-        printf ("Latest modification time 1 : %s", timefToString (&time1) );
-        printf ("Latest modification time 2 : %s", timefToString (&time2) );
+        if (0 != filterOpenFile (ac.fp2, ac.buffer2, size2, args.branchFilter))
+        {
+            fprintf (stderr, "Could not convert %s\n", args.file2);
+            return EXIT_FAILURE;
+        }
+
+        filtered2 = ac.buffer2;
     }
+#endif
 
-    struct AutoClose ac;
+    std::vector<FileHole> holes2;
 
-    ac.fp1 = fopen(args.file1, "rb");
+    if (filtered2 == NULL) getFileHoles (fileno (ac.fp2), size2, holes2);
 
-    if (ac.fp1 == NULL)
+    ac.fp3 = tmpfile ();
+
+    if (ac.fp3 == NULL)
     {
-        fprintf (stderr, "Could not open file %s\n", args.file1);
+        fprintf (stderr, "Could not create temporary file\n");
         return EXIT_FAILURE;
     }
 
-    ac.fp2 = fopen (args.file2, "rb");
+    bool sampled = size2 > 2 * ESTIMATE_WINDOWS * ESTIMATE_WINDOW_SIZE;
 
-    if (ac.fp2 == NULL)
+    int windows = sampled ? ESTIMATE_WINDOWS : 1;
+    long window = sampled ? ESTIMATE_WINDOW_SIZE : size2;
+    long stratum = sampled ? size2 / windows : size2;
+
+    std::mt19937 random (1);
+
+    std::vector<double> ratios;
+
+    PatchStats stats;
+
+    SeekTableBuilder noSeek (0);
+
+    ScanOptions options (args.flagApprox, !args.flagMaximizeCompression);
+
+    for (int w = 0; w < windows; w++)
     {
-        printf("Could not open file %s\n", args.file2);
-        return EXIT_FAILURE;
-    }
+        long begin = (long)w * stratum + (long)(random () % (unsigned long)(stratum - window + 1));
 
-    // try buffering entire file in memory if possible.
-    if (false == args.flagDiskIO)
-    { 
-        int  memb_cnt = 0;
-        ac.buffer1 = (char *)malloc (fsize1);
-        if (ac.buffer1)
+        if (0 != fseek (ac.fp3, 0, SEEK_SET) ||
+            0 != createPatchBody (ac, args.file2, filtered2, base.index, base.blockSize, base.plan.selfStride,
+                                  base.size1, begin, begin + window, options, holes2, noSeek, stats))
         {
-            memb_cnt++;
-            setvbuf (ac.fp1, ac.buffer1, _IOFBF, fsize1);
+            fprintf (stderr, "Read/write error\n");
+            return EXIT_FAILURE;
         }
 
-        ac.buffer2 = (char *)malloc (fsize2);
-        if (ac.buffer2)
-        {
-            memb_cnt++;
-            setvbuf (ac.fp2, ac.buffer2, _IOFBF, fsize2);
-        }
+        long bytes = ftell (ac.fp3) - 1; // without EOF sequence.
 
-        if (memb_cnt == 2 && args.flagVerbose)
-        {
-            printf("Full disk I/O buffering enabled\n");
-        }
+        ratios.push_back ((double)bytes / (std::max)(window, 1L));
     }
 
-    long size1 = 0, size2 = 0;
+    double mean = 0, variance = 0;
 
-    fseek (ac.fp1, 0L, SEEK_END);
-    size1 = ftell(ac.fp1);
-    fseek (ac.fp2, 0L, SEEK_END);
-    size2 = ftell(ac.fp2);
+    for (double r : ratios) mean += r;
 
-    if ((size1 != fsize1) || (size2 != fsize2))
-    {
-        fprintf(stderr, "Stat and actual file size mismatch. Exiting.\n");
-        return EXIT_FAILURE;
-    }
+    mean /= windows;
 
-    // get checksum of file 1.
+    for (double r : ratios) variance += (r - mean) * (r - mean);
+
+    // variance of the mean, with finite population correction.
+    if (windows > 1) variance = variance / (windows - 1) / windows * (1.0 - (double)windows * window / size2);
+
+    double hashes = args.chunkHashSize ? 8 + 8.0 * ((size2 + args.chunkHashSize - 1) / args.chunkHashSize) : 0;
+
+    double extra = PAT_HEADER_SIZE + 1 + hashes; // header, EOF sequence, sections.
+    double stored = PAT_HEADER_SIZE + (double)size2 + hashes;
+
+    double margin = 1.96 * sqrt ((std::max)(variance, 0.0)) * size2;
+
+    long estimate = (long)(std::min)(mean * size2 + extra, stored);
+    long low = (long)(std::min)((std::max)(mean * size2 - margin, 0.0) + extra, stored);
+    long high = (long)(std::min)(mean * size2 + margin + extra, stored);
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
 
-    uint32_t checksum1 = 0, checksum2 = 0;
+    printf ("Estimated patch size: %ld bytes (%.2lf%% of %ld), 95%% bounds %ld - %ld\n",
+            estimate, 100.0 * estimate / (std::max)(size2, 1L), size2, low, high);
 
-    if (0 != getChecksum (ac.fp1, checksum1))
+    if (!args.flagQuiet)
     {
-        fprintf (stderr, "Failed calculating checksum\n");
-        return EXIT_FAILURE;
+        printf ("Sampled %d window(s), %.2lf%% of %s, in %.2lf seconds\n", windows,
+                100.0 * windows * window / (std::max)(size2, 1L), args.file2, 0.001 * duration.count());
+
+        if (mean * size2 + 1 >= size2) printf ("Patch would store %s as is.\n", args.file2);
     }
 
-    // get checksum of file 2.
+    return EXIT_SUCCESS;
+}
+
+// creates one patch per target, all from the same file #1 and index.
+static int createPatches (const struct progArguments & args)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
 
-    if (0 != getChecksum (ac.fp2, checksum2))
+    AutoClose ac;
+    PatchBase base;
+
+    base.limited = args.deadline > 0;
+    base.deadline = start + std::chrono::milliseconds ((long long)(args.deadline * 1000));
+
+    if (0 != prepareBase (args, args.file1, ac, base, true))
     {
-        fprintf (stderr, "Failed calculating checksum\n");
         return EXIT_FAILURE;
     }
 
-    if (args.flagVerbose)
+    if (access (args.outputDir, F_OK) != 0 && mkdir (args.outputDir, 0755) != 0)
     {
-        printf ("Cksum 1: %X\n", (int)checksum1);
-        printf ("Cksum 2: %X\n", (int)checksum2);
+        fprintf (stderr, "Could not create directory %s\n", args.outputDir);
+        return EXIT_FAILURE;
     }
 
-    if ((checksum2 == checksum1) && (size1 == size2))
+    const int count = args.targetCount;
+
+    std::vector<TargetResult> results (count);
+
+    std::atomic<int> next (0);
+
+    auto worker = [&] ()
     {
-        if (!args.flagForce)
-        {
-            printf ("Two input files seem to be identical. Nothing to do.\n");
-            return EXIT_SUCCESS;
-        }
-        else 
+        for (int t = next++; t < count; t = next++)
         {
-            printf ("Two input files seem to be identical. Forcing output.\n");
+            AutoClose tac;
+
+#ifndef _MSC_VER
+            if (base.image)
+            {
+                tac.fp1 = fmemopen (base.image, base.size1, "rb");
+            }
+#endif
+            if (tac.fp1 == NULL)
+            {
+                tac.fp1 = openBase (args.file1, base.files);
+            }
+
+            if (tac.fp1 == NULL)
+            {
+                fprintf (stderr, "Could not open file %s\n", args.file1);
+                continue;
+            }
+
+            results[t].ret = createTargetPatch (base, tac, args.targets[t], args.patches[t], args, results[t], false);
         }
-    }
+    };
 
-    if (access(args.file3, F_OK) == 0 && !args.flagForce)
+    int threadCount = base.plan.threads;
+
+    if (args.flagVerbose)
     {
-        printf("File %s already exists. Use -f flag to overwrite.\n", args.file3);
-        return EXIT_SUCCESS;
+        printf ("Creating %d patches using %d threads\n", count, threadCount);
     }
 
-    ac.fp3 = fopen(args.file3, "w+b");
+    std::vector<std::thread> threads;
 
-    if (ac.fp3 == NULL)
+    for (int i = 1; i < threadCount; i++)
     {
-        fprintf (stderr, "Could not open patch file.\n");
-        return EXIT_FAILURE;
+        threads.push_back (std::thread (worker));
     }
 
-    long blockSize = 0;
+    worker ();
 
-    if ((size1 - 8) < 0x40000L) 
-        blockSize = 4;
-    else
+    for (auto & th : threads) th.join();
+
+    int failed = 0;
+
+    for (int t = 0; t < count; t++)
     {
-        blockSize = (size1 - 8) >> 16;
-        if ((blockSize << 16) < size1 - 8) blockSize++;
+        const TargetResult & r = results[t];
 
-        if (args.flagMaximizeCompression)
+        if (r.ret != EXIT_SUCCESS)
         {
-            blockSize = (size1 - 8) >> 18;
-            if ((blockSize << 18) < size1 - 8) blockSize++;
+            failed++;
+            printf ("%s: failed\n", args.targets[t]);
         }
-    }
+        else if (r.note)
+        {
+            printf ("%s: %s\n", args.targets[t], r.note);
+        }
+        else if (!args.flagQuiet)
+        {
+            printf ("%s -> %s: %ld bytes (%.2lf%%%s) in %.2lf seconds\n", args.targets[t], args.patches[t],
+                    r.patchSize, 100.0 * (double)r.patchSize / (std::max)(r.size2, 1L),
+                    r.stored ? ", stored as is" : "", r.seconds);
 
-    if (blockSize > 256)
-    {
-        printf ("Block size too large (%ld)\n", blockSize);
-        return EXIT_FAILURE;
+            if (args.flagShowStats)
+            {
+                printStats (r.stats);
+            }
+        }
     }
 
-    if (args.flagVerbose)
+    if (!args.flagQuiet)
     {
-        printf ("Block size %ld\n", blockSize);
+        auto end = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+        printf ("%d of %d patches completed in %.2lf seconds\n", count - failed, count, 0.001 * duration.count());
     }
 
-    unsigned long iCount = (size1 - 8 + blockSize) / blockSize;
+    return (failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
 
-    if (iCount > 0x3FFFFF)
+// whether common ends of the two files are worth looking for: not with -x, which
+// indexes all of file #1, nor when file #1 is not read as it is.
+static bool useCommonEnds (const struct progArguments & args)
+{
+    return !args.flagMaximizeCompression && !args.branchFilter && args.baseCount == 0 && !args.flagEstimate;
+}
+
+// creates patch from file1 to file2 and patch back from file2 to file1 (--both).
+// Both files are read, checksummed and indexed once, on two threads, and each of
+// them serves as base of one patch and as new file of the other. Both patches are
+// then created in parallel. returns EXIT_SUCCESS or EXIT_FAILURE.
+static int createBothPatches (const struct progArguments & args)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    AutoClose ac[2];
+    PatchBase base[2];
+
+    const char *files[2] = { args.file1, args.file2 };
+    const char *patches[2] = { args.file3, args.file4 };
+
+    int prepared[2] = { -1, -1 };
+
+    TargetResult results[2];
+
+    for (int d = 0; d < 2; d++)
     {
-        fprintf (stderr, "Input file too large.\n");
-        return EXIT_FAILURE;
+        base[d].limited = args.deadline > 0;
+        base[d].deadline = start + std::chrono::milliseconds ((long long)(args.deadline * 1000));
     }
 
-    if (args.flagVerbose)
+    // common ends are the same both ways, file offsets swapped.
+    if (useCommonEnds (args) && 0 == findCommonEnds (args.file1, args.file2, base[0].ends))
     {
-        printf ("Allocating %ld ref. points\n", iCount);
-    }
+        const CommonEnds & ends = base[0].ends;
 
-#ifndef USE_MAP
-    RefStruct *rv = new (std::nothrow) RefStruct [iCount];
+        base[1].ends.prefixEnd = ends.prefixEnd;
+        base[1].ends.suffixStart = ends.suffixStart + ends.growth;
+        base[1].ends.growth = -ends.growth;
 
-    if (!rv) 
-    {             
-        fprintf (stderr, "Not enough memory\n");
-        return EXIT_FAILURE;
-    }  
+        for (const EqualRange & r : ends.ranges)
+        {
+            base[1].ends.ranges.push_back (EqualRange { r.start1, r.start2, r.length });
+        }
+    }
 
-#else 
-    std::unordered_map<uint32_t, std::vector<uint32_t> > u_map; 
-    u_map.reserve (iCount);
+    // direction d patches files[d] into files[1 - d].
+    std::thread back ([&] () { prepared[1] = prepareBase (args, files[1], ac[1], base[1], true); });
 
-#endif     
+    prepared[0] = prepareBase (args, files[0], ac[0], base[0], true);
 
-    long pos = 0;
-    unsigned long i = 0;
-    unsigned char szBuff32 [8];
+    back.join ();
 
-    for (i = 0, pos = 0; i < iCount; i++, pos += blockSize)
+    if (prepared[0] != 0 || prepared[1] != 0)
     {
-        if (0 != fseek (ac.fp1, pos, SEEK_SET)) break;
+        return EXIT_FAILURE;
+    }
 
-        if (fread(szBuff32, 8, 1, ac.fp1) != 1) break;
+    std::thread scan ([&] () {
+        results[1].ret = createTargetPatch (base[1], ac[1], files[0], patches[1], args, results[1], false, &base[0]);
+    });
 
-        bool dummy = false;
+    results[0].ret = createTargetPatch (base[0], ac[0], files[1], patches[0], args, results[0], false, &base[1]);
 
-#ifndef USE_MAP
-        rv[i].checkValue = checkSum (szBuff32, dummy); 
-        rv[i].index = i;
-#else 
-        uint32_t sum = checkSum (szBuff32, dummy);
+    scan.join ();
 
-        u_map[sum].push_back (i);
-#endif         
-    }
+    int failed = 0;
 
-    if (i < iCount)
+    for (int d = 0; d < 2; d++)
     {
-        fprintf(stderr, "Read error. Exiting.\n");
-        return EXIT_FAILURE;
-    }
+        const TargetResult & r = results[d];
 
-#ifndef USE_MAP
-    qsort (rv, iCount, sizeof(struct RefStruct), RefStruct::compareRefs);
-#endif     
+        if (r.ret != EXIT_SUCCESS)
+        {
+            failed++;
+            printf ("%s: failed\n", patches[d]);
+        }
+        else if (r.note)
+        {
+            printf ("%s: %s\n", patches[d], r.note);
+        }
+        else if (!args.flagQuiet)
+        {
+            printf ("%s -> %s: %ld bytes (%.2lf%%%s) in %.2lf seconds\n", files[1 - d], patches[d],
+                    r.patchSize, 100.0 * (double)r.patchSize / (std::max)(r.size2, 1L),
+                    r.stored ? ", stored as is" : "", r.seconds);
 
-    // write header output ///////////////////////////////////////////////////
+            if (args.flagShowStats)
+            {
+                printStats (r.stats);
+            }
+        }
+    }
 
-    unsigned char szHead [6] = "FOC";
+    if (!args.flagQuiet)
+    {
+        auto end = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 
-    szHead[3] = _VERSION_;
-    szHead[4] = (unsigned char)(blockSize - 1);
-    szHead[5] = 0; // set to 0 to indicate that we have not finished (aborted). Set to endianness (1 or 2) when completed. 
-    fwrite (szHead, 6, 1, ac.fp3);
+        printf ("%d of 2 patches completed in %.2lf seconds\n", 2 - failed, 0.001 * duration.count());
+    }
 
-    fwrite (&time1, 5, 1, ac.fp3);
-    fwrite (&time2, 5, 1, ac.fp3);
+    return (failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
 
-    // we are expecting file size to fit 4 bytes.
-    uint32_t _size1 = size1;
-    uint32_t _size2 = size2;
+///////////////////////////////////////////////////////////////////////////
+//
+//  This is the only exposed function from this file.
+//
+///////////////////////////////////////////////////////////////////////////
 
-    assert (_size1 == size1);
-    assert (_size2 == size2);
+int createPatch (const struct progArguments & args)
+{
+    if (args.outputDir)
+    {
+        return createPatches (args);
+    }
 
-    if (args.flagVerbose)
+    if (args.flagBoth)
     {
-        printf("Input file 1 size: %ld\n", (long)_size1);
-        printf("Input file 2 size: %ld\n", (long)_size2);
+        return createBothPatches (args);
     }
 
-    fwrite (&_size1, 4, 1, ac.fp3);
-    fwrite (&_size2, 4, 1, ac.fp3);
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
 
-    fwrite (&checksum1, 4, 1, ac.fp3);
-    fwrite (&checksum2, 4, 1, ac.fp3);
+    AutoClose ac;
+    PatchBase base;
 
-    // End of header. Now write patch body.
+    base.limited = args.deadline > 0;
+    base.deadline = start + std::chrono::milliseconds ((long long)(args.deadline * 1000));
 
-#ifndef USE_MAP
-    ret = createPatchBody (ac, rv, iCount, blockSize, size1, size2, args);
-    delete[] rv;
-#else 
-    ret = createPatchBody (ac, u_map, blockSize, size1, size2, args);    
-#endif     
+    if (useCommonEnds (args) && 0 != findCommonEnds (args.file1, args.file2, base.ends))
+    {
+        base.ends = CommonEnds ();
+    }
 
-    if (ret != 0)
+    if (0 != prepareBase (args, args.file1, ac, base, false))
     {
-        fclose (ac.fp3);
-        ac.fp3 = nullptr;
+        return EXIT_FAILURE;
+    }
 
-        fprintf(stderr, "Read/write error\n");
-        remove(args.file3);
+    if (args.flagEstimate)
+    {
+        return estimatePatch (base, ac, args);
     }
 
-    if (ret == 0) // set byte 6 to zero to indicate completion. 
+    TargetResult result;
+
+    int ret = createTargetPatch (base, ac, args.file2, args.file3, args, result, true);
+
+    if (ret == EXIT_SUCCESS && result.note == NULL)
     {
-        fseek (ac.fp3, 5, SEEK_SET);
-        unsigned char byte = getEndianness();
-        fwrite (&byte, 1, 1, ac.fp3);
+        if (args.flagShowStats)
+        {
+            printStats (result.stats);
+        }
 
         if (!args.flagQuiet)
         {
@@ -870,16 +3086,16 @@ int createPatch (const struct progArguments & args)
 			printf ("Patch completed in %.2lf seconds\n", 0.001 * duration.count());
         }
 
-        if (args.flagVerbose)
+        if (result.stored && !args.flagQuiet)
         {
-            fseek(ac.fp3, 0L, SEEK_END);
-            long size = ftell(ac.fp3);
+            printf ("Patch would be larger than %s, stored it as is.\n", args.file2);
+        }
 
-            printf ("Patch size %ld bytes (or %.2lf%%)\n", size, 100.0 * (double)size / size2);
+        if (args.flagVerbose)
+        {
+            printf ("Patch size %ld bytes (or %.2lf%%)\n", result.patchSize, 100.0 * (double)result.patchSize / result.size2);
         }
     }
 
-    return (ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    return ret;
 }
-
-
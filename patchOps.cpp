@@ -0,0 +1,623 @@
+/* PatchMaker utility, Copyright (c) 1997-2020 Yuriy Yakimenko
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation.  No representations are made about the suitability of this
+ * software for any purpose.  It is provided "as is" without express or 
+ * implied warranty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm> // min, upper_bound
+
+#ifndef _MSC_VER
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#endif
+
+#include "common.h"
+#include "blockIndex.h"
+#include "patchOps.h"
+
+#define BASE_FILES_OPEN 256  // lazily opened base files kept open at most.
+
+// reads 4-byte length ending at pos and returns section start, or -1 on error.
+static long sectionStart (FILE *fp3, const long pos)
+{
+    uint32_t len = 0;
+
+    if (pos < PAT_HEADER_SIZE + 4 || 0 != fseek (fp3, pos - 4, SEEK_SET) || fread (&len, 4, 1, fp3) != 1) return -1;
+
+    long start = pos - 4 - (long)len;
+
+    return (start >= PAT_HEADER_SIZE) ? start : -1;
+}
+
+int readPatchSections (FILE *fp3, const long patchSize, const unsigned flags, const long size2,
+            PatchSections & sections)
+{
+    long saved = ftell (fp3);
+    long pos = patchSize;
+
+    // sections are located from the end, in reverse order of flag bits.
+    if (flags & PATCH_FLAG_BASES)
+    {
+        long start = sectionStart (fp3, pos);
+        uint32_t count = 0;
+
+        if (start < 0 || 0 != fseek (fp3, start, SEEK_SET)) return -1;
+
+        if (fread (&count, 4, 1, fp3) != 1 || count < 2 || pos - 4 - start != 4 + 8L * count) return -1;
+
+        sections.baseSizes.resize (count);
+        sections.baseChecksums.resize (count);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (fread (&sections.baseSizes[i], 4, 1, fp3) != 1 || fread (&sections.baseChecksums[i], 4, 1, fp3) != 1) return -1;
+        }
+
+        pos = start;
+    }
+
+    if (flags & PATCH_FLAG_SEEK_TABLE)
+    {
+        long start = sectionStart (fp3, pos);
+
+        if (start < 0 || 0 != fseek (fp3, start, SEEK_SET)) return -1;
+
+        if (fread (&sections.seekInterval, 4, 1, fp3) != 1 || sections.seekInterval == 0) return -1;
+
+        long count = (size2 + sections.seekInterval - 1) / sections.seekInterval;
+
+        if (pos - 4 - start != 4 + (long)sizeof (SeekEntry) * count) return -1;
+
+        sections.seekTable.resize (count);
+
+        if (count > 0 && fread (sections.seekTable.data(), sizeof (SeekEntry) * count, 1, fp3) != 1) return -1;
+
+        // entry k is the op covering output offset k * interval.
+        for (long k = 0; k < count; k++)
+        {
+            const SeekEntry & e = sections.seekTable[k];
+
+            if (e.patchPos < PAT_HEADER_SIZE || e.patchPos >= (uint64_t)start ||
+                e.outPos > (uint64_t)k * sections.seekInterval) return -1;
+        }
+
+        pos = start;
+    }
+
+    if (flags & PATCH_FLAG_CHUNK_HASHES)
+    {
+        long start = sectionStart (fp3, pos);
+
+        if (start < 0 || 0 != fseek (fp3, start, SEEK_SET)) return -1;
+
+        if (fread (&sections.chunkSize, 4, 1, fp3) != 1 || sections.chunkSize == 0) return -1;
+
+        long count = (size2 + sections.chunkSize - 1) / sections.chunkSize;
+
+        if (pos - 4 - start != 4 + 8 * count) return -1;
+
+        sections.chunkHashes.resize (count);
+
+        if (count > 0 && fread (sections.chunkHashes.data(), 8 * count, 1, fp3) != 1) return -1;
+
+        pos = start;
+    }
+
+    sections.bodyEnd = pos;
+
+    return (0 == fseek (fp3, saved, SEEK_SET)) ? 0 : -1;
+}
+
+// reads length stored 7 bits per byte, lowest first. returns zero on success.
+static int readVarint (FILE *fp3, uint32_t & value)
+{
+    uint64_t result = 0;
+
+    for (int shift = 0; ; shift += 7)
+    {
+        int b = fgetc (fp3);
+
+        if (b == EOF || shift > 28) return -1;
+
+        result |= (uint64_t)(b & 0x7F) << shift;
+
+        if ((b & 0x80) == 0) break;
+    }
+
+    if (result > 0xFFFFFFFFUL) return -1;
+
+    value = (uint32_t)result;
+
+    return 0;
+}
+
+int decodeOp (FILE *fp3, const long blockSize, const long size1, const long size2,
+            const long patchSize, long & pos, std::vector<PatchOp> & ops)
+{
+    uint8_t bLen = 0;
+    uint16_t iLen = 0, iStart = 0;
+    uint32_t lStart = 0;
+    int32_t maxL = 0;
+
+    int byte = fgetc (fp3);
+
+    if (byte == EOF) return -1;
+
+    PatchOp op;
+
+    op.outPos = pos;
+    op.period = 0;
+    op.delta = 0;
+
+    if (byte == 0)
+    {
+        if (fread (&bLen, 1, 1, fp3) != 1) return -1;
+        op.type = OP_LITERAL;
+        op.length = (uint32_t)bLen + 1;
+        op.src = ftell (fp3);
+        if (op.src + (long)op.length > patchSize) return -1;
+        if (0 != fseek (fp3, op.length, SEEK_CUR)) return -1;
+    }
+    else if (byte == BYTE_PATCH_EOF) 
+    {
+        return (pos == size2) ? 1 : -1;
+    }
+    else if (byte == BYTE_PATCH_SEQ) // sequence of identical bytes.
+    {
+        if (fread (&bLen, 1, 1, fp3) != 1) return -1;
+        op.type = OP_SEQ;
+        op.length = (uint32_t)bLen + 1;
+        if (fread (&bLen, 1, 1, fp3) != 1) return -1;
+        op.src = bLen;
+    }
+    else if (byte == BYTE_PATCH_RUN) // long run of repeated pattern (version 3).
+    {
+        int period = fgetc (fp3);
+
+        if (period < 1 || period > RUN_MAX_PERIOD || (period & (period - 1)) != 0) return -1;
+
+        uint32_t length = 0;
+
+        if (0 != readVarint (fp3, length) || length == 0 || length > 0x7FFFFFFFUL) return -1;
+
+        op.length = length;
+
+        if (period == 1)
+        {
+            if ((op.src = fgetc (fp3)) == EOF) return -1;
+            op.type = OP_SEQ;
+        }
+        else
+        {
+            op.type = OP_RUN;
+            op.period = (uint16_t)period;
+            op.src = ftell (fp3);
+            if (op.src + period > patchSize) return -1;
+            if (0 != fseek (fp3, period, SEEK_CUR)) return -1;
+        }
+    }
+    else if (byte == BYTE_PATCH_HOLE) // hole of sparse file, zeros (version 3).
+    {
+        uint32_t length = 0;
+
+        if (0 != readVarint (fp3, length) || length == 0 || length > 0x7FFFFFFFUL) return -1;
+
+        op.type = OP_HOLE;
+        op.length = length;
+        op.src = 0;
+    }
+    else if (byte == BYTE_PATCH_ADD) // file1 copy with bytes added (version 3).
+    {
+        uint32_t length = 0;
+
+        if (fread (&lStart, 4, 1, fp3) != 1) return -1;
+        if (0 != readVarint (fp3, length) || length == 0 || length > 0x7FFFFFFFUL) return -1;
+        if ((long)lStart + (long)length > size1 || pos + (long)length > size2) return -1;
+
+        // every group of unchanged and changed bytes becomes file1 references,
+        // the changed ones with their bytes to add.
+        for (uint32_t done = 0; done < length; )
+        {
+            uint32_t same = 0, changed = 0;
+
+            if (0 != readVarint (fp3, same) || 0 != readVarint (fp3, changed)) return -1;
+            if (same + changed == 0 || same > length - done || changed > length - done - same) return -1;
+
+            for (int part = 0; part < 2; part++)
+            {
+                uint32_t len = part ? changed : same;
+
+                if (len == 0) continue;
+
+                op.type = OP_REF;
+                op.length = len;
+                op.outPos = pos + done;
+                op.src = (long)lStart + done;
+                op.delta = part ? ftell (fp3) : 0;
+
+                if (part && (op.delta + (long)len > patchSize || 0 != fseek (fp3, len, SEEK_CUR))) return -1;
+
+                ops.push_back (op);
+                done += len;
+            }
+        }
+
+        pos += length;
+        return 0;
+    }
+    else
+    {
+        int width = byte & 3;
+
+        if ((byte & 15) == BYTE_PATCH_SELF) // copy of output written so far.
+        {
+            if (fread (&lStart, 4, 1, fp3) != 1) return -1;
+            op.type = OP_SELF;
+            op.src = lStart;
+            width = byte >> 4;
+        }
+        else if (width != 0)
+        {
+            if (fread (&iStart, 2, 1, fp3) != 1) return -1;
+            lStart = byte >> 2;
+            lStart = (lStart << 16) + iStart;
+            op.type = OP_REF;
+            op.src = (long)lStart * blockSize;
+        }
+
+        if (width == 1)
+        {
+            if (fread (&bLen, 1, 1, fp3) != 1) return -1;
+            maxL = bLen;
+        }
+        else if (width == 2)
+        {
+            if (fread (&iLen, 2, 1, fp3) != 1) return -1;
+            maxL = iLen;
+        }
+        else if (width == 3)
+        {
+            if (fread (&maxL, 4, 1, fp3) != 1) return -1;
+        }
+        else 
+            return -1;
+
+        if (maxL <= 0) return -1;
+
+        op.length = (uint32_t)maxL;
+
+        // file1 reference must be inside file1, output copy must precede its destination.
+        if (op.type == OP_REF && op.src + (long)op.length > size1) return -1;
+        if (op.type == OP_SELF && op.src + (long)op.length > pos) return -1;
+    }
+
+    pos += op.length;
+
+    if (pos > size2) return -1;
+
+    ops.push_back (op);
+
+    return 0;
+}
+
+// decodes patch body into ops list, checking every reference against file sizes.
+// Nothing is written, so a malformed patch is rejected before output is touched.
+// returns zero on success.
+int decodePatchBody (FILE *fp3, const long blockSize, const long size1, const long size2,
+            const long patchSize, std::vector<PatchOp> & ops)
+{
+    long pos = 0;
+
+    for (;;)
+    {
+        int ret = decodeOp (fp3, blockSize, size1, size2, patchSize, pos, ops);
+
+        if (ret != 0) return (ret == 1) ? 0 : -1;
+    }
+}
+
+int storedBodyOps (const long size2, const long bodyEnd, std::vector<PatchOp> & ops)
+{
+    if (bodyEnd - PAT_HEADER_SIZE != size2) return -1;
+
+    if (size2 > 0)
+    {
+        PatchOp op;
+
+        op.type = OP_LITERAL;
+        op.period = 0;
+        op.length = (uint32_t)size2;
+        op.outPos = 0;
+        op.src = PAT_HEADER_SIZE;
+        op.delta = 0;
+
+        ops.push_back (op);
+    }
+
+    return 0;
+}
+
+BaseFiles::~BaseFiles ()
+{
+    release ();
+}
+
+void BaseFiles::release ()
+{
+    // first file belongs to the caller unless all were opened here.
+    for (size_t i = names.empty() ? 1 : 0; i < files.size(); i++)
+    {
+        if (files[i]) fclose (files[i]);
+    }
+
+    files.clear ();
+    names.clear ();
+}
+
+void BaseFiles::single (FILE *fp1, long size1)
+{
+    release ();
+
+    files.assign (1, fp1);
+    starts.assign (1, 0L);
+    starts.push_back (size1);
+}
+
+int BaseFiles::open (FILE *fp1, char * const *names, int count, const PatchSections & sections, bool paranoid,
+            bool verify)
+{
+    if (sections.baseSizes.size() != (size_t)count + 1)
+    {
+        fprintf (stderr, "Patch was made from %ld base file(s), %d given.\n",
+                 (long)(std::max)(sections.baseSizes.size(), (size_t)1), count + 1);
+        return -1;
+    }
+
+    release ();
+
+    files.assign (1, fp1);
+    starts.assign (1, 0L);
+
+    for (int i = 0; i <= count; i++)
+    {
+        FILE *fp = fp1;
+
+        if (i > 0 && (fp = fopen (names[i - 1], "rb")) == NULL)
+        {
+            fprintf (stderr, "Could not open file %s\n", names[i - 1]);
+            return -1;
+        }
+
+        if (i > 0) files.push_back (fp);
+
+        fseek (fp, 0L, SEEK_END);
+        long size = ftell (fp);
+
+        if (size != (long)sections.baseSizes[i])
+        {
+            fprintf (stderr, "Base file #%d size mismatch: %ld vs %ld\n", i + 1, (long)sections.baseSizes[i], size);
+            return -1;
+        }
+
+        // first one is checked against header by the caller.
+        uint32_t checksum = 0;
+        bool cached = false;
+
+        if (i > 0 && verify && (0 != getFileChecksum (names[i - 1], fp, paranoid, checksum, cached) ||
+                      checksum != sections.baseChecksums[i]))
+        {
+            fprintf (stderr, "Base file %s checksum mismatch.\n", names[i - 1]);
+            return -1;
+        }
+
+        starts.push_back (starts.back() + size);
+    }
+
+    return 0;
+}
+
+// lazily opened files kept open: a quarter of descriptors we may have at most,
+// the rest is left to patches and outputs.
+static int openLimit ()
+{
+#ifndef _MSC_VER
+    struct rlimit limit;
+
+    if (0 == getrlimit (RLIMIT_NOFILE, &limit) && limit.rlim_cur != RLIM_INFINITY)
+    {
+        return (int)(std::max)((rlim_t)4, (std::min)((rlim_t)BASE_FILES_OPEN, limit.rlim_cur / 4));
+    }
+#endif
+    return BASE_FILES_OPEN;
+}
+
+void BaseFiles::lazy (const std::vector<std::string> & names, const std::vector<uint32_t> & sizes)
+{
+    release ();
+
+    this->names = names;
+
+    files.assign (names.size(), (FILE *)NULL);
+    users.assign (names.size(), 0);
+    used.assign (names.size(), 0UL);
+    clock = 0;
+    openCount = 0;
+    maxOpen = openLimit ();
+
+    starts.assign (1, 0L);
+
+    for (uint32_t size : sizes) starts.push_back (starts.back() + (long)size);
+}
+
+FILE *BaseFiles::acquire (size_t i) const
+{
+    if (names.empty()) return files[i];
+
+    std::lock_guard<std::mutex> guard (lock);
+
+    if (files[i] == NULL)
+    {
+        // least recently used file nobody reads makes room.
+        size_t oldest = files.size();
+
+        for (size_t k = 0; openCount >= maxOpen && k < files.size(); k++)
+        {
+            if (files[k] && users[k] == 0 && (oldest == files.size() || used[k] < used[oldest])) oldest = k;
+        }
+
+        if (oldest < files.size())
+        {
+            fclose (files[oldest]);
+            files[oldest] = NULL;
+            openCount--;
+        }
+
+        if ((files[i] = fopen (names[i].c_str(), "rb")) == NULL) return NULL;
+
+        openCount++;
+    }
+
+    users[i]++;
+    used[i] = ++clock;
+
+    return files[i];
+}
+
+void BaseFiles::done (size_t i) const
+{
+    if (names.empty()) return;
+
+    std::lock_guard<std::mutex> guard (lock);
+
+    users[i]--;
+}
+
+bool BaseFiles::read (char *buffer, size_t len, long offset) const
+{
+    size_t i = std::upper_bound (starts.begin(), starts.end(), offset) - starts.begin() - 1;
+
+    // reference may span several files.
+    for (; len > 0 && i + 1 < starts.size(); i++)
+    {
+        size_t n = (size_t)(std::min)((long)len, starts[i + 1] - offset);
+
+        FILE *fp = acquire (i);
+
+        if (fp == NULL) return false;
+#ifndef _MSC_VER
+        bool ok = readFull (fileno (fp), buffer, n, offset - starts[i]);
+#else
+        bool ok = 0 == fseek (fp, offset - starts[i], SEEK_SET) && fread (buffer, n, 1, fp) == 1;
+#endif
+        done (i);
+
+        if (!ok) return false;
+
+        buffer += n; len -= n; offset += (long)n;
+    }
+
+    return len == 0;
+}
+
+void BaseFiles::willNeed (long offset, long len) const
+{
+#ifdef POSIX_FADV_WILLNEED
+    size_t i = std::upper_bound (starts.begin(), starts.end(), offset) - starts.begin() - 1;
+
+    for (; len > 0 && i + 1 < starts.size(); i++)
+    {
+        long n = (std::min)(len, starts[i + 1] - offset);
+
+        FILE *fp = acquire (i);
+
+        if (fp) (void)posix_fadvise (fileno (fp), offset - starts[i], n, POSIX_FADV_WILLNEED);
+
+        if (fp) done (i);
+
+        len -= n; offset += n;
+    }
+#else
+    (void)offset; (void)len;
+#endif
+}
+
+void fillRun (char *dest, size_t len, long pos, const unsigned char *pattern, int period)
+{
+    size_t filled = (std::min)(len, (size_t)period);
+
+    for (size_t i = 0; i < filled; i++) dest[i] = (char)pattern[(pos + i) & (period - 1)];
+
+    // pattern doubles with every copy.
+    while (filled < len)
+    {
+        size_t n = (std::min)(filled, len - filled);
+
+        memcpy (dest + filled, dest, n);
+        filled += n;
+    }
+}
+
+#ifndef _MSC_VER
+
+bool readFull (int handle, char *buffer, size_t len, long offset)
+{
+    while (len > 0)
+    {
+        ssize_t r = pread (handle, buffer, len, offset);
+        if (r <= 0) return false;
+        buffer += r; len -= r; offset += r;
+    }
+    return true;
+}
+
+bool addDeltas (int fd3, char *data, size_t len, long offset, std::vector<char> & scratch)
+{
+    if (scratch.size() < len) scratch.resize (len);
+
+    if (!readFull (fd3, scratch.data(), len, offset)) return false;
+
+    for (size_t i = 0; i < len; i++) data[i] = (char)(data[i] + scratch[i]);
+
+    return true;
+}
+
+bool writeFull (int handle, const char *buffer, size_t len, long offset)
+{
+    while (len > 0)
+    {
+        ssize_t r = pwrite (handle, buffer, len, offset);
+        if (r <= 0) return false;
+        buffer += r; len -= r; offset += r;
+    }
+    return true;
+}
+
+bool zeroFull (int handle, size_t len, long offset)
+{
+#ifdef __linux__
+    if (0 == fallocate (handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, (off_t)len)) return true;
+#endif
+
+    std::vector<char> zeros ((std::min)(len, (size_t)(1 << 16)), 0);
+
+    while (len > 0)
+    {
+        size_t n = (std::min)(len, zeros.size());
+        if (!writeFull (handle, zeros.data(), n, offset)) return false;
+        len -= n; offset += (long)n;
+    }
+    return true;
+}
+
+
+#endif
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+#include <string>
+#include <mutex>
+
+enum PatchOpType { OP_LITERAL, OP_SEQ, OP_REF, OP_SELF, OP_RUN, OP_HOLE };
+
+// single decoded patch operation.
+struct PatchOp
+{
+    uint16_t type;
+    uint16_t period;  // pattern size (OP_RUN).
+    uint32_t length;
+    long outPos;  // output offset.
+    long src;     // patch offset (OP_LITERAL), byte value (OP_SEQ),
+                  // file1 offset (OP_REF), output offset (OP_SELF)
+                  // patch offset of pattern (OP_RUN) or zero (OP_HOLE).
+    long delta;   // patch offset of bytes added to file1 data (OP_REF), zero if none.
+};
+
+// fills dest with len bytes of run whose output byte x is pattern[x % period],
+// dest being output at offset pos. Period must be a power of two.
+void fillRun (char *dest, size_t len, long pos, const unsigned char *pattern, int period);
+
+// seek table entry: op covering output offset of the entry.
+struct SeekEntry
+{
+    uint64_t patchPos;  // offset of the op in patch.
+    uint64_t outPos;    // output offset the op starts at.
+};
+
+// optional sections following patch body (after EOF op). Sections are written in
+// order of their flag bits, each one ends with its 4-byte length.
+struct PatchSections
+{
+    long bodyEnd;          // end of op stream.
+    uint32_t chunkSize;    // output chunk size, zero when patch has no chunk hashes.
+    std::vector<uint64_t> chunkHashes;
+    uint32_t seekInterval; // output bytes per seek table entry, zero when there is no table.
+    std::vector<SeekEntry> seekTable;
+    std::vector<uint32_t> baseSizes;     // size of every base file, empty for single file 1.
+    std::vector<uint32_t> baseChecksums; // and its CRC.
+
+    PatchSections () : bodyEnd(0), chunkSize(0), seekInterval(0) {}
+};
+
+// reads optional sections given by header flags. returns zero on success.
+int readPatchSections (FILE *fp3, const long patchSize, const unsigned flags, const long size2,
+            PatchSections & sections);
+
+// File #1 of a patch: concatenation of one or more base files. The first file
+// belongs to the caller, the others are opened and closed here. Lazily opened
+// files all belong here and may be read by several threads at once.
+struct BaseFiles
+{
+    BaseFiles () : clock(0), openCount(0), maxOpen(0) {}
+    ~BaseFiles ();
+
+    // sets fp1 (file of size1) as the only base.
+    void single (FILE *fp1, long size1);
+
+    // sets fp1 followed by files given by names, checking them against sizes and
+    // (when verify is set) checksums of the patch. returns zero on success.
+    int open (FILE *fp1, char * const *names, int count, const PatchSections & sections, bool paranoid,
+              bool verify = true);
+
+    // sets files given by names, of sizes already checked by the caller. Each is
+    // opened when first read, and only a limited number of them is kept open.
+    void lazy (const std::vector<std::string> & names, const std::vector<uint32_t> & sizes);
+
+    size_t count () const { return starts.empty() ? 0 : starts.size() - 1; }
+
+    long size () const { return starts.back(); }
+
+    // size of base file i.
+    long sizeOf (size_t i) const { return starts[i + 1] - starts[i]; }
+
+    // reads exactly len bytes at offset of the concatenation. returns true on success.
+    bool read (char *buffer, size_t len, long offset) const;
+
+    // asks system to read range of the concatenation ahead.
+    void willNeed (long offset, long len) const;
+
+private:
+
+    void release ();
+
+    // returns file i, opened if needed, or NULL. Every call is paired with done.
+    FILE *acquire (size_t i) const;
+    void done (size_t i) const;
+
+    mutable std::vector<FILE *> files;
+    std::vector<long> starts;  // offset of every file in concatenation, then total size.
+
+    std::vector<std::string> names;         // of lazily opened files, empty otherwise.
+    mutable std::vector<int> users;         // reads in progress on every lazily opened file,
+    mutable std::vector<unsigned long> used; // and its last use.
+    mutable unsigned long clock;
+    mutable int openCount;
+    int maxOpen;
+    mutable std::mutex lock;
+
+    BaseFiles (const BaseFiles &);
+    BaseFiles & operator = (const BaseFiles &);
+};
+
+// decodes next op of patch body starting at output offset pos (advanced past it).
+// Some ops are decoded into several ones. returns zero on success, one at end of
+// body, -1 on error.
+int decodeOp (FILE *fp3, const long blockSize, const long size1, const long size2,
+            const long patchSize, long & pos, std::vector<PatchOp> & ops);
+
+// decodes patch body (fp3 positioned right after header) into ops list, checking
+// every reference against file sizes. returns zero on success.
+int decodePatchBody (FILE *fp3, const long blockSize, const long size1, const long size2,
+            const long patchSize, std::vector<PatchOp> & ops);
+
+// makes ops list of patch storing file2 as is (PATCH_FLAG_STORED). returns zero
+// when body has exactly the size of file2.
+int storedBodyOps (const long size2, const long bodyEnd, std::vector<PatchOp> & ops);
+
+// returns zero when file1 has journal of interrupted in-place patching,
+// identity is set to size1, size2, checksum1 and checksum2 of its patch.
+int readInPlaceJournal (const char *file1, uint32_t identity[4]);
+
+// transforms file1 into file2 in place (resuming when journal of the same patch
+// exists). Extra memory is bounded by memoryBudget when set. returns zero on success.
+int applyPatchInPlace (const char *file1, FILE *fp3, const std::vector<PatchOp> & ops,
+            const uint32_t identity[4], long long memoryBudget, bool verbose);
+
+#ifndef _MSC_VER
+// positioned read / write of exactly len bytes. return true on success.
+bool readFull (int handle, char *buffer, size_t len, long offset);
+bool writeFull (int handle, const char *buffer, size_t len, long offset);
+
+// makes len bytes at offset read as zeros, punching a hole where the file system
+// allows it and writing zeros elsewhere. returns true on success.
+bool zeroFull (int handle, size_t len, long offset);
+
+// adds len bytes read from patch at offset to data (modulo 256). returns true on success.
+bool addDeltas (int fd3, char *data, size_t len, long offset, std::vector<char> & scratch);
+#endif
@@ -0,0 +1,247 @@
+/* PatchMaker utility, Copyright (c) 1997-2020 Yuriy Yakimenko
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation.  No representations are made about the suitability of this
+ * software for any purpose.  It is provided "as is" without express or
+ * implied warranty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm> // min, max
+
+#include "common.h"
+#include "blockIndex.h"
+#include "patchedReader.h"
+
+#define READER_OP_BATCH 4096  // ops decoded before they are executed.
+
+void PatchedReader::close ()
+{
+    if (fp1) { fclose (fp1); fp1 = nullptr; }
+    if (fp3) { fclose (fp3); fp3 = nullptr; }
+}
+
+int PatchedReader::open (const char *file1, const char *patchFile, bool paranoid,
+            char * const *bases, int baseCount)
+{
+    close ();
+
+    fp1 = fopen (file1, "rb");
+
+    if (fp1 == NULL)
+    {
+        fprintf (stderr, "Could not open file %s\n", file1);
+        return -1;
+    }
+
+    fp3 = fopen (patchFile, "rb");
+
+    if (fp3 == NULL)
+    {
+        fprintf (stderr, "Could not open file %s\n", patchFile);
+        return -1;
+    }
+
+    fseek (fp1, 0L, SEEK_END);
+    long actualSize1 = ftell (fp1);
+
+    fseek (fp3, 0L, SEEK_END);
+    patchSize = ftell (fp3);
+    fseek (fp3, 0L, SEEK_SET);
+
+    unsigned char header [PAT_HEADER_SIZE] = { 0 };
+
+    if (patchSize < PAT_HEADER_SIZE || fread (header, PAT_HEADER_SIZE, 1, fp3) != 1 || memcmp (header, "FOC", 3) != 0)
+    {
+        fprintf (stderr, "Not a patch file: %s\n", patchFile);
+        return -1;
+    }
+
+    if (header[3] == 0 || header[3] > _VERSION_)
+    {
+        fprintf (stderr, "Patch version %d not supported.\n", (int)header[3]);
+        return -1;
+    }
+
+    if (header[5] == 0 || (header[5] & PATCH_ENDIANNESS_MASK) != getEndianness())
+    {
+        fprintf (stderr, "Incomplete patch or endianness not supported.\n");
+        return -1;
+    }
+
+    flags = header[5] & ~PATCH_ENDIANNESS_MASK;
+
+    if (flags & ~PATCH_KNOWN_FLAGS)
+    {
+        fprintf (stderr, "Patch uses features not supported by this version.\n");
+        return -1;
+    }
+
+    if (flags & (PATCH_FLAG_FILTER_X86 | PATCH_FLAG_FILTER_ARM64))
+    {
+        fprintf (stderr, "Patch made with --filter cannot be read partially.\n");
+        return -1;
+    }
+
+    if ((flags & (PATCH_FLAG_SEEK_TABLE | PATCH_FLAG_STORED)) == 0)
+    {
+        fprintf (stderr, "Patch has no seek table, create it with --seek-table.\n");
+        return -1;
+    }
+
+    // header: signature (3), version, block size - 1, flags, 2 times, 2 sizes, 2 checksums.
+    uint32_t size, checksum1 = 0, actualChecksum1 = 0;
+
+    blockSize = (long)header[4] + 1;
+    memcpy (&size, header + 16, 4);
+    size1 = (long)size;
+    memcpy (&size, header + 20, 4);
+    size2 = (long)size;
+    memcpy (&checksum1, header + 24, 4);
+
+    if (0 != readPatchSections (fp3, patchSize, flags, size2, sections) ||
+        ((flags & PATCH_FLAG_STORED) && sections.bodyEnd - PAT_HEADER_SIZE != size2))
+    {
+        fprintf (stderr, "Incomplete or corrupted patch\n");
+        return -1;
+    }
+
+    if (baseCount || (flags & PATCH_FLAG_BASES))
+    {
+        if (0 != baseFiles.open (fp1, bases, baseCount, sections, paranoid)) return -1;
+
+        actualSize1 = baseFiles.size ();
+    }
+    else
+    {
+        baseFiles.single (fp1, actualSize1);
+    }
+
+    if (size1 != actualSize1)
+    {
+        fprintf (stderr, "Original file size mismatch: %ld vs %ld\n", size1, actualSize1);
+        return -1;
+    }
+
+    bool cached = false;
+
+    if (0 != getFileChecksum (file1, fp1, paranoid, actualChecksum1, cached) || actualChecksum1 != checksum1)
+    {
+        fprintf (stderr, "Original file checksum mismatch.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int PatchedReader::readAt (FILE *fp, long offset, size_t len, char *dest)
+{
+    if (0 != fseek (fp, offset, SEEK_SET) || fread (dest, 1, len, fp) != len) return -1;
+
+    return 0;
+}
+
+int PatchedReader::read (long offset, size_t len, char *dest)
+{
+    if (fp3 == nullptr || offset < 0 || offset > size2 || (long)len > size2 - offset) return -1;
+
+    if (len == 0) return 0;
+
+    if (flags & PATCH_FLAG_STORED) return readAt (fp3, PAT_HEADER_SIZE + offset, len, dest);
+
+    // copies of earlier output add tasks instead of recursing, chains of them
+    // may be long. Every task fills its own part of dest.
+    std::vector<Task> pending;
+
+    Task task = { offset, (long)len, dest };
+    pending.push_back (task);
+
+    while (!pending.empty ())
+    {
+        task = pending.back ();
+        pending.pop_back ();
+
+        if (0 != readTask (task, pending)) return -1;
+    }
+
+    return 0;
+}
+
+int PatchedReader::readTask (const Task & task, std::vector<Task> & pending)
+{
+    const long end = task.offset + task.length;
+    const SeekEntry & entry = sections.seekTable[task.offset / sections.seekInterval];
+
+    long pos = (long)entry.outPos;
+    long patchPos = (long)entry.patchPos;
+
+    while (pos < end)
+    {
+        ops.clear ();
+
+        if (0 != fseek (fp3, patchPos, SEEK_SET)) return -1;
+
+        while (pos < end && ops.size () < READER_OP_BATCH)
+        {
+            // EOF op before end of the range means broken seek table.
+            if (0 != decodeOp (fp3, blockSize, size1, size2, sections.bodyEnd, pos, ops)) return -1;
+        }
+
+        patchPos = ftell (fp3);
+
+        for (const PatchOp & op : ops)
+        {
+            long first = (std::max)(op.outPos, task.offset);
+            long last = (std::min)(op.outPos + (long)op.length, end);
+
+            if (first >= last) continue;
+
+            size_t len = (size_t)(last - first);
+            long skip = first - op.outPos;
+            char *dest = task.dest + (first - task.offset);
+
+            if (op.type == OP_LITERAL)
+            {
+                if (0 != readAt (fp3, op.src + skip, len, dest)) return -1;
+            }
+            else if (op.type == OP_SEQ || op.type == OP_HOLE)
+            {
+                memset (dest, (int)op.src, len);
+            }
+            else if (op.type == OP_RUN)
+            {
+                unsigned char pattern [RUN_MAX_PERIOD];
+
+                if (0 != readAt (fp3, op.src, op.period, (char *)pattern)) return -1;
+
+                fillRun (dest, len, first, pattern, op.period);
+            }
+            else if (op.type == OP_REF)
+            {
+                if (!baseFiles.read (dest, len, op.src + skip)) return -1;
+
+                if (op.delta)
+                {
+                    scratch.resize (len);
+
+                    if (0 != readAt (fp3, op.delta + skip, len, scratch.data())) return -1;
+
+                    for (size_t i = 0; i < len; i++) dest[i] = (char)(dest[i] + scratch[i]);
+                }
+            }
+            else // OP_SELF, source precedes the op.
+            {
+                Task copy = { op.src + skip, (long)len, dest };
+                pending.push_back (copy);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "patchOps.h"
+
+// Random access to file #2 of a patch without building the whole file: seek
+// table of the patch gives the op covering any output offset, and only ops
+// overlapping the requested range are decoded from there. Copies of earlier
+// output are resolved by reading their source ranges the same way.
+struct PatchedReader
+{
+    PatchedReader () : fp1(nullptr), fp3(nullptr), blockSize(0), size1(0), size2(0), patchSize(0), flags(0) {}
+    ~PatchedReader () { close (); }
+
+    // opens file1 (followed by other base files of the patch, if any) and patch,
+    // checking base files against patch (their checksums may come from .fcc
+    // sidecars unless paranoid is set). Patch must have a seek table or store
+    // file2 as is. returns zero on success.
+    int open (const char *file1, const char *patchFile, bool paranoid = false,
+              char * const *bases = nullptr, int baseCount = 0);
+
+    // copies [offset, offset + len) of file2 to dest. returns zero on success.
+    int read (long offset, size_t len, char *dest);
+
+    // size of file2.
+    long size () const { return size2; }
+
+    // optional sections of the patch (chunk hashes allow checking what was read).
+    const PatchSections & patchSections () const { return sections; }
+
+    void close ();
+
+private:
+
+    // part of output still to be read into dest.
+    struct Task
+    {
+        long offset;
+        long length;
+        char *dest;
+    };
+
+    int readTask (const Task & task, std::vector<Task> & pending);
+    int readAt (FILE *fp, long offset, size_t len, char *dest);
+
+    FILE *fp1;
+    FILE *fp3;
+    long blockSize;
+    long size1;
+    long size2;
+    long patchSize;
+    unsigned flags;
+    PatchSections sections;
+    BaseFiles baseFiles;
+    std::vector<PatchOp> ops;
+    std::vector<char> scratch;
+
+    PatchedReader (const PatchedReader &);
+    PatchedReader & operator = (const PatchedReader &);
+};
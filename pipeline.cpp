@@ -0,0 +1,220 @@
+/* PatchMaker utility, Copyright (c) 1997-2020 Yuriy Yakimenko
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation.  No representations are made about the suitability of this
+ * software for any purpose.  It is provided "as is" without express or
+ * implied warranty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm> // min, max
+
+#include "pipeline.h"
+
+int InputReader::start (const char *filename, const char *data, long fileSize, long firstOffset)
+{
+    image = data;
+
+    if (image == nullptr && (fp = fopen (filename, "rb")) == NULL) return -1;
+
+    if (fp && 0 != fseek (fp, firstOffset, SEEK_SET))
+    {
+        stop ();
+        return -1;
+    }
+
+    first = firstOffset;
+    size = fileSize;
+    cancelled = false;
+
+    for (int i = 0; i < PIPELINE_BLOCKS; i++)
+    {
+        PipelineBlock block = { (char *)malloc (PIPELINE_BLOCK_SIZE), 0, 0 };
+
+        if (block.data == nullptr)
+        {
+            stop ();
+            return -1;
+        }
+
+        empty.push (block);
+    }
+
+    thread = std::thread (&InputReader::run, this);
+    started = true;
+
+    return 0;
+}
+
+void InputReader::run ()
+{
+    for (long offset = first; offset < size; offset += PIPELINE_BLOCK_SIZE)
+    {
+        PipelineBlock block;
+
+        while (!empty.tryPop (block))
+        {
+            if (cancelled) return;
+            std::this_thread::yield();
+        }
+
+        block.offset = offset;
+        block.length = (std::min)(PIPELINE_BLOCK_SIZE, size - offset);
+
+        if (image) memcpy (block.data, image + offset, block.length);
+        else if (fread (block.data, block.length, 1, fp) != 1) block.length = -1;
+
+        while (!filled.tryPush (block))
+        {
+            if (cancelled) { free (block.data); return; }
+            std::this_thread::yield();
+        }
+
+        if (block.length < 0) return;
+    }
+}
+
+void InputReader::stop ()
+{
+    if (started)
+    {
+        cancelled = true;
+        thread.join ();
+        started = false;
+    }
+
+    PipelineBlock block;
+
+    while (filled.tryPop (block)) free (block.data);
+    while (empty.tryPop (block)) free (block.data);
+
+    for (PipelineBlock & b : window) free (b.data);
+
+    window.clear ();
+
+    if (fp) { fclose (fp); fp = nullptr; }
+}
+
+int InputReader::read (long pos, size_t len, unsigned char *dest)
+{
+    if (!started || pos < first || pos + (long)len > size) return -1;
+
+    // blocks entirely before pos are no longer needed, unless pos may still go back into them.
+    while (!window.empty() && window.front().offset + window.front().length <= pos - PIPELINE_REWIND)
+    {
+        empty.push (window.front());
+        window.pop_front ();
+    }
+
+    for (size_t done = 0; done < len; )
+    {
+        long p = pos + (long)done;
+
+        const PipelineBlock *found = nullptr;
+
+        for (const PipelineBlock & b : window)
+        {
+            if (p >= b.offset && p < b.offset + b.length) found = &b;
+        }
+
+        if (found == nullptr)
+        {
+            PipelineBlock block = filled.pop ();
+
+            if (block.length < 0)
+            {
+                empty.push (block);
+                return -1;
+            }
+
+            if (block.offset + block.length <= pos - PIPELINE_REWIND) empty.push (block);
+            else window.push_back (block);
+
+            continue;
+        }
+
+        size_t n = (std::min)(len - done, (size_t)(found->offset + found->length - p));
+
+        memcpy (dest + done, found->data + (p - found->offset), n);
+
+        done += n;
+    }
+
+    return 0;
+}
+
+int OutputWriter::start (FILE *output)
+{
+    fp = output;
+    failed = false;
+
+    for (int i = 0; i < PIPELINE_BLOCKS; i++)
+    {
+        PipelineBlock block = { (char *)malloc (PIPELINE_BLOCK_SIZE), 0, 0 };
+
+        if (block.data == nullptr)
+        {
+            while (empty.tryPop (block)) free (block.data);
+            free (current.data);
+            current.data = nullptr;
+            return -1;
+        }
+
+        if (i == 0) current = block;
+        else empty.push (block);
+    }
+
+    thread = std::thread (&OutputWriter::run, this);
+    started = true;
+
+    return 0;
+}
+
+void OutputWriter::run ()
+{
+    for (;;)
+    {
+        PipelineBlock block = filled.pop ();
+
+        if (block.data == nullptr) break; // end of output.
+
+        if (!failed && block.length > 0 && fwrite (block.data, block.length, 1, fp) != 1) failed = true;
+
+        block.length = 0;
+        empty.push (block);
+    }
+}
+
+void OutputWriter::flush ()
+{
+    filled.push (current);
+    current = empty.pop ();
+}
+
+int OutputWriter::finish ()
+{
+    if (!started) return failed ? -1 : 0;
+
+    PipelineBlock end = { nullptr, 0, 0 };
+
+    filled.push (current);
+    filled.push (end);
+
+    thread.join ();
+    started = false;
+
+    PipelineBlock block;
+
+    while (empty.tryPop (block)) free (block.data);
+
+    current.data = nullptr;
+    current.length = 0;
+
+    return failed ? -1 : 0;
+}
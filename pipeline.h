@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <deque>
+
+#define PIPELINE_BLOCK_SIZE (1L << 20)  // size of buffers passed between threads.
+#define PIPELINE_BLOCKS     4           // buffers per stage.
+#define PIPELINE_REWIND     (64L << 10) // InputReader positions may go back this far.
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+// Waiting side yields its time slice until the other side catches up.
+template <typename T, size_t N> struct SpscQueue
+{
+    SpscQueue () : head(0), tail(0) {}
+
+    bool tryPush (const T & item)
+    {
+        size_t t = tail.load (std::memory_order_relaxed);
+
+        if (t - head.load (std::memory_order_acquire) == N) return false;
+
+        items[t % N] = item;
+        tail.store (t + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    bool tryPop (T & item)
+    {
+        size_t h = head.load (std::memory_order_relaxed);
+
+        if (h == tail.load (std::memory_order_acquire)) return false;
+
+        item = items[h % N];
+        head.store (h + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    void push (const T & item) { while (!tryPush (item)) std::this_thread::yield(); }
+
+    T pop () { T item; while (!tryPop (item)) std::this_thread::yield(); return item; }
+
+private:
+
+    T items [N];
+    alignas(64) std::atomic<size_t> head;  // next item to pop, written by consumer only.
+    alignas(64) std::atomic<size_t> tail;  // next free place, written by producer only.
+};
+
+struct PipelineBlock
+{
+    char *data;
+    long offset;  // position in file (reader only).
+    long length;  // bytes of data, -1 on read error.
+};
+
+// Reads a file sequentially on its own thread, up to PIPELINE_BLOCKS buffers
+// ahead of the consumer, so disk stalls do not pause the consumer.
+struct InputReader
+{
+    InputReader () : fp(nullptr), image(nullptr), first(0), size(0), started(false), cancelled(false) {}
+    ~InputReader () { stop (); }
+
+    // opens file and starts reading it from offset first up to size. When image
+    // is given, data comes from it instead (file already in memory).
+    // returns zero on success.
+    int start (const char *filename, const char *image, long size, long first = 0);
+
+    // copies [pos, pos + len) to dest. pos must not go back between calls by more
+    // than PIPELINE_REWIND and len must not exceed PIPELINE_BLOCK_SIZE. returns
+    // zero on success.
+    int read (long pos, size_t len, unsigned char *dest);
+
+private:
+
+    void run ();
+    void stop ();
+
+    FILE *fp;
+    const char *image;
+    long first;
+    long size;
+    bool started;
+    std::atomic<bool> cancelled;
+    std::thread thread;
+    SpscQueue<PipelineBlock, PIPELINE_BLOCKS> filled, empty;
+    std::deque<PipelineBlock> window;  // blocks held by consumer, ascending.
+
+    InputReader (const InputReader &);
+    InputReader & operator = (const InputReader &);
+};
+
+// Collects small writes into large buffers, written to file on its own thread.
+struct OutputWriter
+{
+    OutputWriter () : fp(nullptr), started(false), failed(false), total(0) { current.data = nullptr; current.length = 0; }
+    ~OutputWriter () { finish (); }
+
+    // starts writer thread for file positioned where output goes. returns zero on success.
+    int start (FILE *fp);
+
+    inline void write (const void *data, size_t len)
+    {
+        const char *src = (const char *)data;
+
+        total += (long)len;
+
+        while (len > 0)
+        {
+            size_t room = (size_t)(PIPELINE_BLOCK_SIZE - current.length);
+            size_t n = len < room ? len : room;
+
+            memcpy (current.data + current.length, src, n);
+
+            current.length += (long)n;
+            src += n;
+            len -= n;
+
+            if (current.length == PIPELINE_BLOCK_SIZE) flush ();
+        }
+    }
+
+    // writes remaining data and stops writer thread. returns zero when all
+    // data was written.
+    int finish ();
+
+    // bytes given to write so far.
+    long position () const { return total; }
+
+private:
+
+    void run ();
+    void flush ();
+
+    FILE *fp;
+    bool started;
+    std::atomic<bool> failed;
+    long total;
+    std::thread thread;
+    PipelineBlock current;
+    SpscQueue<PipelineBlock, PIPELINE_BLOCKS> filled, empty;
+
+    OutputWriter (const OutputWriter &);
+    OutputWriter & operator = (const OutputWriter &);
+};
@@ -1,4 +1,5 @@
 #include "progArgs.h"
+#include "bcjFilter.h"
 
 const char szSyntax [] =
      "Syntax: ./patch [flags] oldfile.ext newfile.ext [file.pat]\n"
@@ -10,11 +11,56 @@ const char szSyntax [] =
      "          -q - quiet mode\n"
      "          -v - verbose mode\n"
      "          -d - disable I/O buffering\n"
-     "          -x - maximize compression\n";
+     "          -x - maximize compression\n"
+     "          -k - cache oldfile index (creation only)\n"
+     "          --output-dir=DIR - create one patch per new file in DIR:\n"
+     "            ./patch -c [flags] --output-dir=DIR oldfile.ext new1.ext ... newN.ext\n"
+     "          --in-place - transform oldfile into newfile (apply only):\n"
+     "            ./patch -a [flags] --in-place oldfile.ext file.pat\n"
+     "          --base=FILE - one more old file to refer to, may be repeated;\n"
+     "            the same list is given when applying\n"
+     "          --tree - oldfile and newfile are directories, patch is one archive:\n"
+     "            ./patch -c|-a [flags] --tree olddir newdir [file.fot]\n"
+     "          --max-memory=SIZE - memory budget, e.g. 512M or 2G\n"
+     "          --chunk-hashes[=SIZE] - store hash of every SIZE bytes of newfile\n"
+     "            (creation only, default 1M), allows resuming interrupted apply\n"
+     "          --seek-table[=SIZE] - store where every SIZE bytes of newfile start\n"
+     "            in patch (creation only, default 1M), allows --range\n"
+     "          --range=OFFSET,LENGTH - make only this part of newfile (apply only)\n"
+     "          --filter=x86|arm64 - convert branches of executables (creation only)\n"
+     "          --both - also create patch from newfile back to oldfile (creation\n"
+     "            only), named after oldfile unless given:\n"
+     "            ./patch -c [flags] --both oldfile.ext newfile.ext [file.pat [back.pat]]\n"
+     "          --approx - allow matches with scattered changed bytes (creation only)\n"
+     "          --deadline=SECONDS - finish patch within this time, refining it\n"
+     "            while time remains (creation only)\n"
+     "          --paranoid - always read whole files for checksums, ignore .fcc cache\n"
+     "          --estimate - predict patch size from samples of newfile (creation only):\n"
+     "            ./patch -c [flags] --estimate oldfile.ext newfile.ext\n";
 
 const char szCopyRight []= "Patch maker utility. (c) Yuriy Yakimenko. 1997-2020\n";
 
 
+// parses size with optional K, M or G suffix. returns zero on success.
+static int parseSize (const char *text, long long & size)
+{
+    char *end = nullptr;
+
+    double value = strtod (text, &end);
+
+    if (end == text || value <= 0) return -1;
+
+    if (*end == 'K' || *end == 'k') { value *= 1024.0; end++; }
+    else if (*end == 'M' || *end == 'm') { value *= 1024.0 * 1024; end++; }
+    else if (*end == 'G' || *end == 'g') { value *= 1024.0 * 1024 * 1024; end++; }
+
+    if (*end != 0) return -1;
+
+    size = (long long)value;
+
+    return 0;
+}
+
 static void outputSyntax (bool showAuthor = false)
 {
     if (showAuthor)
@@ -35,9 +81,136 @@ int progArguments::parseArguments (int argc, char *argv[])
         return -1;
     }
 
+    targets = (char **)calloc (argc, sizeof (char *));
+    patches = (char **)calloc (argc, sizeof (char *));
+    bases = (char **)calloc (argc, sizeof (char *));
+
+    if (targets == nullptr || patches == nullptr || bases == nullptr)
+    {
+        fprintf (stderr, "Not enough memory\n");
+        return -1;
+    }
+
     for (int i = 1; i < argc; i++)
     {
-        if (strncmp (argv[i], "-", 1) == 0) // flags
+        if (strncmp (argv[i], "--", 2) == 0) // long options
+        {
+            if (fileNameSet)
+            {
+                outputSyntax ();
+                return -1;
+            }
+
+            if (strncmp (argv[i], "--output-dir=", 13) == 0 && argv[i][13])
+            {
+                free (outputDir);
+                outputDir = strdup (argv[i] + 13);
+            }
+            else if (strncmp (argv[i], "--base=", 7) == 0 && argv[i][7])
+            {
+                bases[baseCount++] = strdup (argv[i] + 7);
+            }
+            else if (strcmp (argv[i], "--tree") == 0)
+            {
+                flagTree = true;
+            }
+            else if (strcmp (argv[i], "--in-place") == 0)
+            {
+                flagInPlace = true;
+            }
+            else if (strcmp (argv[i], "--both") == 0)
+            {
+                flagBoth = true;
+            }
+            else if (strcmp (argv[i], "--approx") == 0)
+            {
+                flagApprox = true;
+            }
+            else if (strncmp (argv[i], "--deadline=", 11) == 0)
+            {
+                char *end = nullptr;
+
+                deadline = strtod (argv[i] + 11, &end);
+
+                if (end == argv[i] + 11 || *end != 0 || !(deadline > 0) || deadline > 1e7)
+                {
+                    fprintf (stderr, "Invalid deadline %s\n", argv[i] + 11);
+                    return -1;
+                }
+            }
+            else if (strcmp (argv[i], "--paranoid") == 0)
+            {
+                flagParanoid = true;
+            }
+            else if (strcmp (argv[i], "--estimate") == 0)
+            {
+                flagEstimate = true;
+            }
+            else if (strncmp (argv[i], "--max-memory=", 13) == 0)
+            {
+                if (0 != parseSize (argv[i] + 13, maxMemory))
+                {
+                    fprintf (stderr, "Invalid memory size %s\n", argv[i] + 13);
+                    return -1;
+                }
+            }
+            else if (strncmp (argv[i], "--filter=", 9) == 0)
+            {
+                branchFilter = branchFilterByName (argv[i] + 9);
+
+                if (branchFilter == FILTER_NONE)
+                {
+                    fprintf (stderr, "Unknown filter %s\n", argv[i] + 9);
+                    return -1;
+                }
+            }
+            else if (strcmp (argv[i], "--chunk-hashes") == 0)
+            {
+                chunkHashSize = 1024 * 1024;
+            }
+            else if (strncmp (argv[i], "--chunk-hashes=", 15) == 0)
+            {
+                if (0 != parseSize (argv[i] + 15, chunkHashSize) || chunkHashSize < 4096 || chunkHashSize > 0x4000000)
+                {
+                    fprintf (stderr, "Invalid chunk size %s (4K to 64M)\n", argv[i] + 15);
+                    return -1;
+                }
+            }
+            else if (strcmp (argv[i], "--seek-table") == 0)
+            {
+                seekInterval = 1024 * 1024;
+            }
+            else if (strncmp (argv[i], "--seek-table=", 13) == 0)
+            {
+                if (0 != parseSize (argv[i] + 13, seekInterval) || seekInterval < 0x10000 || seekInterval > 0x40000000)
+                {
+                    fprintf (stderr, "Invalid seek interval %s (64K to 1G)\n", argv[i] + 13);
+                    return -1;
+                }
+            }
+            else if (strncmp (argv[i], "--range=", 8) == 0)
+            {
+                char *end = nullptr;
+
+                rangeOffset = strtoll (argv[i] + 8, &end, 10);
+
+                if (end == argv[i] + 8 || *end != ',' || rangeOffset < 0 ||
+                    0 != parseSize (end + 1, rangeLength))
+                {
+                    fprintf (stderr, "Invalid range %s\n", argv[i] + 8);
+                    return -1;
+                }
+
+                flagRange = true;
+            }
+            else
+            {
+                fprintf (stderr, "Unknown option %s\n", argv[i]);
+                outputSyntax ();
+                return -1;
+            }
+        }
+        else if (strncmp (argv[i], "-", 1) == 0) // flags
         {
             if (fileNameSet)
             {
@@ -89,6 +262,10 @@ int progArguments::parseArguments (int argc, char *argv[])
                 {
                     flagMaximizeCompression = true;
                 }
+                else if (flag == 'k')
+                {
+                    flagIndexCache = true;
+                }
                 else 
                 {
                     fprintf (stderr, "Unknown flag -%c\n", flag);
@@ -105,6 +282,16 @@ int progArguments::parseArguments (int argc, char *argv[])
             {
                 file1 = strdup (argv[i]);
             }
+            else if (outputDir)
+            {
+                if (strcmp (file1, argv[i]) == 0)
+                {
+                    fprintf (stderr, "Two input files are the same\n");
+                    return -1;
+                }
+
+                targets[targetCount++] = strdup (argv[i]);
+            }
             else if (file2 == nullptr)
             {
                 file2 = strdup (argv[i]);
@@ -113,6 +300,10 @@ int progArguments::parseArguments (int argc, char *argv[])
             {
                 file3 = strdup (argv[i]);
             }
+            else if (file4 == nullptr && flagBoth)
+            {
+                file4 = strdup (argv[i]);
+            }
         }
     }
 
@@ -135,22 +326,150 @@ int progArguments::parseArguments (int argc, char *argv[])
         return -1;
     }
 
+    if (chunkHashSize && !flagCreate)
+    {
+        fprintf (stderr, "--chunk-hashes can only be used with -c flag\n");
+        return -1;
+    }
+
+    if (seekInterval && (!flagCreate || branchFilter))
+    {
+        fprintf (stderr, "--seek-table can only be used with -c flag and without --filter\n");
+        return -1;
+    }
+
+    if (flagRange && (!flagApply || flagInPlace))
+    {
+        fprintf (stderr, "--range can only be used with -a flag and without --in-place\n");
+        return -1;
+    }
+
+    if (flagEstimate && (!flagCreate || outputDir))
+    {
+        fprintf (stderr, "--estimate can only be used with -c flag and two file names\n");
+        return -1;
+    }
+
+    if (deadline > 0 && (!flagCreate || flagEstimate))
+    {
+        fprintf (stderr, "--deadline can only be used with -c flag and without --estimate\n");
+        return -1;
+    }
+
+    if (flagApprox && !flagCreate)
+    {
+        fprintf (stderr, "--approx can only be used with -c flag\n");
+        return -1;
+    }
+
+    if (branchFilter && !flagCreate)
+    {
+        fprintf (stderr, "--filter can only be used with -c flag\n");
+        return -1;
+    }
+
+#ifdef _MSC_VER
+    if (branchFilter)
+    {
+        fprintf (stderr, "--filter is not supported on this platform\n");
+        return -1;
+    }
+#endif
+
+    if (baseCount && (flagInPlace || flagIndexCache || branchFilter))
+    {
+        fprintf (stderr, "--base cannot be combined with --in-place, -k or --filter\n");
+        return -1;
+    }
+
+    if (flagTree && (outputDir || baseCount || flagInPlace || flagRange || flagEstimate || flagIndexCache || branchFilter))
+    {
+        fprintf (stderr, "--tree cannot be combined with --output-dir, --base, --in-place, --range, --estimate, -k or --filter\n");
+        return -1;
+    }
+
+    if (flagBoth && (!flagCreate || outputDir || baseCount || flagTree || flagEstimate))
+    {
+        fprintf (stderr, "--both can only be used with -c flag and without --output-dir, --base, --tree or --estimate\n");
+        return -1;
+    }
+
+#ifdef _MSC_VER
+    if (baseCount || flagTree)
+    {
+        fprintf (stderr, "--base and --tree are not supported on this platform\n");
+        return -1;
+    }
+#endif
+
+    if (outputDir)
+    {
+        if (!flagCreate)
+        {
+            fprintf (stderr, "--output-dir can only be used with -c flag\n");
+            return -1;
+        }
+
+        if (file1 == nullptr || targetCount == 0)
+        {
+            fprintf (stderr, "Input file names not set\n");
+            return -1;
+        }
+
+        file2 = strdup (targets[0]);
+
+        return CreateTargetPatchNames ();
+    }
+
     if (file1 == nullptr || file2 == nullptr)
     {
         fprintf (stderr, "Input file names not set\n");
         return -1;
     }
 
+    if (flagInPlace) // second file name is the patch.
+    {
+        if (!flagApply || file3 != nullptr)
+        {
+            fprintf (stderr, "--in-place requires -a flag and two file names\n");
+            return -1;
+        }
+
+        file3 = file2;
+        file2 = strdup (file1);
+
+        return 0;
+    }
+
     if (strcmp (file1, file2) == 0)
     {
         fprintf (stderr, "Two input files are the same\n");
         return -1;
     }
 
+    if (file3 == nullptr && flagTree)
+    {
+        return CreateArchiveFileName ();
+    }
+
     if (file3 == nullptr)
     {
-        if (0 != this->CreatePatchFileName())
+        if (0 != this->CreatePatchFileName (file2, file3))
+        {
+            return -1;
+        }
+    }
+
+    if (flagBoth)
+    {
+        if (file4 == nullptr && 0 != this->CreatePatchFileName (file1, file4))
+        {
+            return -1;
+        }
+
+        if (strcmp (file3, file4) == 0)
         {
+            fprintf (stderr, "Both patches would be written to %s\n", file3);
             return -1;
         }
     }
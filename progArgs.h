@@ -6,11 +6,20 @@
 #include <string.h>
 #include "common.h"
 
+struct BaseFiles;
+
 struct progArguments
 {
     char *file1;
     char *file2;
     char *file3;
+    char *file4;       // patch from newfile back to oldfile (--both).
+    char *outputDir;   // set when creating patches for several new files.
+    int targetCount;   // number of new files (output directory mode).
+    char **targets;    // new files (output directory mode).
+    char **patches;    // patch file per new file (output directory mode).
+    int baseCount;     // number of additional base files.
+    char **bases;      // additional base files, referenced after oldfile.
     bool flagCreate;
     bool flagApply;
     bool flagForce;
@@ -20,10 +29,34 @@ struct progArguments
     bool flagShowStats;
     bool flagIgnoreTimestamps;
     bool flagMaximizeCompression; // double number of refs.
+    bool flagIndexCache;          // keep file1 index in a sidecar file.
+    bool flagInPlace;             // apply patch to file1 itself.
+    bool flagApprox;              // extend matches through scattered changed bytes.
+    bool flagParanoid;            // always compute checksums, ignoring .fcc sidecars.
+    bool flagEstimate;            // predict patch size from samples, create nothing.
+    bool flagTree;                // oldfile and newfile are directories, patch is a tree archive.
+    bool flagBoth;                // also create patch from newfile back to oldfile.
+    bool flagBasesVerified;       // base files already checked by caller (not an option).
+    bool flagNoSidecars;          // files are tree members, no .fcc written (not an option).
+    bool flagNoBaseList;          // base files are listed by caller, not in patch (not an option).
+    const BaseFiles *sharedBases; // base files opened by caller, instead of bases (not an option).
+    long long maxMemory;          // memory budget in bytes, zero when not set.
+    long long chunkHashSize;      // output chunk size for integrity hashes, zero when not set.
+    long long seekInterval;       // output bytes per seek table entry, zero when not set.
+    bool flagRange;               // extract only part of newfile (apply only).
+    long long rangeOffset;
+    long long rangeLength;
+    int branchFilter;             // FILTER_* of bcjFilter.h, executable preprocessing.
+    double deadline;              // seconds allowed for creation, zero when not set.
 
     progArguments ()
     {
-        file1 = file2 = file3 = nullptr;
+        file1 = file2 = file3 = file4 = nullptr;
+        outputDir = nullptr;
+        targetCount = 0;
+        targets = patches = nullptr;
+        baseCount = 0;
+        bases = nullptr;
         flagCreate = false;
         flagApply = false;
         flagForce = false;
@@ -33,6 +66,24 @@ struct progArguments
         flagShowStats = false;
         flagIgnoreTimestamps = false;
         flagMaximizeCompression = false;
+        flagIndexCache = false;
+        flagInPlace = false;
+        flagApprox = false;
+        flagParanoid = false;
+        flagEstimate = false;
+        flagTree = false;
+        flagBoth = false;
+        flagBasesVerified = false;
+        flagNoSidecars = false;
+        flagNoBaseList = false;
+        sharedBases = nullptr;
+        maxMemory = 0;
+        chunkHashSize = 0;
+        seekInterval = 0;
+        flagRange = false;
+        rangeOffset = rangeLength = 0;
+        branchFilter = 0;
+        deadline = 0;
     }
 
     ~progArguments ()
@@ -40,25 +91,43 @@ struct progArguments
         free (file1);
         free (file2);
         free (file3);
+        free (file4);
+        free (outputDir);
+
+        for (int i = 0; i < targetCount; i++)
+        {
+            free (targets[i]);
+            free (patches[i]);
+        }
+
+        for (int i = 0; i < baseCount; i++)
+        {
+            free (bases[i]);
+        }
+
+        free (targets);
+        free (patches);
+        free (bases);
     }
 
-    int CreatePatchFileName ()
+    // sets patch name: name of the file patch produces, with .foc extension.
+    int CreatePatchFileName (const char *target, char *& patch)
     {
         int i = 0;
 
         char szNewName [PATH_MAX] = { 0 };
 
-        if (strlen(file2) > PATH_MAX - 1)
+        if (strlen(target) > PATH_MAX - 1)
         {
             return -1;
         }
 
-        strcpy (szNewName, file2);
+        strcpy (szNewName, target);
         
-        for (i = (int)strlen(file2) - 1; file2[i] != '.' && i > 0; i--);
+        for (i = (int)strlen(target) - 1; target[i] != '.' && i > 0; i--);
 
         if (i == 0)  // name may no point and extention
-            i = (int)strlen(file2);
+            i = (int)strlen(target);
 
         if (i > PATH_MAX - 5)
         {
@@ -70,6 +139,78 @@ struct progArguments
 
         printf ("Patch file set to %s\n", szNewName);
 
+        patch = strdup (szNewName);
+
+        return 0;
+    }
+
+    // sets patch file name in output directory for every new file. Fails when
+    // two new files get the same one.
+    int CreateTargetPatchNames ()
+    {
+        for (int t = 0; t < targetCount; t++)
+        {
+            char szNewName [PATH_MAX] = { 0 };
+
+            const char *name = targets[t];
+
+            for (const char *p = targets[t]; *p; p++)
+            {
+                if (*p == '/' || *p == '\\') name = p + 1;
+            }
+
+            int len = (int)strlen (name);
+
+            int i = len - 1;
+
+            for (; i > 0 && name[i] != '.'; i--);
+
+            if (i <= 0)  // name may no point and extention
+                i = len;
+
+            if (snprintf (szNewName, sizeof (szNewName), "%s/%.*s.foc", outputDir, i, name) >= (int)sizeof (szNewName))
+            {
+                fprintf (stderr, "File name is too long\n");
+                return -1;
+            }
+
+            patches[t] = strdup (szNewName);
+
+            // only the name is kept, new files from different directories may clash.
+            for (int u = 0; u < t; u++)
+            {
+#ifdef _MSC_VER
+                if (_stricmp (patches[u], patches[t]) == 0)
+#else
+                if (strcmp (patches[u], patches[t]) == 0)
+#endif
+                {
+                    fprintf (stderr, "New files %s and %s would both be patched to %s\n", targets[u], targets[t], patches[t]);
+                    return -1;
+                }
+            }
+        }
+
+        return 0;
+    }
+
+    // sets tree archive name: new directory name with .fot extension.
+    int CreateArchiveFileName ()
+    {
+        char szNewName [PATH_MAX] = { 0 };
+
+        int len = (int)strlen (file2);
+
+        while (len > 1 && (file2[len - 1] == '/' || file2[len - 1] == '\\')) len--;
+
+        if (snprintf (szNewName, sizeof (szNewName), "%.*s.fot", len, file2) >= (int)sizeof (szNewName))
+        {
+            fprintf (stderr, "File name is too long\n");
+            return -1;
+        }
+
+        printf ("Archive file set to %s\n", szNewName);
+
         this->file3 = strdup (szNewName);
 
         return 0;
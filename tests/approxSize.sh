@@ -0,0 +1,70 @@
+#!/bin/bash
+# Patches made with --approx must never be larger than exact ones: scattered
+# edits of records, and pages copied from similar pages with a few changes.
+# usage: tests/approxSize.sh [path to patch]
+set -u
+
+P=$(realpath "${1:-./patch}")
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+cd "$T"
+
+# records with counters, every n-th byte on average changed in new file.
+records ()
+{
+    awk -v seed=$1 -v gap=$2 'BEGIN {
+        srand (seed);
+        next_ = int (rand () * 2 * gap);
+        for (i = 0; i < 20000; i++) {
+            line = sprintf ("rec%06d|%08x|", i, int (rand () * 4294967296));
+            for (k = 0; k < 20; k++) line = line substr ("abcdefghij", int (rand () * 10) + 1, 1);
+            line = line "\n";
+            printf "%s", line > "old";
+            for (; next_ < length (line); next_ += int (rand () * 2 * gap) + 1) {
+                line = substr (line, 1, next_) substr ("0123456789", int (rand () * 10) + 1, 1) substr (line, next_ + 2);
+            }
+            next_ -= length (line);
+            printf "%s", line > "new";
+        }
+    }'
+}
+
+# 64 variants of a page, new pages taken from random old ones with a few changes.
+pages ()
+{
+    awk -v seed=$1 'function vary (s,   j, q) {
+            for (j = int (rand () * 19) + 2; j > 0; j--) {
+                q = int (rand () * 4096) + 1;
+                s = substr (s, 1, q - 1) substr ("KLMNOPQRST", int (rand () * 10) + 1, 1) substr (s, q + 1);
+            }
+            return s;
+        }
+        BEGIN {
+            srand (seed);
+            for (i = 0; i < 4096; i++) base = base substr ("abcdefghijklmnopqrstuvwxyz", int (rand () * 26) + 1, 1);
+            for (i = 0; i < 64; i++) { page[i] = vary(base); printf "%s", page[i] > "old"; }
+            for (i = 0; i < 64; i++) printf "%s", vary(page[int (rand () * 64)]) > "new";
+        }'
+}
+
+fail=0
+
+check ()
+{
+    "$P" -cfq old new exact.foc && "$P" -cfq --approx old new approx.foc && "$P" -afq old out approx.foc &&
+        cmp -s out new || { echo "FAIL: $1 round trip"; fail=1; return; }
+
+    local e=$(stat -c %s exact.foc) a=$(stat -c %s approx.foc)
+
+    [ $a -le $e ] || { echo "FAIL: $1 approx $a > exact $e bytes"; fail=1; }
+}
+
+for seed in 1 2 3; do
+    for gap in 8 30 100 400; do records $seed $gap; check "records $seed/$gap"; done
+    pages $seed; check "pages $seed"
+done
+
+[ $fail -eq 0 ] && echo "approx never larger: OK"
+
+exit $fail
@@ -0,0 +1,23 @@
+/* Test helper, preloaded into patch: process exits at the CRASH_AT-th call of
+   fsync, before it is done, as if the machine went down there. Data written
+   so far stays in file cache, like after a crash of the process itself.
+
+   c++ -shared -fPIC -o fsyncKill.so fsyncKill.cpp -ldl
+   CRASH_AT=6 LD_PRELOAD=./fsyncKill.so ./patch ...
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+extern "C" int fsync (int fd)
+{
+    static long calls = 0;
+    static const char *limit = getenv ("CRASH_AT");
+
+    if (limit && ++calls == atol (limit)) _exit (99);
+
+    int (*real)(int) = (int (*)(int))dlsym (RTLD_NEXT, "fsync");
+
+    return real (fd);
+}
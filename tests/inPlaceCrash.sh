@@ -0,0 +1,42 @@
+#!/bin/bash
+# In-place patching killed at every fsync in turn, then resumed: file #1 has to
+# end up equal to file #2 each time.
+# usage: tests/inPlaceCrash.sh [path to patch]
+set -u
+
+P=$(realpath "${1:-./patch}")
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+c++ -shared -fPIC -o "$T/fsyncKill.so" "$(dirname "$0")/fsyncKill.cpp" -ldl || exit 1
+
+cd "$T"
+
+# 10 MB old file, new file with blocks moved around so that batches conflict.
+head -c 10485760 /dev/urandom > old
+{ tail -c 3145728 old; head -c 4194304 old; head -c 524288 /dev/urandom; head -c 3145728 old | tail -c 2097152; } > new
+
+"$P" -cfq old new p.foc || exit 1
+
+fail=0
+
+for ((n = 1; ; n++))
+do
+    cp old work
+    rm -f work.foj work.fcc
+
+    CRASH_AT=$n LD_PRELOAD="$T/fsyncKill.so" "$P" -afq --in-place --max-memory=2M work p.foc > /dev/null 2>&1
+    ret=$?
+
+    if [ $ret -ne 99 ]; then
+        [ $ret -eq 0 ] && cmp -s work new || { echo "FAIL: run without crash at $n"; fail=1; }
+        break
+    fi
+
+    "$P" -afq --in-place --max-memory=2M work p.foc > /dev/null 2>&1 && cmp -s work new ||
+        { echo "FAIL: resume after crash at fsync $n"; fail=1; }
+done
+
+[ $fail -eq 0 ] && echo "in-place crash/resume: OK ($((n - 1)) crash points)"
+
+exit $fail
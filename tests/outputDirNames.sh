@@ -0,0 +1,36 @@
+#!/bin/bash
+# --output-dir names patches after new files: ones which would get the same patch
+# must be refused, not overwrite each other. Distinct ones must all be created.
+# usage: tests/outputDirNames.sh [path to patch]
+set -u
+
+P=$(realpath "${1:-./patch}")
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+cd "$T"
+
+mkdir a b od
+head -c 100000 /dev/urandom > old
+for f in a/x.bin b/x.bin a/x.txt a/y.bin; do
+    cp old $f; printf '%s' "$f" | dd of=$f bs=1 seek=5000 conv=notrunc 2>/dev/null
+done
+
+fail=0
+
+# same name in two directories, and same name with another extension.
+for pair in "a/x.bin b/x.bin" "a/x.bin a/x.txt"; do
+    rm -f od/*
+    # invalid arguments do not change exit code, see main.
+    "$P" -cfq --output-dir=od old $pair 2>&1 | grep -q "would both be patched" || { echo "FAIL: $pair accepted"; fail=1; }
+    [ -z "$(ls od)" ] || { echo "FAIL: $pair wrote $(ls od)"; fail=1; }
+done
+
+rm -f od/*
+"$P" -cfq --output-dir=od old a/x.bin a/y.bin > /dev/null &&
+    "$P" -afq old x.out od/x.foc > /dev/null && cmp -s x.out a/x.bin &&
+    "$P" -afq old y.out od/y.foc > /dev/null && cmp -s y.out a/y.bin || { echo "FAIL: distinct names"; fail=1; }
+
+[ $fail -eq 0 ] && echo "output dir names: OK"
+
+exit $fail
@@ -0,0 +1,48 @@
+#!/bin/bash
+# Tree archive of more files than the process may have open: old files are
+# listed once, not in every patch, and applying opens them only as needed.
+# usage: tests/treeFiles.sh [path to patch]
+set -u
+
+P=$(realpath "${1:-./patch}")
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+cd "$T"
+
+# 1500 files of 2 KB in three directories, every third one changed by 10 bytes.
+mkdir old
+head -c $((1500 * 2048)) /dev/urandom > all
+(cd old && split -a 3 -b 2048 ../all f)
+rm all
+
+for d in a b c; do mkdir old/$d; done
+i=0
+for f in old/f*; do mv $f old/$(printf 'abc' | cut -c $((i % 3 + 1)))/; i=$((i + 1)); done
+
+cp -r old new
+i=0
+for f in new/*/*; do
+    [ $((i % 3)) -eq 0 ] && printf '0123456789' | dd of=$f bs=1 seek=$((i % 2000)) conv=notrunc 2>/dev/null
+    i=$((i + 1))
+done
+
+fail=0
+treeSize=$(cat new/*/* | wc -c)
+
+for memory in "" "--max-memory=1M"; do
+    rm -rf out tree.fot
+
+    # fewer descriptors than files in the tree.
+    ( ulimit -n 256 && "$P" -cfq --tree $memory old new tree.fot > /dev/null &&
+        "$P" -afq --tree old out tree.fot > /dev/null ) && diff -r new out > /dev/null ||
+        { echo "FAIL: round trip ${memory:-default}"; fail=1; continue; }
+
+    size=$(stat -c %s tree.fot)
+
+    [ $size -lt $((treeSize / 10)) ] || { echo "FAIL: archive $size bytes for $treeSize bytes tree"; fail=1; }
+done
+
+[ $fail -eq 0 ] && echo "tree over descriptor limit: OK"
+
+exit $fail
@@ -0,0 +1,780 @@
+/* PatchMaker utility, Copyright (c) 1997-2020 Yuriy Yakimenko
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation.  No representations are made about the suitability of this
+ * software for any purpose.  It is provided "as is" without express or
+ * implied warranty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _MSC_VER
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm> // sort, min, max
+
+#include "common.h"
+#include "progArgs.h"
+#include "timeutil.h"
+#include "checksum.h"
+#include "blockIndex.h"
+#include "patchOps.h"
+#include "treeArchive.h"
+
+#ifndef _MSC_VER
+
+#define TREE_VERSION     2  // patches have no BASES section, old files list stands for it.
+#define TREE_COPY_BUFFER (1L << 20)
+
+// archive entry types.
+enum TreeEntryType
+{
+    ENTRY_UNCHANGED = 1,  // old file of the same path, as is.
+    ENTRY_COPY      = 2,  // old file of another path (renamed or copied).
+    ENTRY_PATCH     = 3,  // patch against all old files (listed once, in header).
+    ENTRY_RAW       = 4,  // new file stored as is (empty, or nothing to refer to).
+    ENTRY_DELETED   = 5   // old file not present in new tree.
+};
+
+#pragma pack(push,1)
+struct TreeHeader
+{
+    char     magic[3];     // "FOT"
+    uint8_t  version;
+    uint8_t  endianness;
+    uint8_t  reserved[3];
+    uint32_t oldCount;
+    uint32_t entryCount;
+};
+#pragma pack(pop)
+
+struct TreeFile
+{
+    std::string path;   // relative to tree root, '/' separated.
+    uint32_t size;
+    uint32_t checksum;
+    struct ftime time;
+
+    TreeFile () : size(0), checksum(0), time(ftime()) {}
+};
+
+// adds regular files under root/rel to files. returns zero on success.
+static int listTree (const std::string & root, const std::string & rel, std::vector<TreeFile> & files)
+{
+    std::string dirName = rel.empty() ? root : root + "/" + rel;
+
+    DIR *dir = opendir (dirName.c_str());
+
+    if (dir == NULL)
+    {
+        fprintf (stderr, "Could not read directory %s\n", dirName.c_str());
+        return -1;
+    }
+
+    int ret = 0;
+
+    for (struct dirent *item = readdir (dir); item && ret == 0; item = readdir (dir))
+    {
+        if (strcmp (item->d_name, ".") == 0 || strcmp (item->d_name, "..") == 0) continue;
+
+        std::string path = rel.empty() ? std::string (item->d_name) : rel + "/" + item->d_name;
+        std::string full = root + "/" + path;
+
+        struct stat st;
+
+        if (lstat (full.c_str(), &st) != 0)
+        {
+            fprintf (stderr, "Could not get status of %s\n", full.c_str());
+            ret = -1;
+        }
+        else if (S_ISDIR (st.st_mode))
+        {
+            if (0 != listTree (root, path, files)) ret = -1;
+        }
+        else if (S_ISREG (st.st_mode))
+        {
+            if ((unsigned long long)st.st_size > 0xFFFFFFFFULL)
+            {
+                fprintf (stderr, "File %s too large.\n", full.c_str());
+                ret = -1;
+                continue;
+            }
+
+            TreeFile file;
+            file.path = path;
+            file.size = (uint32_t)st.st_size;
+            files.push_back (file);
+        }
+        // links and special files are left out.
+    }
+
+    closedir (dir);
+
+    return ret;
+}
+
+// lists tree sorted by path, with CRC and time of every file. Nothing is written
+// into the tree, so no .fcc sidecars either. returns zero on success.
+static int scanTree (const char *root, bool paranoid, std::vector<TreeFile> & files)
+{
+    if (0 != listTree (root, "", files)) return -1;
+
+    std::sort (files.begin(), files.end(), [] (const TreeFile & a, const TreeFile & b) { return a.path < b.path; });
+
+    for (TreeFile & file : files)
+    {
+        std::string full = std::string (root) + "/" + file.path;
+
+        bool cached = false;
+
+        FILE *fp = fopen (full.c_str(), "rb");
+
+        if (fp == NULL || 0 != getftime (full.c_str(), &file.time) ||
+            0 != getFileChecksum (full.c_str(), fp, paranoid, file.checksum, cached, false))
+        {
+            if (fp) fclose (fp);
+            fprintf (stderr, "Could not read %s\n", full.c_str());
+            return -1;
+        }
+
+        fclose (fp);
+    }
+
+    return 0;
+}
+
+// copies len bytes from in to out. returns zero on success.
+static int copyData (FILE *in, FILE *out, unsigned long long len)
+{
+    std::vector<char> buffer (TREE_COPY_BUFFER);
+
+    while (len > 0)
+    {
+        size_t n = (size_t)(std::min)(len, (unsigned long long)TREE_COPY_BUFFER);
+
+        if (fread (buffer.data(), n, 1, in) != 1 || fwrite (buffer.data(), n, 1, out) != 1) return -1;
+
+        len -= n;
+    }
+
+    return 0;
+}
+
+// appends whole file to out, writing its length first. returns zero on success.
+static int appendFile (FILE *out, const char *filename)
+{
+    FILE *in = fopen (filename, "rb");
+
+    if (in == NULL) return -1;
+
+    fseek (in, 0L, SEEK_END);
+    uint64_t len = (uint64_t)ftell (in);
+    fseek (in, 0L, SEEK_SET);
+
+    int ret = (fwrite (&len, 8, 1, out) == 1) ? copyData (in, out, len) : -1;
+
+    fclose (in);
+
+    return ret;
+}
+
+static bool writeString (FILE *fp, const std::string & text)
+{
+    uint16_t len = (uint16_t)text.size();
+
+    return fwrite (&len, 2, 1, fp) == 1 && (len == 0 || fwrite (text.data(), len, 1, fp) == 1);
+}
+
+static bool readString (FILE *fp, std::string & text)
+{
+    uint16_t len = 0;
+
+    if (fread (&len, 2, 1, fp) != 1) return false;
+
+    text.resize (len);
+
+    return len == 0 || fread (&text[0], len, 1, fp) == 1;
+}
+
+// relative path must stay inside the tree.
+static bool isSafePath (const std::string & path)
+{
+    if (path.empty() || path[0] == '/') return false;
+
+    for (size_t start = 0; start <= path.size(); )
+    {
+        size_t end = path.find ('/', start);
+
+        if (end == std::string::npos) end = path.size();
+
+        std::string part = path.substr (start, end - start);
+
+        if (part.empty() || part == "." || part == "..") return false;
+
+        start = end + 1;
+    }
+
+    return true;
+}
+
+// creates directories leading to path. returns zero on success.
+static int makeParents (const std::string & path)
+{
+    for (size_t i = path.find ('/', 1); i != std::string::npos; i = path.find ('/', i + 1))
+    {
+        std::string dir = path.substr (0, i);
+
+        if (access (dir.c_str(), F_OK) != 0 && mkdir (dir.c_str(), 0755) != 0) return -1;
+    }
+
+    return 0;
+}
+
+// fills progArguments of patches against all non-empty old files of the tree.
+static void setBaseFiles (progArguments & pa, const char *root, const std::vector<TreeFile> & olds,
+            const std::vector<uint32_t> & base)
+{
+    pa.file1 = strdup ((std::string (root) + "/" + olds[base[0]].path).c_str());
+    pa.bases = (char **)calloc (base.size(), sizeof (char *));
+
+    for (size_t i = 1; i < base.size(); i++)
+    {
+        pa.bases[pa.baseCount++] = strdup ((std::string (root) + "/" + olds[base[i]].path).c_str());
+    }
+}
+
+struct TreeEntry
+{
+    uint8_t type;
+    uint32_t file;  // index of new file (old file for ENTRY_DELETED).
+    uint32_t old;   // source of ENTRY_UNCHANGED and ENTRY_COPY.
+};
+
+int createTreeArchive (const progArguments & args)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    if (access (args.file3, F_OK) == 0 && !args.flagForce)
+    {
+        printf ("File %s already exists. Use -f flag to overwrite.\n", args.file3);
+        return EXIT_SUCCESS;
+    }
+
+    std::vector<TreeFile> olds, news;
+
+    if (0 != scanTree (args.file1, args.flagParanoid, olds) || 0 != scanTree (args.file2, args.flagParanoid, news))
+    {
+        return EXIT_FAILURE;
+    }
+
+    std::map<std::string, uint32_t> oldByPath;
+    std::multimap<std::pair<uint32_t, uint32_t>, uint32_t> oldByContent;
+    std::set<std::string> newPaths;
+    std::vector<uint32_t> base;  // non-empty old files, all referred to as one.
+
+    for (uint32_t i = 0; i < olds.size(); i++)
+    {
+        oldByPath[olds[i].path] = i;
+        oldByContent.insert (std::make_pair (std::make_pair (olds[i].size, olds[i].checksum), i));
+
+        if (olds[i].size > 0) base.push_back (i);
+    }
+
+    for (const TreeFile & file : news) newPaths.insert (file.path);
+
+    std::vector<TreeEntry> entries;
+    std::vector<uint32_t> patched;  // new files needing patches.
+
+    for (uint32_t n = 0; n < news.size(); n++)
+    {
+        const TreeFile & file = news[n];
+        TreeEntry entry = { ENTRY_PATCH, n, 0 };
+
+        auto same = oldByPath.find (file.path);
+        auto range = oldByContent.equal_range (std::make_pair (file.size, file.checksum));
+
+        if (same != oldByPath.end() && olds[same->second].size == file.size && olds[same->second].checksum == file.checksum)
+        {
+            entry.type = ENTRY_UNCHANGED;
+            entry.old = same->second;
+        }
+        else if (range.first != range.second && file.size > 0)
+        {
+            // prefer old file gone from new tree, i.e. renamed one.
+            entry.type = ENTRY_COPY;
+            entry.old = range.first->second;
+
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                if (newPaths.count (olds[it->second].path) == 0) { entry.old = it->second; break; }
+            }
+        }
+        else if (file.size == 0 || base.empty())
+        {
+            entry.type = ENTRY_RAW;
+        }
+        else
+        {
+            patched.push_back (n);
+        }
+
+        entries.push_back (entry);
+    }
+
+    for (uint32_t i = 0; i < olds.size(); i++)
+    {
+        if (newPaths.count (olds[i].path) == 0)
+        {
+            TreeEntry entry = { ENTRY_DELETED, i, 0 };
+            entries.push_back (entry);
+        }
+    }
+
+    // changed files are patched in parallel against one index of all old files.
+    std::string tempDir = std::string (args.file3) + ".tmp";
+
+    if (!patched.empty())
+    {
+        progArguments pa;
+
+        setBaseFiles (pa, args.file1, olds, base);
+
+        pa.flagCreate = pa.flagForce = pa.flagQuiet = pa.flagNoSidecars = pa.flagNoBaseList = true;
+        pa.flagVerbose = args.flagVerbose;
+        pa.flagDiskIO = args.flagDiskIO;
+        pa.flagMaximizeCompression = args.flagMaximizeCompression;
+        pa.flagApprox = args.flagApprox;
+        pa.flagParanoid = args.flagParanoid;
+        pa.maxMemory = args.maxMemory;
+        pa.chunkHashSize = args.chunkHashSize;
+        pa.seekInterval = args.seekInterval;
+        pa.outputDir = strdup (tempDir.c_str());
+        pa.targets = (char **)calloc (patched.size(), sizeof (char *));
+        pa.patches = (char **)calloc (patched.size(), sizeof (char *));
+
+        for (uint32_t n : patched)
+        {
+            char name [32];
+            snprintf (name, sizeof (name), "/%u.foc", pa.targetCount);
+
+            pa.targets[pa.targetCount] = strdup ((std::string (args.file2) + "/" + news[n].path).c_str());
+            pa.patches[pa.targetCount++] = strdup ((tempDir + name).c_str());
+        }
+
+        pa.file2 = strdup (pa.targets[0]);
+
+        if (createPatch (pa) != EXIT_SUCCESS)
+        {
+            for (int t = 0; t < pa.targetCount; t++) remove (pa.patches[t]);
+            rmdir (tempDir.c_str());
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    FILE *fp3 = fopen (args.file3, "wb");
+
+    bool ok = (fp3 != NULL);
+
+    TreeHeader header;
+
+    memcpy (header.magic, "FOT", 3);
+    header.version = TREE_VERSION;
+    header.endianness = getEndianness();
+    memset (header.reserved, 0, sizeof (header.reserved));
+    header.oldCount = (uint32_t)olds.size();
+    header.entryCount = (uint32_t)entries.size();
+
+    ok = ok && fwrite (&header, sizeof (header), 1, fp3) == 1;
+
+    for (size_t i = 0; ok && i < olds.size(); i++)
+    {
+        ok = fwrite (&olds[i].size, 4, 1, fp3) == 1 && fwrite (&olds[i].checksum, 4, 1, fp3) == 1 &&
+             writeString (fp3, olds[i].path);
+    }
+
+    long counts [ENTRY_DELETED + 1] = { 0 };
+    uint32_t patchIndex = 0;
+
+    for (size_t i = 0; ok && i < entries.size(); i++)
+    {
+        const TreeEntry & entry = entries[i];
+        const TreeFile & file = (entry.type == ENTRY_DELETED) ? olds[entry.file] : news[entry.file];
+
+        ok = fwrite (&entry.type, 1, 1, fp3) == 1 && writeString (fp3, file.path);
+
+        if (entry.type == ENTRY_UNCHANGED || entry.type == ENTRY_COPY)
+        {
+            ok = ok && fwrite (&entry.old, 4, 1, fp3) == 1 && fwrite (&file.time, 5, 1, fp3) == 1;
+        }
+        else if (entry.type == ENTRY_RAW)
+        {
+            std::string full = std::string (args.file2) + "/" + file.path;
+
+            ok = ok && fwrite (&file.checksum, 4, 1, fp3) == 1 && fwrite (&file.time, 5, 1, fp3) == 1 &&
+                 0 == appendFile (fp3, full.c_str());
+        }
+        else if (entry.type == ENTRY_PATCH)
+        {
+            char name [32];
+            snprintf (name, sizeof (name), "/%u.foc", patchIndex++);
+
+            std::string patch = tempDir + name;
+
+            ok = ok && 0 == appendFile (fp3, patch.c_str());
+
+            remove (patch.c_str());
+        }
+
+        if (ok && args.flagVerbose)
+        {
+            const char *names[] = { "", "unchanged", "copied", "patched", "added", "deleted" };
+
+            if (entry.type == ENTRY_COPY) printf ("%s: copy of %s\n", file.path.c_str(), olds[entry.old].path.c_str());
+            else printf ("%s: %s\n", file.path.c_str(), names[entry.type]);
+        }
+
+        counts[entry.type]++;
+    }
+
+    for (; patchIndex < patched.size(); patchIndex++)
+    {
+        char name [32];
+        snprintf (name, sizeof (name), "/%u.foc", patchIndex);
+        remove ((tempDir + name).c_str());
+    }
+
+    if (!patched.empty()) rmdir (tempDir.c_str());
+
+    long archiveSize = ok ? ftell (fp3) : 0;
+
+    if (fp3 && fclose (fp3) != 0) ok = false;
+
+    if (!ok)
+    {
+        fprintf (stderr, "Read/write error\n");
+        remove (args.file3);
+        return EXIT_FAILURE;
+    }
+
+    if (!args.flagQuiet)
+    {
+        auto end = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+        printf ("%ld unchanged, %ld copied or renamed, %ld patched, %ld added, %ld deleted\n",
+                counts[ENTRY_UNCHANGED], counts[ENTRY_COPY], counts[ENTRY_PATCH], counts[ENTRY_RAW], counts[ENTRY_DELETED]);
+        printf ("Archive %s: %ld bytes, completed in %.2lf seconds\n", args.file3, archiveSize, 0.001 * duration.count());
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// file of new tree built from old file or patch after archive is read.
+struct TreeJob
+{
+    uint8_t type;
+    std::string path;   // output file.
+    std::string patch;  // extracted patch (ENTRY_PATCH).
+    uint32_t old;
+    struct ftime time;
+};
+
+// copies old file to output, checking its CRC. returns zero on success.
+static int copyOldFile (const std::string & from, const TreeJob & job, const TreeFile & old, bool ignoreTimestamps)
+{
+    FILE *in = fopen (from.c_str(), "rb");
+    FILE *out = in ? fopen (job.path.c_str(), "w+b") : NULL;
+
+    uint32_t checksum = 0;
+
+    int ret = (in && out && 0 == copyData (in, out, old.size) && 0 == getChecksum (out, checksum) &&
+               checksum == old.checksum) ? 0 : -1;
+
+    if (in) fclose (in);
+    if (out && fclose (out) != 0) ret = -1;
+
+    if (ret == 0 && !ignoreTimestamps && is_valid (&job.time)) setftime (job.path.c_str(), &job.time);
+
+    return ret;
+}
+
+int applyTreeArchive (const progArguments & args)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    AutoClose ac;
+
+    ac.fp3 = fopen (args.file3, "rb");
+
+    if (ac.fp3 == NULL)
+    {
+        fprintf (stderr, "Could not open file %s\n", args.file3);
+        return EXIT_FAILURE;
+    }
+
+    TreeHeader header;
+
+    if (fread (&header, sizeof (header), 1, ac.fp3) != 1 || memcmp (header.magic, "FOT", 3) != 0)
+    {
+        printf ("Not a tree archive: %s\n", args.file3);
+        return EXIT_FAILURE;
+    }
+
+    if (header.version == 0 || header.version > TREE_VERSION || header.endianness != getEndianness())
+    {
+        fprintf (stderr, "Archive version %d or endianness not supported.\n", (int)header.version);
+        return EXIT_FAILURE;
+    }
+
+    // every old file is checked once, patches then skip it.
+    std::vector<TreeFile> olds (header.oldCount);
+    std::vector<std::string> baseNames;
+    std::vector<uint32_t> baseSizes;
+
+    for (uint32_t i = 0; i < header.oldCount; i++)
+    {
+        TreeFile & old = olds[i];
+
+        if (fread (&old.size, 4, 1, ac.fp3) != 1 || fread (&old.checksum, 4, 1, ac.fp3) != 1 ||
+            !readString (ac.fp3, old.path) || !isSafePath (old.path))
+        {
+            fprintf (stderr, "Incomplete or corrupted archive\n");
+            return EXIT_FAILURE;
+        }
+
+        std::string full = std::string (args.file1) + "/" + old.path;
+
+        long size = 0;
+        uint32_t checksum = 0;
+        bool cached = false;
+
+        FILE *fp = fopen (full.c_str(), "rb");
+
+        if (fp == NULL || 0 != getftime (full.c_str(), &old.time, &size) || size != (long)old.size ||
+            0 != getFileChecksum (full.c_str(), fp, args.flagParanoid, checksum, cached, false) || checksum != old.checksum)
+        {
+            if (fp) fclose (fp);
+            fprintf (stderr, "Old file %s is missing or differs.\n", full.c_str());
+            return EXIT_FAILURE;
+        }
+
+        fclose (fp);
+
+        if (old.size > 0)
+        {
+            baseNames.push_back (full);
+            baseSizes.push_back (old.size);
+        }
+    }
+
+    // all patches refer to the same old files, opened as they are read.
+    BaseFiles bases;
+
+    if (!baseNames.empty()) bases.lazy (baseNames, baseSizes);
+
+    if (access (args.file2, F_OK) == 0 && !args.flagForce)
+    {
+        printf ("Directory %s already exists. Use -f flag to overwrite.\n", args.file2);
+        return EXIT_SUCCESS;
+    }
+
+    std::string root = args.file2;
+
+    if (0 != makeParents (root + "/") )
+    {
+        fprintf (stderr, "Could not create directory %s\n", args.file2);
+        return EXIT_FAILURE;
+    }
+
+    // archive is read in one pass: stored files are written right away, patches
+    // are extracted next to their output and applied in parallel afterwards.
+    std::vector<TreeJob> jobs;
+    long deleted = 0, added = 0;
+    bool ok = true;
+
+    for (uint32_t i = 0; ok && i < header.entryCount; i++)
+    {
+        TreeJob job;
+        std::string path;
+
+        job.type = 0;
+        job.old = 0;
+        job.time = ftime();
+
+        ok = fread (&job.type, 1, 1, ac.fp3) == 1 && readString (ac.fp3, path) && isSafePath (path);
+
+        job.path = root + "/" + path;
+
+        if (ok && job.type != ENTRY_DELETED && 0 != makeParents (job.path))
+        {
+            fprintf (stderr, "Could not create directory for %s\n", job.path.c_str());
+            return EXIT_FAILURE;
+        }
+
+        if (!ok) break;
+
+        if (job.type == ENTRY_UNCHANGED || job.type == ENTRY_COPY)
+        {
+            ok = fread (&job.old, 4, 1, ac.fp3) == 1 && job.old < header.oldCount && fread (&job.time, 5, 1, ac.fp3) == 1;
+
+            jobs.push_back (job);
+        }
+        else if (job.type == ENTRY_RAW)
+        {
+            uint32_t checksum = 0, actual = 0;
+            uint64_t len = 0;
+
+            ok = fread (&checksum, 4, 1, ac.fp3) == 1 && fread (&job.time, 5, 1, ac.fp3) == 1 && fread (&len, 8, 1, ac.fp3) == 1;
+
+            FILE *out = ok ? fopen (job.path.c_str(), "w+b") : NULL;
+
+            ok = out && 0 == copyData (ac.fp3, out, len) && 0 == getChecksum (out, actual) && actual == checksum;
+
+            if (out && fclose (out) != 0) ok = false;
+
+            if (ok && !args.flagIgnoreTimestamps && is_valid (&job.time)) setftime (job.path.c_str(), &job.time);
+
+            added++;
+        }
+        else if (job.type == ENTRY_PATCH)
+        {
+            uint64_t len = 0;
+
+            job.patch = job.path + ".foc.part";
+
+            ok = fread (&len, 8, 1, ac.fp3) == 1;
+
+            FILE *out = ok ? fopen (job.patch.c_str(), "wb") : NULL;
+
+            ok = out && 0 == copyData (ac.fp3, out, len);
+
+            if (out && fclose (out) != 0) ok = false;
+
+            jobs.push_back (job);
+        }
+        else if (job.type == ENTRY_DELETED)
+        {
+            if (args.flagVerbose) printf ("%s: deleted\n", path.c_str());
+
+            deleted++;
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+
+    if (!ok)
+    {
+        fprintf (stderr, "Incomplete or corrupted archive\n");
+
+        for (const TreeJob & job : jobs) if (!job.patch.empty()) remove (job.patch.c_str());
+
+        return EXIT_FAILURE;
+    }
+
+    std::vector<int> results (jobs.size(), 0);
+    std::atomic<size_t> next (0);
+
+    auto worker = [&] ()
+    {
+        for (size_t j = next++; j < jobs.size(); j = next++)
+        {
+            const TreeJob & job = jobs[j];
+
+            if (job.type != ENTRY_PATCH)
+            {
+                results[j] = copyOldFile (std::string (args.file1) + "/" + olds[job.old].path, job, olds[job.old],
+                                          args.flagIgnoreTimestamps);
+                continue;
+            }
+
+            progArguments pa;
+
+            pa.file1 = baseNames.empty() ? NULL : strdup (baseNames[0].c_str());
+            pa.file2 = strdup (job.path.c_str());
+            pa.file3 = strdup (job.patch.c_str());
+            pa.flagApply = pa.flagForce = pa.flagQuiet = pa.flagBasesVerified = pa.flagNoSidecars = true;
+            pa.flagIgnoreTimestamps = args.flagIgnoreTimestamps;
+            pa.sharedBases = &bases;
+
+            results[j] = (!baseNames.empty() && applyPatch (pa) == EXIT_SUCCESS) ? 0 : -1;
+
+            remove (job.patch.c_str());
+        }
+    };
+
+    int threadCount = (int)(std::min)((size_t)(std::max)(1U, std::thread::hardware_concurrency()), jobs.size());
+
+    std::vector<std::thread> threads;
+
+    for (int t = 1; t < threadCount; t++) threads.push_back (std::thread (worker));
+
+    worker ();
+
+    for (auto & th : threads) th.join();
+
+    long failed = 0, patched = 0;
+
+    for (size_t j = 0; j < jobs.size(); j++)
+    {
+        if (results[j] != 0)
+        {
+            failed++;
+            fprintf (stderr, "%s: failed\n", jobs[j].path.c_str());
+        }
+        else if (jobs[j].type == ENTRY_PATCH)
+        {
+            patched++;
+        }
+
+        if (args.flagVerbose && results[j] == 0)
+        {
+            printf ("%s: %s\n", jobs[j].path.c_str(), jobs[j].type == ENTRY_PATCH ? "patched" : "copied");
+        }
+    }
+
+    if (failed == 0 && !args.flagQuiet)
+    {
+        auto end = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+        printf ("%ld copied, %ld patched, %ld added, %ld deleted in %.2lf seconds\n",
+                (long)jobs.size() - patched, patched, added, deleted, 0.001 * duration.count());
+        printf ("Tree successfully built.\n");
+    }
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#else
+
+int createTreeArchive (const progArguments &)
+{
+    fprintf (stderr, "--tree is not supported on this platform\n");
+    return EXIT_FAILURE;
+}
+
+int applyTreeArchive (const progArguments &)
+{
+    fprintf (stderr, "--tree is not supported on this platform\n");
+    return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "progArgs.h"
+
+// Tree archive: patch of a whole directory tree against another one in a single
+// file. Files are matched by path and by content (size and CRC), so unchanged,
+// renamed and copied files take a few bytes. All old files form one base, so
+// patches of changed files refer to any of them.
+
+// creates archive args.file3 which turns old directory args.file1 into new
+// directory args.file2. returns EXIT_SUCCESS or EXIT_FAILURE.
+int createTreeArchive (const progArguments & args);
+
+// builds new directory args.file2 from old directory args.file1 and archive
+// args.file3. returns EXIT_SUCCESS or EXIT_FAILURE.
+int applyTreeArchive (const progArguments & args);